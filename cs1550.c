@@ -13,9 +13,23 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
-
-//size of a disk block
-#define	BLOCK_SIZE 512
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "cs1550.h"
+
+//Block sizes an image can have, powers of two. The block structures below
+//are laid out for the largest; a block on disk is the first BLOCK_SIZE bytes
+//of one.
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define DEFAULT_BLOCK_SIZE 512
 
 //we'll use 8.3 filenames
 #define	MAX_FILENAME 8
@@ -23,1000 +37,6098 @@
 #define DISKFILE ".disk"
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
-#define USED 1		//Used for FAT
-#define UNUSED 0	//Used for FAT
+#define USED 1		//Used for the allocation bitmaps
+#define UNUSED 0	//Used for the allocation bitmaps
 #define DEBUG 0		//Debugger
 
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+//One run of contiguous blocks of a file
+struct cs1550_extent
+{
+	long start;		//First block of the run
+	int count;		//Number of blocks in the run
+} __attribute__((packed));
+
+//Runs kept in the directory entry itself, the rest go in an extent block
+#define INLINE_EXTENTS 2
+
+//How many entries can there be in a directory block of the largest size?
+#define DIR_FILES_MAX ((MAX_BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + 1 + sizeof(size_t) + sizeof(long) + INLINE_EXTENTS * sizeof(struct cs1550_extent) + sizeof(long)))
+
+//Index entries in an index block of the largest size
+#define INDEX_ENTRIES_MAX ((MAX_BLOCK_SIZE - 3 * sizeof(int)) / (sizeof(unsigned int) + sizeof(long)))
+
+//Blank images formatted at mount get the size of the image file, cs1550_mkfs
+//makes new ones this large unless told otherwise
+#define DEFAULT_VOLUME_BYTES 5000000
+
+/*
+ * Geometry of the mounted image, from its superblock. Everything that used to
+ * be a constant derived from the block size lives here, and the macros below
+ * keep their old names, so they read like constants but change with the
+ * image. Set by geo_setup() before anything else touches the disk.
+ */
+struct cs1550_geometry
+{
+	int block_size;
+	int block_shift;		//log2 of block_size
+	long num_blocks;
+	int files_per_dir;		//Entries in a leaf block of a directory
+	int index_entries;		//Entries in an index block of a directory
+	int extents_per_block;
+	int group_shift;		//log2 of the blocks in an allocation group
+	long groups;
+	long table_blocks;		//Blocks of the group table
+	long super_blocks;		//Blocks holding the two superblock slots
+	long copy_blocks;
+	long journal_start;
+	long first_dir_block;
+	long first_file_block;
+};
+
+struct cs1550_geometry geo;
 
-//Total available space/ number of blocks = Free blocks
-#define MAX_NUM_BLOCKS (5000000/BLOCK_SIZE)
+#define BLOCK_SIZE (geo.block_size)
+#define MAX_NUM_BLOCKS (geo.num_blocks)
+#define MAX_FILES_IN_DIR (geo.files_per_dir)
+#define MAX_INDEX_ENTRIES (geo.index_entries)
+
+//Calls fn(args..., bs) with the block size as a constant for the common
+//sizes, so the per-block arithmetic and copies in the data paths compile
+//to shifts and fixed-size moves. fn is written once, always inlined.
+#define BLOCK_SIZE_DISPATCH(fn, ...) \
+	(BLOCK_SIZE == 4096 ? fn(__VA_ARGS__, 4096) : BLOCK_SIZE == 512 ? fn(__VA_ARGS__, 512) : fn(__VA_ARGS__, BLOCK_SIZE))
 
 //Global Variables
-char directory[MAX_FILENAME + 1];
-char filename[MAX_FILENAME + 1];
-char extension[MAX_EXTENSION + 1];
+char disk_path[PATH_MAX] = DISKFILE;	//Absolute path of the disk image, resolved in main()
+int disk_fd = -1;			//Descriptor of the disk image, open from init until destroy
+
+#define BCACHE_DEFAULT_BLOCKS 1024
+#define READAHEAD_MAX_BLOCKS 128
+#define DIRTY_DEFAULT_KB 4096
+#define DIRTY_DEFAULT_AGE 5
+
+//Levels of options.log_level, each including the ones above it
+#define LOG_OFF 0
+#define LOG_ERR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+#define LOG_DEFAULT_LEVEL LOG_WARN
+
+struct cs1550_options options = { BCACHE_DEFAULT_BLOCKS, READAHEAD_MAX_BLOCKS, DIRTY_DEFAULT_KB, DIRTY_DEFAULT_AGE, LOG_DEFAULT_LEVEL };
+
+#ifndef CS1550_LIBRARY
+#define CS1550_OPT(t, p) { t, offsetof(struct cs1550_options, p), 1 }
+
+static struct fuse_opt cs1550_opts[] = {
+	CS1550_OPT("cache_blocks=%lu", cache_blocks),
+	CS1550_OPT("readahead=%lu", readahead),
+	CS1550_OPT("dirty_kb=%lu", dirty_kb),
+	CS1550_OPT("dirty_age=%lu", dirty_age),
+	CS1550_OPT("log_level=%lu", log_level),
+	FUSE_OPT_END
+};
+#endif
+
+//A path walked down to its last component: the directory holding it and
+//its name split 8.3 style. Each handler walks into its own copy so
+//concurrent requests never share walk state.
+struct cs1550_path
+{
+	long parent;						//First block of the directory holding it, -1 for "/" itself
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+};
+
+/*
+ * Locking model, so fuse_main can run multithreaded:
+ *   meta_lock   the shape of the tree, which directories there are and
+ *               where; write-locked by mkdir/rmdir/rename, read-locked by
+ *               every other handler for the whole request
+ *   dir_locks   contents of one directory, the root too, all its leaf and
+ *               index blocks, striped by its first block; write-locked by
+ *               mknod/unlink/write, read-locked otherwise. A path walk
+ *               holds each directory's lock only while it looks in it.
+ *   commit_lock one journal commit at a time, and committed_seq
+ *   txn_lock    read-locked by an operation from its first metadata change
+ *               to its commit, write-locked by the commit that logs them
+ *   file_lock   the open file table, the refs of each file and dirty_pages;
+ *               a file's pages and size are covered by its directory's lock
+ *   alloc_lock  the group table and bitmaps, the group cache, free_hint
+ *               and the free and reserved counts
+ *   jnl_lock    the images of the running transaction
+ *   index_lock  the name index
+ * Locks are always taken in that order. Disk I/O needs no lock since it is
+ * all positioned pread/pwrite on disk_fd.
+ */
+#define DIR_LOCK_STRIPES 64
+pthread_rwlock_t meta_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t dir_locks[DIR_LOCK_STRIPES];
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t txn_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t jnl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Directories. A directory starts out as a single leaf block listing its
+ * entries. When a leaf is full it is split in two by the hash of the names,
+ * and the directory's first block becomes the root of an index: a sorted
+ * list of (lowest hash, block) pairs, each covering the names hashing from
+ * its hash up to the next one. A full index block is split the same way,
+ * the root growing a level when it fills, up to DIR_MAX_LEVELS levels. A
+ * lookup reads one block per level and the leaf, whatever the size of the
+ * directory. Names with the same hash always share a leaf. Leaves are not
+ * merged again when entries go away.
+ *
+ * The root directory is one of these too, at FIRST_DIR_BLOCK. Any
+ * directory holds files and subdirectories, to any depth.
+ */
+#define DIR_INDEX_MARK -1		//nFiles of an index block, never a leaf's
+#define DIR_MAX_LEVELS 3		//Index levels above the leaves
+
+#define ENTRY_FILE 0
+#define ENTRY_DIR 1
 
 //The attribute packed means to not align these things
 struct cs1550_directory_entry
 {
 
-	int nFiles;	//How many files are in this directory.
+	int nFiles;	//How many entries are in this leaf.
 				//Needs to be less than MAX_FILES_IN_DIR
 
 	struct cs1550_file_directory
 	{
 		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
 		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
+		unsigned char ftype;			//ENTRY_FILE or ENTRY_DIR
 		size_t fsize;					//file size
-		long nStartBlock;				//where the first block is on disk
-	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
-
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+		long nStartBlock;				//where the first block is on disk, a directory's first block
+		struct cs1550_extent extents[INLINE_EXTENTS];	//first runs of the file, unused ones have count 0
+		long nExtentBlock;				//block holding the remaining runs, 0 if none
+	} __attribute__((packed)) files[DIR_FILES_MAX];	//There is an array of these
+
+	//This is some space to get this to be exactly the size of the largest
+	//disk block. Don't use it for anything.
+	char padding[MAX_BLOCK_SIZE - DIR_FILES_MAX * sizeof(struct cs1550_file_directory) - sizeof(int)];
 } ;
 
-typedef struct cs1550_root_directory cs1550_root_directory;
-
-struct cs1550_root_directory root_block;
-
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
-
-struct cs1550_root_directory
+struct cs1550_index_block
 {
-	int nDirectories;	//How many subdirectories are in the root
-						//Needs to be less than MAX_DIRS_IN_ROOT
-	struct cs1550_directory
+	int nFiles;		//DIR_INDEX_MARK
+	int nLevels;	//Index levels below this one, 0 when the entries are leaves
+	int nEntries;
+
+	struct cs1550_index_entry
 	{
-		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
-		long nStartBlock;				//where the directory block is on disk
-	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
+		unsigned int hash;		//Lowest hash of the names below, the first entry's is the block's own lowest
+		long block;
+	} __attribute__((packed)) entries[INDEX_ENTRIES_MAX];	//Sorted by hash
 
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+	//This is some space to get this to be exactly the size of the largest
+	//disk block. Don't use it for anything.
+	char padding[MAX_BLOCK_SIZE - INDEX_ENTRIES_MAX * sizeof(struct cs1550_index_entry) - 3 * sizeof(int)];
 } ;
 
-//Block nStartBlock[0] used for root block
-//Block nStartBlock[1] used for FAT
-//If nStartBlock = 1 is used, nStartBlock = 0 is unused
+//Overflow runs of a file with more than INLINE_EXTENTS of them
+#define BLOCK_EXTENTS_MAX ((MAX_BLOCK_SIZE - sizeof(int)) / sizeof(struct cs1550_extent))
+#define EXTENTS_PER_BLOCK (geo.extents_per_block)
 
+struct cs1550_extent_block
+{
+	int nExtents;	//How many runs follow the inline ones
+	struct cs1550_extent extents[BLOCK_EXTENTS_MAX];
 
-struct cs1550_FAT_buf{
-	int nStartBlock[MAX_NUM_BLOCKS];	//Array of 5000K/512 possible blocks
-}FAT_buf;
+	//This is some space to get this to be exactly the size of the largest
+	//disk block. Don't use it for anything.
+	char padding[MAX_BLOCK_SIZE - BLOCK_EXTENTS_MAX * sizeof(struct cs1550_extent) - sizeof(int)];
+} ;
 
-//Function Prototypes
-int get_root_block(struct cs1550_root_directory *);
-int write_root_block(struct cs1550_root_directory);
-int get_FAT_block(struct cs1550_FAT_buf *);
-int write_FAT_block(struct cs1550_FAT_buf);
-int get_free_nStartBlock(struct cs1550_FAT_buf *, int file_flag);
+//All runs of one file, gathered from its entry and its extent block
+#define MAX_EXTENTS (INLINE_EXTENTS + EXTENTS_PER_BLOCK)
 
-typedef struct cs1550_directory_entry cs1550_directory_entry;
+struct extent_map
+{
+	int n;
+	long blocks;	//Total blocks in all runs
+	struct cs1550_extent ext[INLINE_EXTENTS + BLOCK_EXTENTS_MAX];
+};
 
-//How much data can one block hold?
-#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE)
+//Bytes of a map up to its last run, what copying one needs
+#define EXTENT_MAP_SIZE(m) (offsetof(struct extent_map, ext) + (m)->n * sizeof(struct cs1550_extent))
 
+//New files start in a free run at least this long when there is one
+#define NEW_FILE_RUN 16
 
-struct cs1550_disk_block
+//Bytes 0 to 2 * SUPER_SLOT_SIZE - 1 used for the two superblock slots
+//Blocks TABLE_COPY(c) onwards used for copy c of the group table and bitmaps
+//Blocks JOURNAL_START to FIRST_DIR_BLOCK - 1 used for the metadata journal
+//Block FIRST_DIR_BLOCK holds the first block of the root directory
+//Blocks FIRST_FILE_BLOCK onwards hold files, extent blocks and the rest of the directories
+//Files are mapped by their extents, the bitmaps only record which blocks are in use
 
+/*
+ * Free space. The volume is split into allocation groups of BLOCK_SIZE * 8
+ * blocks, each described by one bitmap block (set = in use). A copy holds a
+ * group table with the free count of every group and the checksum of its
+ * bitmap in that copy, then the bitmaps. The table is resident; a group's
+ * bitmap is read from the current copy the first time an allocation or free
+ * touches it, and clean ones are dropped again when more than
+ * GROUP_CACHE_BYTES are loaded. Searches skip full groups on their count
+ * alone, so memory and allocation time follow the groups in use rather than
+ * the size of the volume.
+ */
+struct cs1550_group
 {
-	//All of the space in the block can be used for actual data
-	//storage.
-	char data[MAX_DATA_IN_BLOCK];
+	unsigned int nFree;		//Free blocks in the group
+	unsigned int checksum;	//FNV-1a over the group's bitmap block
 };
 
-typedef struct cs1550_disk_block cs1550_disk_block;
+#define GROUP_SHIFT (geo.group_shift)
+#define GROUP_BLOCKS (1L << GROUP_SHIFT)
+#define NUM_GROUPS (geo.groups)
+#define TABLE_BLOCKS (geo.table_blocks)
+#define GROUPS_PER_TABLE_BLOCK ((long)(BLOCK_SIZE / sizeof(struct cs1550_group)))
+#define GROUP_CACHE_BYTES (4L << 20)
+#define GROUP_IO_BLOCKS 64		//Bitmaps a commit writes with one request
+
+struct cs1550_group *group_table = NULL;	//NUM_GROUPS entries, TABLE_BLOCKS blocks long
+unsigned int *table_sums = NULL;			//Checksum of each table block
+uint64_t **group_maps = NULL;				//Loaded bitmaps, NULL if not loaded
+long *loaded_groups = NULL;					//Groups with a loaded bitmap
+long groups_loaded = 0;
+long group_clock = 0;						//Where eviction looks next in loaded_groups
+char *group_io = NULL;						//GROUP_IO_BLOCKS blocks for commits
 
-int get_root_block(struct cs1550_root_directory *root_block){
-	FILE *fd;
-	fd = fopen(DISKFILE, "r+b");
-	if(fd == NULL){
-		printf("Error: Unable to open disk: %s\n", DISKFILE);
-		return -ENOENT;		//File not found
-	}
-	fread(root_block, BLOCK_SIZE, 1, fd);
-	fclose(fd);
-	return 0;
-}
-int write_root_block(struct cs1550_root_directory root_block){
-	int i = 0;
-	FILE *fd = fopen(DISKFILE, "r+b");			//Open disk for writing binary
-	if(fd == NULL){
-		printf("Error: Unable to open disk: %s\n", DISKFILE);
-		return -ENOENT;		//File not found
-	}
+/*
+ * Shadow paging for the free space. There are two copies, each the group
+ * table and the bitmaps, and a superblock slot for each. A commit
+ * writes the copy that is not current, waits for it, then writes that
+ * copy's slot with the next generation number, which is the moment the
+ * commit takes effect. Mount picks the valid slot with the highest
+ * generation, so a torn write only ever costs the commit it belonged to.
+ * Generation g lives in slot and copy g % 2.
+ */
+#define SUPER_MAGIC 0x53353530u	//"S550"
+#define SUPER_SLOT_SIZE 512		//Slot i is at byte i * SUPER_SLOT_SIZE whatever the block size
+#define SUPER_BLOCKS (geo.super_blocks)
+#define COPY_BLOCKS (geo.copy_blocks)
+#define TABLE_COPY(c) (SUPER_BLOCKS + (long)(c) * COPY_BLOCKS)
+#define BITMAP_COPY(c, g) (TABLE_COPY(c) + TABLE_BLOCKS + (g))
+
+//Layout version in the superblock. Version 0, with one FAT entry of an int
+//per block, had no field and reads as 0; version 1 had a one block root and
+//one block subdirectories.
+#define SUPER_VERSION 2
+
+struct cs1550_superblock
+{
+	unsigned int magic;
+	unsigned int checksum;			//FNV-1a over this slot with this field 0
+	unsigned long generation;		//Bumped by every commit
+	unsigned int copy_checksum;		//FNV-1a over the group table of this copy
+	int journal_blocks;				//Images in journal record generation, 0 if none
+
+	//Geometry of the image. The block size and number of blocks decide the
+	//rest, which is recorded to catch an image from an incompatible build.
+	int block_size;
+	long num_blocks;
+	long table_blocks;
+	long journal_start;
+	long first_dir_block;
+	unsigned int version;
+
+	char padding[SUPER_SLOT_SIZE - 5 * sizeof(unsigned int) - sizeof(unsigned long) - 2 * sizeof(int) - 4 * sizeof(long)];
+} ;
 
-	if(DEBUG)printf("In write_root_block(), Number of directories %d\n", root_block.nDirectories);
-	for(i = 0; i < root_block.nDirectories; i++){
-		if(DEBUG)printf("In write_root_block(), Directory = %s\n", root_block.directories[i].dname);
-		if(DEBUG)printf("nStartBlock = %ld\n", root_block.directories[i].nStartBlock);
-	}
-	i = fwrite(&root_block, BLOCK_SIZE, 1, fd);
-	if(DEBUG)printf("In write_root_block, blocks returned: i = %d\n", i);
-	fclose(fd);
-	return 0;
-}
+//Generation of the current slot and copy
+unsigned long sb_generation = 0;
 
+/*
+ * Metadata journal for directory and extent blocks, after the two copies.
+ * It is split in two halves, record g of commit generation g going in half
+ * g % 2: a header block listing the home block of every image, then the
+ * images. At mount the record named by the current superblock is written
+ * home again if its checksum over the header and all images matches.
+ */
+#define JOURNAL_MAGIC 0x31353530u	//"1550"
+#define JOURNAL_MAX_IMAGES 60
 
-int get_FAT_block(struct cs1550_FAT_buf *FAT_block){
-	FILE *fd;
-	fd = fopen(DISKFILE, "r+b");
-	if(fd == NULL){
-		printf("Error: Unable to open file in get_FAT_block: %s\n", DISKFILE);
-		return -ENOENT;		//File not found
-	}
-	fseek(fd, 1*BLOCK_SIZE, SEEK_SET);	//Go to second block
-	fread(FAT_block, BLOCK_SIZE, 1, fd);
-	fclose(fd);
-	return 0;
-}
+struct cs1550_journal_header
+{
+	unsigned int magic;
+	unsigned int checksum;			//FNV-1a over the record with this field 0
+	unsigned long seq;				//Generation of the commit
+	int nBlocks;					//Images following this block
+	long blocks[JOURNAL_MAX_IMAGES];	//Home block of each image, the rest of the block is zero
+} ;
 
-int write_FAT_block(struct cs1550_FAT_buf FAT_block){
-	FILE *fd = fopen(DISKFILE, "r+b");			//Open disk for writing binary
-	if(fd == NULL){
-		printf("Error: Unable to open disk for FAT block write: %s\n", DISKFILE);
-		return -ENOENT;		//File not found
-	}
-	fseek(fd, 1*BLOCK_SIZE, SEEK_SET);
-	fwrite(&FAT_block, BLOCK_SIZE, 1, fd);
-	fclose(fd);
-	return 0;
-}
+#define JOURNAL_START (geo.journal_start)
+#define JOURNAL_HALF_BLOCKS (1 + JOURNAL_MAX_IMAGES)
+#define JOURNAL_BLOCKS (2 * JOURNAL_HALF_BLOCKS)
+
+//Directory and extent block images a transaction can hold, and the most of
+//them one operation logs: two for most, more to add an entry to a directory,
+//which may split a leaf and an index block on every level
+#define JOURNAL_TABLE_SIZE JOURNAL_MAX_IMAGES
+#define JOURNAL_TXN_BLOCKS 2
+#define DIR_TXN_BLOCKS (2 * DIR_MAX_LEVELS + 4)
+
+//The root directory comes first after the journal, everything else after it
+#define FIRST_DIR_BLOCK (geo.first_dir_block)
+#define FIRST_FILE_BLOCK (geo.first_file_block)
+
+//Smallest volume: room for a few files after the metadata
+#define MIN_FILE_BLOCKS 16
+
+//Groups whose bitmap a copy lacks, as a flag per group and a list. Only
+//these, and the table blocks describing them, are written at the commit point.
+unsigned char *group_dirty[2] = {NULL, NULL};
+long *dirty_groups[2] = {NULL, NULL};
+long ndirty_groups[2] = {0, 0};
+
+//Running transaction: the latest image of each directory and extent block
+//changed since the last commit. Reads look here before the block cache.
+//Each entry keeps its own data buffer, entries are swapped and never copied.
+struct journal_image
+{
+	long block;
+	char *data;
+};
 
-int get_free_nStartBlock(struct cs1550_FAT_buf *FAT_block, int file_flag){
-	get_FAT_block(FAT_block);
-	int i = 2 //Skip blocks 0 and 1 (root and FAT)
-;
-        if ( file_flag ==1)
-        {
-          i = MAX_DIRS_IN_ROOT; // For files start blcoks after possible directories blocks
-        }
-	for(; i < MAX_NUM_BLOCKS; i++){	//Skip blocks 0 and 1 (root and FAT)
-		if(FAT_block->nStartBlock[i] == UNUSED){
-			FAT_block->nStartBlock[i] = USED;	//Set to used
-			return i;			//Return block number
-		}
-	}
+struct journal_image jnl_images[JOURNAL_TABLE_SIZE];
+char *jnl_data = NULL;				//Buffers of jnl_images
+char *jnl_record = NULL;			//Record being committed or replayed
+int jnl_count = 0;
+int jnl_reserved = 0;				//Images promised to operations between txn_begin() and their commit
+__thread int txn_blocks = 0;		//Of those, what the calling thread's operation promised
+unsigned long txn_seq = 1;			//Transaction operations are joining now
+unsigned long committed_seq = 0;	//Last transaction committed
+int commit_res = 0;					//Result of that commit
+unsigned long jnl_commits = 0;
+unsigned long jnl_ops = 0;
+
+//Words in a bitmap of every block of the volume, as fsck keeps
+#define FREE_MAP_WORDS ((MAX_NUM_BLOCKS + 63) / 64)
+
+//Rotating next-free hints, one for directory blocks and one for file blocks
+long free_hint[2] = {0, 0};
+
+//Free blocks in the file region, and how many of them buffered writes have
+//promised to files that have not been given their blocks yet
+long free_count = 0;
+long reserved_count = 0;
+
+//In-memory name index, the dentry cache of the path walk: (directory start
+//block, name, extension) -> type, leaf, slot and start block, or that there
+//is no such name. Entries are added as names are looked up and kept up to
+//date by the handlers and leaf splits, so walking a deep path a second
+//time takes one probe per component and reads nothing. A file's slot is
+//still checked against its leaf before it is used. Past NAME_INDEX_MAX
+//entries a new one takes the place of the least recently used in its
+//bucket.
+#define NAME_INDEX_BUCKETS 16384
+#define NAME_INDEX_MAX 65536
+#define ENTRY_NONE 0xff				//Name index only: known not to exist
+
+struct name_index_entry
+{
+	long dir_block;					//First block of the directory holding the entry
+	char name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+	unsigned char ftype;			//ENTRY_FILE, ENTRY_DIR or ENTRY_NONE
+	long leaf;						//Leaf block holding the entry
+	int slot;						//Index into the leaf's files[]
+	long nStartBlock;				//Block the entry points to
+	struct name_index_entry *next;
+};
 
-	
-	return -1;	//Return -1 if unable to find any free blocks
-}
+struct name_index_entry *name_index[NAME_INDEX_BUCKETS];
+long name_index_count = 0;
+
+//Bumped by rmdir and rename so open handles look their file up by path again
+unsigned long dir_generation = 0;
+
+//Bumped by truncate when it takes runs away, which may make cursors wrong
+unsigned long extent_trims = 0;
+
+//Last run used in a file: run number extent starts at block number index
+//of the file and at physical block block
+struct extent_cursor
+{
+	long start;		//nStartBlock of the file the cursor belongs to
+	long index;
+	int extent;
+	long block;
+	unsigned long trims;	//extent_trims when the cursor was set
+};
 
 /*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not. 
- *
- * man -s 2 stat will show the fields of a stat structure
+ * Write-back cache. Every open file has one in-core cs1550_file shared by
+ * all its handles, holding the blocks written since the last write back as
+ * whole-block dirty pages sorted by position. Writes only fill pages and
+ * reserve the blocks they will need; the blocks are allocated, all in one
+ * go, when the pages are written out. That happens in offset order,
+ * adjacent pages in a single request, by flush, fsync and release,
+ * when dirty_pages passes options.dirty_kb, or by the writeback thread once
+ * they are older than options.dirty_age.
  */
-static int cs1550_getattr(const char *path, struct stat *stbuf)
+struct dirty_page
 {
-	int i = 0;
-	int res = 0;
+	long index;					//Block number within the file
+	struct dirty_page *prev;
+	struct dirty_page *next;
+	char data[];				//BLOCK_SIZE bytes
+};
 
-	strcpy(filename, "");
-	strcpy(directory, "");
-	strcpy(extension, "");
+struct cs1550_file
+{
+	long dir_block;				//Directory block holding the entry
+	char fname[MAX_FILENAME + 1];
+	char fext[MAX_EXTENSION + 1];
+	int refs;					//Handles, plus the writeback thread while it flushes
+	int unlinked;				//Dropped from open_files by unlink
+	size_t size;				//Size including data not written back yet
+	long reserved;				//Blocks reserved for the pages past the file's last block
+	struct dirty_page *pages;	//Sorted by index
+	struct dirty_page *hint;	//Page the last write ended in
+	long npages;
+	time_t dirty_since;			//When the oldest dirty page was made, 0 if clean
+	struct cs1550_file *next;
+};
 
-	if(DEBUG)printf("In getattr\n");
+#define WRITEBACK_RUN_BLOCKS 64	//Largest run written back with one request
 
-	memset(stbuf, 0, sizeof(struct stat));
-	
-   	struct cs1550_directory current_dir;
+struct cs1550_file *open_files = NULL;
+unsigned long dirty_pages = 0;		//Dirty pages of all files
+int wb_stop = 0;
+int wb_started = 0;
+pthread_t wb_thread;
+pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
 
-	if(strlen(path) != 1){ //Check if the input is anything but the root
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	}
+//Per-open state kept in fi->fh, so read and write skip the path lookup
+struct cs1550_handle
+{
+	long dir_block;					//First block of the directory holding the entry
+	long leaf;						//Leaf block holding the entry
+	int slot;						//Index into the leaf's files[], rechecked on every use
+	unsigned long dir_generation;	//dir_generation when the file was opened
+	char fname[MAX_FILENAME + 1];
+	char fext[MAX_EXTENSION + 1];
+	pthread_mutex_t lock;			//Guards cursor and the readahead state
+	struct extent_cursor cursor;
+	off_t ra_next;					//Offset a sequential read would start at
+	long ra_window;					//Blocks to read ahead, 0 while access looks random
+	long ra_end;					//Block of the file readahead has been queued up to
+	struct cs1550_file *file;		//Shared in-core file, NULL when writing through
+	char *stats;					//Snapshot of the stats file, NULL for other files
+	size_t stats_len;
+};
 
-	if(DEBUG)printf("---PATH--- [%s] directory: [%s], filename: [%s], extension: [%s]\n", path, directory, filename, extension);
-	//Check if any names exceed the character limit
-	if(strlen(directory) > MAX_FILENAME || strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION){
-		if(DEBUG)printf("Input too long\n");
-		return -ENAMETOOLONG;
-	}
+/*
+ * Block buffer cache for directory and data blocks. A fixed pool of buffers
+ * allocated at mount, found through a hash on the block number and recycled
+ * in LRU order. Writes go through to the disk so a buffer is never dirty.
+ * The group table does not go through it since it is resident anyway, and
+ * bitmaps are kept by the group cache.
+ */
+#define BUF_EMPTY 0		//Not holding any block
+#define BUF_LOADING 1	//Being read from disk, wait on bcache_cond
+#define BUF_VALID 2
 
-	//is path the root dir?
-	//No more work required, return 0
+struct bcache_buf
+{
+	long block;
+	int state;
+	int prefetched;				//Loaded by readahead and not read yet
+	struct bcache_buf *prev;	//LRU list, most recently used first
+	struct bcache_buf *next;
+	struct bcache_buf *hnext;	//Hash chain
+	char *data;					//BLOCK_SIZE bytes in bcache_data
+};
 
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		return 0;
-	}
-	strcpy(current_dir.dname, "");	//Initialize the current directory
-	current_dir.nStartBlock = -1;
-	if(get_root_block(&root_block) != 0){
-		if(DEBUG)printf("Unable to get root block\n");
-		return -ENOENT;
-	}
-	//Check for directory being passed
-	for(i = 0; i < root_block.nDirectories; i++){
-                if(DEBUG)printf("Checking Directory %s\n", root_block.directories[i].dname);
-		if(strcmp(root_block.directories[i].dname, directory) == 0){
-				if(DEBUG)printf("Directory %s found\n", root_block.directories[i].dname);
-                                if(DEBUG)printf("nStartBlock %ld\n", root_block.directories[i].nStartBlock);
-				break; //Found directory
-		}
-	}
-		
-	if( i >= root_block.nDirectories){
-		printf("Directory not found\n");
-		res = -ENOENT;
-		return res;
-	}
-        
-	current_dir = root_block.directories[i];
+struct bcache_buf *bcache_bufs;
+char *bcache_data;
+struct bcache_buf **bcache_hash;
+unsigned long bcache_nbufs = 0;
+unsigned long bcache_nhash = 0;
+struct bcache_buf bcache_lru;	//List head, bcache_lru.next is the most recent
+pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;
+unsigned long bcache_hits = 0;
+unsigned long bcache_misses = 0;
+unsigned long bcache_wseq = 0;		//Bumped when a write starts, see cache_prefetch()
+unsigned long bcache_writing = 0;	//Writes between their cache update and the disk
 
-	//Check if name is subdirectory
-	if(strcmp(filename, "") == 0){		//No file, only empty subdir 
-		//Might want to return a structure with these fields
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		res = 0; //no error
-		return res;
-	}
-	if(DEBUG)printf("Checking if regular file\n");
+/*
+ * Readahead. read() notices when a handle keeps reading where it left off
+ * and queues the physical runs ahead of it; a worker thread loads them into
+ * the block cache so the next requests hit. The window doubles from
+ * READAHEAD_MIN_BLOCKS up to options.readahead while reads stay sequential
+ * and is dropped as soon as one is not.
+ */
+#define READAHEAD_MIN_BLOCKS 8
+#define READAHEAD_QUEUE 64
 
-	//Check if name is a regular file
-	//Process file by looking at current_dir.nStartBlock
+struct readahead_request
+{
+	long block;
+	long count;
+};
 
-	FILE *fd = fopen(DISKFILE, "r+b");
-	fseek(fd, current_dir.nStartBlock*BLOCK_SIZE, SEEK_SET);	//Go to block where file in directory is stored
+struct readahead_request ra_queue[READAHEAD_QUEUE];
+int ra_head = 0;			//Next request for the worker
+int ra_tail = 0;			//Next free slot
+int ra_stop = 0;
+int ra_started = 0;
+pthread_t ra_thread;
+pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+unsigned long ra_blocks = 0;		//Blocks loaded by readahead
+unsigned long ra_hits = 0;			//Of those, read before being evicted
+unsigned long ra_wasted = 0;		//Evicted or overwritten without being read
+unsigned long ra_dropped = 0;		//Requests not queued because the queue was full
 
-	//Subdirectory block
-	cs1550_directory_entry subdir;
-	i = fread(&subdir, BLOCK_SIZE, 1, fd);
+/*
+ * Per-operation statistics, read through the virtual file STATS_PATH. Each
+ * thread counts into a slot of its own without taking a lock; reading the
+ * file adds all slots up. A slot outlives its thread and is handed to the
+ * next new thread, so the totals keep everything ever counted.
+ */
+#define STATS_PATH "/.cs1550_stats"
+#define STATS_NAME ".cs1550_stats"
+#define STATS_BUCKETS 32	//Bucket i counts calls taking [2^i, 2^(i+1)) us, bucket 0 from 0
 
-	if (i < 0){
-		printf("Error: Unable to read subdirectory block\n");
-		res = -ENOENT;
-		return res;
-	}
+enum { OP_GETATTR, OP_READDIR, OP_MKDIR, OP_RMDIR, OP_MKNOD, OP_UNLINK, OP_RENAME, OP_READ, OP_WRITE,
+	OP_TRUNCATE, OP_OPEN, OP_RELEASE, OP_FLUSH, OP_FSYNC, OP_COUNT };
 
-	fclose(fd);
+const char *op_names[OP_COUNT] = { "getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink", "rename", "read", "write",
+	"truncate", "open", "release", "flush", "fsync" };
 
-	//Using subdirectory block, process file info within the block
+struct op_counters
+{
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;		//Moved by read and write
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t hist[STATS_BUCKETS];
+};
 
-	
-	struct cs1550_file_directory file_info;
-	memset(&file_info, 0, sizeof(struct cs1550_file_directory));
+struct stats_slot
+{
+	struct op_counters ops[OP_COUNT];
+	int in_use;		//Owned by a live thread
+	struct stats_slot *next;
+};
 
-	//Search for filename in block
-	int j = 0;
-	for(j = 0; j < subdir.nFiles; j++){
-		if(strcmp(subdir.files[j].fname, filename) == 0){
-			if(DEBUG)printf("File already exists, returning\n");
-			//return -EEXIST;	//File already exists
-			 stbuf->st_mode = S_IFREG | 0666;
-		        stbuf->st_nlink = 1; //file links
-		        stbuf->st_size = 0; //file size - make sure you replace with real size!
-		        res = 0; // no error
-			return res;
-		        if(DEBUG)printf("In getattr, stbuf set to 666\n");
-		}
-	}
-	//If file is not found
-	if(j >= subdir.nFiles){
-	//	int file_start_block = 0;
-		printf("File not found\n");
-		res = -ENOENT;
-		return res;
+struct stats_slot *stats_slots = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+__thread struct stats_slot *stats_self = NULL;
 
-	}
+/*
+ * Logging. LOG() only evaluates its arguments when the level is enabled by
+ * options.log_level, so a debug message on a hot path costs one comparison
+ * when it is off. An enabled message is formatted by the caller straight into
+ * a slot of log_ring and written out by the log thread, so handlers never
+ * block on the terminal; when the ring is full the message is dropped and
+ * counted. Each call site, told apart by its format string, may log
+ * LOG_BURST messages a second and the rest are only counted.
+ */
+#define LOG_RING 256		//Slots, a power of two
+#define LOG_LINE 192		//Longest message kept, the rest is cut off
+#define LOG_BURST 10
+#define LOG_LIMITS 128		//Call sites with a rate limit, any more are not limited
+#define LOG_PERIOD_MS 100	//How long a message may wait in the ring
 
-       /* //regular file, probably want to be read and write
-        stbuf->st_mode = S_IFREG | 0666;
-        stbuf->st_nlink = 1; //file links
-//      stbuf->st_size = file_info.fsize; //file size - make sure you replace with real size!
-        stbuf->st_size = 0; //file size - make sure you replace with real size!
-        res = 0; // no error
-	if(DEBUG)printf("In getattr, stbuf set to 666\n");*/
+#define LOG(level, ...) do{ if((unsigned long)(level) <= options.log_level) log_msg(level, __VA_ARGS__); }while(0)
 
-        return res;
-}
+struct log_slot
+{
+	unsigned long seq;		//Position the slot is free for, one past it once written
+	int level;
+	char text[LOG_LINE];
+};
 
-/* 
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
+struct log_limit
 {
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
+	const char *fmt;		//Call site the slot belongs to, NULL while unused
+	time_t window;			//Second being counted
+	unsigned long count;		//Messages in that second
+	unsigned long suppressed;	//Not logged since the last report
+};
 
-        strcpy(directory, "");
-        strcpy(filename,"");
-        strcpy(extension,"");
+const char *log_names[] = { "", "error", "warn", "info", "debug" };
 
-	int i = 0;
-	
-	if(DEBUG)printf("In readdir\n");
+struct log_slot log_ring[LOG_RING];
+unsigned long log_head = 0;		//Next position to claim, moved by the writers
+unsigned long log_tail = 0;		//Next position to write out, moved by the log thread
+unsigned long log_dropped = 0;		//Messages lost to a full ring
+struct log_limit log_limits[LOG_LIMITS];
+int log_stop_flag = 0;
+int log_started = 0;
+pthread_t log_thread;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
 
-	if(DEBUG)printf("Path: %s\n",path);
+typedef struct cs1550_directory_entry cs1550_directory_entry;
 
-	//the filler function allows us to add entries to the listing
-	//read the fuse.h file for a description (in the ../include dir)
-	if(DEBUG)printf("Before filler\n");
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	if(DEBUG)printf("After filler\n");	
+//A file located for one request: a copy of its directory block and its slot.
+//Holds meta_lock and the directory's lock until put_file().
+struct file_ref
+{
+	long dir_block;		//First block of the directory
+	long leaf;			//Block dir was read from
+	int slot;
+	int exclusive;		//Directory lock taken for writing
+	cs1550_directory_entry dir;
+};
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	if(DEBUG)printf("PATH: %s\n", path);
+//Function Prototypes
+int split_name(const char *s, size_t len, char *name, char *ext);
+int walk_components(const char *path, struct cs1550_path *p, long avoid);
+int walk_path(const char *path, struct cs1550_path *p);
+void init_locks(void);
+pthread_rwlock_t *dir_lock(long dir_block);
+int disk_open(void);
+void disk_close(void);
+int disk_read(void *buf, size_t size, off_t off);
+int disk_write(const void *buf, size_t size, off_t off);
+int disk_read_block(long block, void *buf);
+int disk_write_block(long block, const void *buf);
+int bcache_init(unsigned long nbufs);
+void bcache_destroy(void);
+int cache_read_block(long block, void *buf);
+int cache_write_block(long block, const void *buf);
+int cache_read_blocks(long block, long count, void *buf);
+int cache_write_blocks(long block, long count, const void *buf);
+void cache_prefetch(long block, long count, char *scratch);
+int readahead_start(void);
+void readahead_stop(void);
+void readahead_queue(long block, long count);
+void *readahead_worker(void *arg);
+void readahead_file(const struct cs1550_file_directory *file, long from, long count);
+void txn_begin(void);
+void txn_begin_blocks(int blocks);
+void txn_end(void);
+int commit_metadata(void);
+unsigned int journal_checksum(unsigned int h, const void *buf, size_t len);
+int journal_write_block(long block, const void *buf);
+int journal_read_block(long block, void *buf);
+void journal_drop(int i);
+void journal_forget(long block);
+int journal_commit(void);
+int journal_group_commit(void);
+int journal_flush(void);
+int journal_replay(const struct cs1550_superblock *sb, int in_memory);
+unsigned int copy_checksum(void);
+void table_sum(long tb);
+int write_superblock(unsigned long generation, int journal_blocks);
+int read_superblock(int slot, struct cs1550_superblock *sb);
+int super_intact(const struct cs1550_superblock *sb);
+int super_valid(const struct cs1550_superblock *sb, struct cs1550_geometry *g);
+int geo_compute(struct cs1550_geometry *g, int block_size, long num_blocks);
+int geo_setup(const struct cs1550_geometry *g);
+void geo_free(void);
+void bits_set(uint64_t *bits, long from, long to);
+long group_empty(long g, uint64_t *bits);
+int format_disk(void);
+int format_blank(void);
+int load_superblock(void);
+int load_copy(struct cs1550_superblock *cur, int format);
+int load_groups(void);
+void count_free(void);
+void group_drop(void);
+void group_touch(long g, int copy);
+void group_stale(int copy);
+void group_evict(void);
+uint64_t *group_map(long g);
+int write_groups(int copy);
+void groups_written(int copy);
+int block_in_use(long block);
+int set_block(long block, int value);
+long get_free_nStartBlock(int file_flag);
+long find_free_block(long from, long to);
+long alloc_blocks(long count, long *blocks, int file_flag);
+long alloc_blocks_locked(long count, long *blocks, int file_flag);
+void free_block(long block);
+long find_used_block(long from, long to);
+long find_run(long goal, long want, long *len);
+void take_run(long start, long count);
+long alloc_run_locked(long goal, long want, long *start);
+void free_run(long start, long count);
+int load_extents(const struct cs1550_file_directory *file, struct extent_map *map);
+int store_extents(struct cs1550_file_directory *file, const struct extent_map *map);
+int grow_extents(struct extent_map *map, long count, long *ext_block, long reserved);
+int reserve_blocks(long count);
+void unreserve_blocks(long count);
+void free_extents(const struct cs1550_file_directory *file);
+long map_block(const struct extent_map *map, long index, long *run, struct extent_cursor *cursor);
+int read_file_data(const struct cs1550_file_directory *file, char *buf, size_t size, off_t offset, struct extent_cursor *cursor);
+int write_file_data(struct cs1550_file_directory *file, const char *buf, size_t size, off_t offset, struct extent_cursor *cursor);
+struct name_index_entry *index_lookup(long dir_block, const char *name, const char *ext);
+struct name_index_entry *index_entry(long dir_block, const char *name, const char *ext);
+void index_add(long dir_block, const struct cs1550_file_directory *entry, long leaf, int slot);
+void index_absent(long dir_block, const char *name, const char *ext);
+void index_move(long dir_block, const char *name, const char *ext, long leaf, int slot);
+void index_drop_directory(long dir_block);
+void index_clear(void);
+unsigned int dir_hash(const char *name, const char *ext);
+int dir_node_ok(const void *node, int above);
+int index_child(const struct cs1550_index_block *ib, unsigned int h);
+int dir_lookup(long dir_block, const char *name, const char *ext, long *leaf_block, cs1550_directory_entry *leaf);
+long lookup_directory(long dir_block, const char *name, const char *ext);
+int find_file(long dir_block, const char *fname, const char *fext, long *leaf_block, cs1550_directory_entry *leaf);
+int dir_insert(long dir_block, const struct cs1550_file_directory *entry);
+int dir_remove(long dir_block, long leaf_block, cs1550_directory_entry *leaf, int slot);
+int dir_walk(long dir_block, int (*fn)(long block, void *data, void *arg), void *arg);
+int get_file(const char *path, struct cs1550_handle *h, int exclusive, struct file_ref *ref);
+int lock_file(long dir_block, const char *fname, const char *fext, struct cs1550_handle *h, int exclusive, struct file_ref *ref);
+void put_file(struct file_ref *ref);
+void fill_stat(struct stat *stbuf, long block, size_t size);
+int stat_entry(const struct cs1550_path *p, struct stat *stbuf);
+int open_handle(struct file_ref *ref, struct fuse_file_info *fi);
+int make_dir(const struct cs1550_path *p);
+int remove_dir(const struct cs1550_path *p);
+int make_file(const struct cs1550_path *p);
+int remove_file(const struct cs1550_path *p);
+int rename_entry(const struct cs1550_path *src, const char *to, struct cs1550_path *dst);
+int entry_path(long dir, const char *name, struct cs1550_path *p);
+int list_block(long block, void *data, void *arg);
+int entry_op(int op, long dir, const char *name, int exclusive, int (*fn)(const struct cs1550_path *p));
+struct cs1550_file *file_find(long dir_block, const char *fname, const char *fext);
+struct cs1550_file *file_get(long dir_block, const char *fname, const char *fext, size_t fsize);
+void file_put(struct cs1550_file *f);
+void file_discard(struct cs1550_file *f);
+struct dirty_page *page_seek(const struct cs1550_file *f, long index);
+struct dirty_page *page_get(struct cs1550_file *f, const struct cs1550_file_directory *file, long index);
+void pages_free(struct cs1550_file *f);
+void pages_cut(struct cs1550_file *f, size_t size);
+int buffer_write(struct cs1550_file *f, struct cs1550_file_directory *file, const char *buf, size_t size, off_t offset);
+void buffer_read(const struct cs1550_file *f, char *buf, size_t size, off_t offset);
+int flush_file(struct cs1550_file *f, struct file_ref *ref);
+int truncate_file(struct file_ref *ref, off_t size);
+int writeback_file(struct cs1550_file *f, int put);
+int writeback_start(void);
+void writeback_stop(void);
+void *writeback_worker(void *arg);
+void stats_key_create(void);
+void stats_release_slot(void *slot);
+struct stats_slot *stats_slot(void);
+uint64_t stats_start(void);
+int stats_end(int op, uint64_t start, int res);
+char *stats_text(size_t *len);
+int fsck_problem(int need, const char *fix, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+int fsck_claim(long start, long count);
+void fsck_unclaim(long start, long count);
+int fsck_name_ok(const char *name, int max, int empty_ok);
+void fsck_commit(void);
+char *fsck_path(const char *dname, const struct cs1550_file_directory *file);
+void fsck_file(const char *path, struct cs1550_file_directory *file, int *drop, int *changed);
+int fsck_leaf(const char *dname, long block, cs1550_directory_entry *leaf, int above, uint64_t lo, uint64_t hi);
+int fsck_index(const char *dname, long block, struct cs1550_index_block *ib, int above, uint64_t lo, uint64_t hi);
+int fsck_tree(const char *dname, long block, int above, uint64_t lo, uint64_t hi);
+void fsck_free_space(void);
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+struct log_limit *log_limit_for(const char *fmt);
+int log_allow(int level, const char *fmt);
+void log_drain(void);
+int log_start(void);
+void log_stop(void);
+void *log_worker(void *arg);
 
-	if(DEBUG)printf("Directory %s, File %s, Extension %s\n", directory, filename, extension);
-	if(strlen(directory) > MAX_FILENAME){
-		if(DEBUG)printf("Directory name %s too long\n", directory);
-		return -ENAMETOOLONG;
-	}
+//How much data can one block hold?
+#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE)
 
-	if(strlen(filename) > MAX_FILENAME){
-		if(DEBUG)printf("File name %s too long\n", filename);
-		return -ENAMETOOLONG;
-	}
 
-	if(strlen(extension) > MAX_EXTENSION){
-		if(DEBUG)printf("Extension name %s too long\n", extension);
-		return -ENAMETOOLONG;
-	}
+struct cs1550_disk_block
 
-	//If root, then only subdirectories should exist, no files
-	if (strcmp(path, "/") == 0){
-		//Check if filename or extension, return error
+{
+	//All of the space in the block can be used for actual data
+	//storage. Only the first BLOCK_SIZE bytes are on disk.
+	char data[MAX_BLOCK_SIZE];
+};
 
-		if(strlen(filename) > 0 || strlen(extension) > 0){
-			printf("File cannot exist in root\n");
-			return -EEXIST;
-		}
+typedef struct cs1550_disk_block cs1550_disk_block;
 
-	struct cs1550_root_directory root_block;
-	//Open file and get root_block
-	get_root_block(&root_block);
-	if(DEBUG)printf("Number of directories = %d\n", root_block.nDirectories);
+//Split the len characters of one path component at its first dot into
+//name and extension, checking the 8.3 limits. A component with nothing
+//before the dot cannot be stored, so it is never found either.
+int split_name(const char *s, size_t len, char *name, char *ext){
+	const char *dot = memchr(s, '.', len);
+	size_t n = dot != NULL ? (size_t)(dot - s) : len;
+	size_t e = dot != NULL ? len - n - 1 : 0;
 
-	printf("Listing directories\n");
-	for(i = 0; i < root_block.nDirectories; i++){
-			if(DEBUG)printf("Directory %s found\n", root_block.directories[i].dname);
-			filler(buf, root_block.directories[i].dname, NULL, 0);	//List directory in buffer
-			
+	if(n > MAX_FILENAME || e > MAX_EXTENSION){
+		return -ENAMETOOLONG;
+	}
+	if(n == 0){
+		return -ENOENT;
 	}
+	memcpy(name, s, n);
+	name[n] = '\0';
+	memcpy(ext, s + n + 1, e);
+	ext[e] = '\0';
 	return 0;
-	}	//End of if
-	else{			//In subdirectory, list the files in subdirectory
-		FILE *fd;
-		char file_buf[MAX_FILENAME + 1];
- 	        struct cs1550_root_directory root_block;
-        	//Open file and get root_block
-        	get_root_block(&root_block);
-
-	        for(i = 0; i < root_block.nDirectories; i++){
-			if(strcmp(root_block.directories[i].dname, directory) == 0){
-	                        if(DEBUG)printf("Directory %s found, start_block = %ld\n", root_block.directories[i].dname, root_block.directories[i].nStartBlock);
-				break;
-			}
+}
 
-        	}
+void init_locks(void){
+	int i;
 
-		//Directory not found
-		if(i == root_block.nDirectories){
-			printf("Directory %s not found\n", directory);
-			return -ENOENT;
-		}
+	for(i = 0; i < DIR_LOCK_STRIPES; i++){
+		pthread_rwlock_init(&dir_locks[i], NULL);
+	}
+}
 
-		if (DEBUG) printf("nStartblock of subdirectory=%ld \n", root_block.directories[i].nStartBlock);
-		fd = fopen(DISKFILE, "r+b"); //Open for reading
-		fseek(fd, root_block.directories[i].nStartBlock*BLOCK_SIZE,SEEK_SET); //Move to offset block
-		cs1550_directory_entry file_listing;	//Store file info here
+//Lock guarding the contents of the directory stored at dir_block
+pthread_rwlock_t *dir_lock(long dir_block){
+	return &dir_locks[dir_block % DIR_LOCK_STRIPES];
+}
 
-		memset(&file_listing, 0, sizeof(file_listing));
-		memset(file_buf, 0, sizeof(file_buf));
-		if(DEBUG)printf("Subdir nStartBlock = %ld\n", root_block.directories[i].nStartBlock);
+/*
+ * Disk device layer. The image is opened once when the filesystem is mounted
+ * and every access after that is a single pread/pwrite on disk_fd, so reading
+ * or writing a block costs one syscall instead of fopen/fseek/fread/fclose.
+ */
+int disk_open(void){
+	disk_fd = open(disk_path, O_RDWR);
+	if(disk_fd < 0){
+		LOG(LOG_ERR, "Unable to open disk: %s\n", disk_path);
+		return -ENOENT;		//File not found
+	}
+	return 0;
+}
 
-		fread(&file_listing, BLOCK_SIZE, 1, fd);//read from that block
-		if(DEBUG)printf("Listing files\n");
+void disk_close(void){
+	if(disk_fd >= 0){
+		fsync(disk_fd);
+		close(disk_fd);
+	}
+	disk_fd = -1;
+}
 
-		int j = 0;
+//Read size bytes at byte offset off, anything past the end of the image reads as zeros
+int disk_read(void *buf, size_t size, off_t off){
+	size_t done = 0;
+	ssize_t n;
 
-		if(DEBUG)printf("file_listing.nFiles = %d\n", file_listing.nFiles);
-		for(j = 0; j < file_listing.nFiles; j++){ //Iterate over the non-empty filenames in this directory and print them to the user using filler()
-			if(DEBUG)printf("Fname=<%s> exten=<%s>\n",file_listing.files[j].fname, file_listing.files[j].fext);
-			strcpy(file_buf, file_listing.files[j].fname);	//Copied file name
-			//Check for extension
-			if(strcmp(file_listing.files[j].fext, "") != 0){	//Found extension
-				strcat(file_buf, ".");	//Concatinate extension
-				strcat(file_buf, file_listing.files[j].fext);
+	if(disk_fd < 0){
+		return -EIO;
+	}
+	while(done < size){
+		n = pread(disk_fd, (char *)buf + done, size - done, off + done);
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
 			}
-			if(DEBUG)printf("Call filler for listing files\n");
-			filler(buf, file_buf, NULL, 0);
-
+			return -errno;
 		}
-		fclose(fd);
-
+		if(n == 0){
+			memset((char *)buf + done, 0, size - done);	//Short image
+			break;
+		}
+		done += n;
 	}
-	/*
-	//add the user stuff (subdirs or files)
-	//the +1 skips the leading '/' on the filenames
-	//filler(buf, newpath + 1, NULL, 0);
-	*/
 	return 0;
 }
 
-/* 
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
-static int cs1550_mkdir(const char *path, mode_t mode)
-{
-	(void) path;
-	(void) mode;
+//Write size bytes at byte offset off
+int disk_write(const void *buf, size_t size, off_t off){
+	size_t done = 0;
+	ssize_t n;
 
-	int res = 0;
+	if(disk_fd < 0){
+		return -EIO;
+	}
+	while(done < size){
+		n = pwrite(disk_fd, (const char *)buf + done, size - done, off + done);
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -errno;
+		}
+		done += n;
+	}
+	return 0;
+}
 
-	if(DEBUG)printf("In mkdir\n");
+int disk_read_block(long block, void *buf){
+	return disk_read(buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
 
+int disk_write_block(long block, const void *buf){
+	return disk_write(buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
 
-	strcpy(filename, "");
-	strcpy(directory, "");
-	strcpy(extension, "");
+//Allocate nbufs buffers, all empty and on the LRU list
+int bcache_init(unsigned long nbufs){
+	unsigned long i;
 
-	if(strlen(path) > 1){
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	bcache_lru.next = bcache_lru.prev = &bcache_lru;
+	bcache_hits = bcache_misses = 0;
+	if(nbufs == 0){
+		return 0;	//Cache disabled, every access goes to the disk
+	}
+	for(bcache_nhash = 1; bcache_nhash < nbufs * 2; bcache_nhash <<= 1);
+	bcache_bufs = calloc(nbufs, sizeof(struct bcache_buf));
+	bcache_data = malloc(nbufs * BLOCK_SIZE);
+	bcache_hash = calloc(bcache_nhash, sizeof(struct bcache_buf *));
+	if(bcache_bufs == NULL || bcache_data == NULL || bcache_hash == NULL){
+		free(bcache_bufs);
+		free(bcache_data);
+		free(bcache_hash);
+		bcache_bufs = NULL;
+		bcache_data = NULL;
+		bcache_hash = NULL;
+		bcache_nhash = 0;
+		return -ENOMEM;
 	}
+	bcache_nbufs = nbufs;
+	for(i = 0; i < nbufs; i++){
+		bcache_bufs[i].state = BUF_EMPTY;
+		bcache_bufs[i].data = bcache_data + i * BLOCK_SIZE;
+		bcache_bufs[i].next = bcache_lru.next;
+		bcache_bufs[i].prev = &bcache_lru;
+		bcache_lru.next->prev = &bcache_bufs[i];
+		bcache_lru.next = &bcache_bufs[i];
+	}
+	return 0;
+}
 
-	if(DEBUG)printf("Path: %s\n", path);
+void bcache_destroy(void){
+	if(DEBUG)printf("Block cache: %lu hits, %lu misses\n", bcache_hits, bcache_misses);
+	free(bcache_bufs);
+	free(bcache_data);
+	free(bcache_hash);
+	bcache_bufs = NULL;
+	bcache_data = NULL;
+	bcache_hash = NULL;
+	bcache_nbufs = 0;
+	bcache_nhash = 0;
+}
 
-	if(strcmp(directory, "") == 0){
-		printf("Invalid directory name\n");
-		res = -ENOENT;
-		return res;
+//The rest of the bcache_ helpers expect the caller to hold bcache_lock
+struct bcache_buf *bcache_lookup(long block){
+	struct bcache_buf *b = bcache_hash[block & (bcache_nhash - 1)];
+
+	while(b != NULL && b->block != block){
+		b = b->hnext;
 	}
+	return b;
+}
 
-	get_root_block(&root_block);
+void bcache_unhash(struct bcache_buf *b){
+	struct bcache_buf **pb = &bcache_hash[b->block & (bcache_nhash - 1)];
 
-	if(root_block.nDirectories >= MAX_DIRS_IN_ROOT){
-		printf("Maximum number of directories reached\n");
-		res = -ENOENT;
-		return res;
+	while(*pb != b){
+		pb = &(*pb)->hnext;
 	}
+	*pb = b->hnext;
+}
 
-	int i = 0;
+//Move a buffer to the front of the LRU list
+void bcache_touch(struct bcache_buf *b){
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+	b->next = bcache_lru.next;
+	b->prev = &bcache_lru;
+	bcache_lru.next->prev = b;
+	bcache_lru.next = b;
+}
 
-	if(DEBUG)printf("In mkdir, trying to create directory <%s>\n", directory); 
-	for(i = 0; i < MAX_DIRS_IN_ROOT; i++){
-		if(strcmp(root_block.directories[i].dname, "") != 0 && strcmp(root_block.directories[i].dname, directory) == 0){
-			if(DEBUG)printf("Directory %s already exists\n", directory);
-			res = -EEXIST;
-			return res;
+//Take the least recently used buffer that is not being loaded and give it block
+struct bcache_buf *bcache_claim(long block){
+	struct bcache_buf *b;
+
+	for(b = bcache_lru.prev; b != &bcache_lru; b = b->prev){
+		if(b->state != BUF_LOADING){
+			break;
 		}
 	}
-
-	//Write directory
-	strcpy(root_block.directories[root_block.nDirectories].dname, directory);
-	//Need to get nStarBlock from FAT table
-	i = get_free_nStartBlock(&FAT_buf, 0);
-	if(i > 0){
-		root_block.directories[root_block.nDirectories].nStartBlock = i;
+	if(b == &bcache_lru){
+		return NULL;
 	}
-	else{
-		printf("Unable to find free block\n");
-		res = -ENOENT;
-		return res;
+	if(b->state == BUF_VALID){
+		bcache_unhash(b);
 	}
-	root_block.nDirectories++;
-
-	if(DEBUG)printf("************In mkdir, nStartBlock = %d\n", i);
-
-
-	write_FAT_block(FAT_buf);
-
-	write_root_block(root_block);
+	if(b->prefetched){
+		ra_wasted++;
+		b->prefetched = 0;
+	}
+	b->block = block;
+	b->state = BUF_EMPTY;
+	b->hnext = bcache_hash[block & (bcache_nhash - 1)];
+	bcache_hash[block & (bcache_nhash - 1)] = b;
+	bcache_touch(b);
+	return b;
+}
 
-	if(DEBUG)printf("Directory %s created with nStartBlock = %ld\n", directory, root_block.directories[root_block.nDirectories].nStartBlock);
+//Find a block in the cache, waiting out anyone still reading it from disk
+struct bcache_buf *bcache_find(long block){
+	struct bcache_buf *b;
 
-	return res;
+	while((b = bcache_lookup(block)) != NULL && b->state == BUF_LOADING){
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+	}
+	return b;
 }
 
-/* 
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
-}
-
-/* 
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
+/*
+ * Read one directory or data block. A hit is a memory copy; on a miss the
+ * buffer is marked loading while the disk read runs outside the lock so
+ * other blocks can be served meanwhile.
  */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
-{
-	(void) mode;
-	(void) dev;
-
-	strcpy(filename, "");
-	strcpy(directory, "");
-	strcpy(extension, "");
-
+int cache_read_block(long block, void *buf){
+	struct bcache_buf *b;
 	int res;
-	int i = 0;
-
-	if(DEBUG)printf("In mknod\n");
 
-	if(strlen(path) > 1){
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	if(journal_read_block(block, buf)){
+		return 0;	//Changed by a transaction that is not home yet
 	}
-
-	if(DEBUG)printf("Mknod Path: %s\n", path);
-	if(DEBUG)printf("Path: directory [%s] file[%s] ext [%s]\n", directory, filename, extension);
-
-	if(strcmp(directory, "") == 0){
-		printf("Directory not specified (cannot create file in root dir)\n");
-		return -EPERM;
+	if(bcache_nbufs == 0){
+		return disk_read_block(block, buf);
 	}
 
-	if(strcmp(filename, "") == 0){
-		printf("Invalid file name, file name is empty %s\n", path);
-		res = -EPERM;
-		return res;
+	pthread_mutex_lock(&bcache_lock);
+	b = bcache_find(block);
+	if(b != NULL && b->state == BUF_VALID){
+		bcache_hits++;
+		if(b->prefetched){
+			ra_hits++;
+			b->prefetched = 0;
+		}
+		bcache_touch(b);
+		memcpy(buf, b->data, BLOCK_SIZE);
+		pthread_mutex_unlock(&bcache_lock);
+		return 0;
 	}
-
-	//Check file name length
-	if(strlen(filename) > MAX_FILENAME){
-		if(DEBUG)printf("Mknod file too long\n");
-		return -ENAMETOOLONG;
+	bcache_misses++;
+	if(b == NULL){
+		b = bcache_claim(block);
 	}
-
-	if(strcmp(extension, "") != 0){
-		//File extension exists
-		if(strlen(extension) > MAX_EXTENSION){
-			if(DEBUG)printf("Mknod extension too long\n");
-			return -ENAMETOOLONG;
-		}
+	if(b == NULL){
+		//Every buffer is being loaded, go around the cache
+		pthread_mutex_unlock(&bcache_lock);
+		return disk_read_block(block, buf);
 	}
+	b->state = BUF_LOADING;
+	pthread_mutex_unlock(&bcache_lock);
 
-	get_root_block(&root_block);
+	res = disk_read_block(block, b->data);
 
-        // Get directory nStartBlock
-	for(i = 0; i < root_block.nDirectories; i++){
-		if(strcmp(root_block.directories[i].dname, "") != 0 && strcmp(root_block.directories[i].dname, directory) == 0){
-			if(DEBUG)printf("mknod directory %s found\n", directory);
-			break;	//Directory found
-		}
+	pthread_mutex_lock(&bcache_lock);
+	if(res == 0){
+		b->state = BUF_VALID;
+		memcpy(buf, b->data, BLOCK_SIZE);
 	}
-
-	if(i == root_block.nDirectories){
-		//No directories by name found
-		printf("No such %s directory found\n", directory);
-		res = -ENOENT;
-		return res;
+	else{
+		bcache_unhash(b);
+		b->state = BUF_EMPTY;
 	}
+	pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+	return res;
+}
 
-        // found directory name, using nStartBlock, go to that block
-
-	FILE *fd = fopen(DISKFILE, "r+b");
-	fseek(fd, root_block.directories[i].nStartBlock*BLOCK_SIZE, SEEK_SET);	//Go to the nStartBlock
-
-	//Subdirectory block
-	cs1550_directory_entry subdir;
-	i = fread(&subdir, BLOCK_SIZE, 1, fd);
+/*
+ * Read count physically adjacent blocks into buf. Blocks found in the cache
+ * are copied out; every run of missing blocks is read with a single request
+ * straight into buf and then copied into the cache.
+ */
+int cache_read_blocks(long block, long count, void *buf){
+	struct bcache_buf *b;
+	long i = 0;
+	long run;
+	int res;
 
-	if (i < 0){
-		printf("Error: Unable to read subdirectory block\n");
-		res = -ENOENT;
-		return res;
+	if(bcache_nbufs == 0){
+		return disk_read(buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
 	}
 
-	fclose(fd);
+	while(i < count){
+		//Copy out the blocks that are already cached
+		pthread_mutex_lock(&bcache_lock);
+		while(i < count && (b = bcache_find(block + i)) != NULL){
+			bcache_hits++;
+			if(b->prefetched){
+				ra_hits++;
+				b->prefetched = 0;
+			}
+			bcache_touch(b);
+			memcpy((char *)buf + i * BLOCK_SIZE, b->data, BLOCK_SIZE);
+			i++;
+		}
+		//Measure the run of misses that follows
+		for(run = 0; i + run < count && bcache_lookup(block + i + run) == NULL; run++);
+		bcache_misses += run;
+		pthread_mutex_unlock(&bcache_lock);
 
-	//Check if file already exists in subdir
-	for(i = 0; i < subdir.nFiles; i++){
-		if(strcmp(subdir.files[i].fname, filename) == 0 && 
-		   strcmp(subdir.files[i].fext, extension) == 0){
-			if(DEBUG)printf("File already exists\n");
-			res = -EEXIST;
+		if(run == 0){
+			continue;
+		}
+		res = disk_read((char *)buf + i * BLOCK_SIZE, run * BLOCK_SIZE, (off_t)(block + i) * BLOCK_SIZE);
+		if(res != 0){
 			return res;
 		}
-	}
-
-	//If file does not exist
-	if(DEBUG)printf("mknod file %s does not exist\n", filename);
-	strcpy(subdir.files[i].fname, filename);
-	strcpy(subdir.files[i].fext, extension);
-	
-	int free_start_block;
-	free_start_block = get_free_nStartBlock(&FAT_buf, 1);	//Get free starting block for file
 
-	if(free_start_block == -1){
-		//There are no free blocks
-		printf("No free blocks available\n");
-		return -ENOENT;
+		//Keep a copy unless someone cached a newer one in the meantime
+		pthread_mutex_lock(&bcache_lock);
+		for(; run > 0; run--, i++){
+			if(bcache_lookup(block + i) == NULL && (b = bcache_claim(block + i)) != NULL){
+				memcpy(b->data, (char *)buf + i * BLOCK_SIZE, BLOCK_SIZE);
+				b->state = BUF_VALID;
+			}
+		}
+		pthread_mutex_unlock(&bcache_lock);
 	}
- 
-	subdir.files[i].nStartBlock = free_start_block;
-	subdir.files[i].fsize = 0;
-	subdir.nFiles++;	//Increment the number of files
-
-	if(DEBUG)printf("mknod free_Start_block %d\n", free_start_block);
-
-	fd = fopen(DISKFILE, "r+b");
-	if(DEBUG)printf("Subdir Start Block %ld\n", root_block.directories[i].nStartBlock);
-	fseek(fd, root_block.directories[i].nStartBlock*BLOCK_SIZE, SEEK_SET);	//Go to the nStartBlock
-
-	fwrite(&subdir, BLOCK_SIZE, 1, fd);	//Write subdirectory block at location
-	fclose(fd);
-
-	if(DEBUG)printf("mknod write FAT block\n");
-	write_FAT_block(FAT_buf);		//Write FAT block back with updated nStartBlock
-
 	return 0;
 }
 
 /*
- * Deletes a file
+ * Write count physically adjacent whole blocks with a single request.
+ * Cached copies are updated; blocks that are not cached are not pulled in,
+ * so a large write does not flush the directory blocks out of the cache.
  */
-static int cs1550_unlink(const char *path)
-{
-    (void) path;
+int cache_write_blocks(long block, long count, const void *buf){
+	struct bcache_buf *b;
+	long i;
+	int res;
 
-    return 0;
-}
+	if(bcache_nbufs == 0){
+		return disk_write(buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+	}
 
-/* 
- * Read size bytes from file into buf starting from offset
- *
- */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-			  struct fuse_file_info *fi)
-{
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
+	pthread_mutex_lock(&bcache_lock);
+	for(i = 0; i < count; i++){
+		b = bcache_find(block + i);
+		if(b != NULL){
+			memcpy(b->data, (const char *)buf + i * BLOCK_SIZE, BLOCK_SIZE);
+			b->state = BUF_VALID;
+			b->prefetched = 0;
+		}
+	}
+	bcache_wseq++;
+	bcache_writing++;
+	pthread_mutex_unlock(&bcache_lock);
 
-	int res;
-	int i = 0;
+	res = disk_write(buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
 
-	if(DEBUG)printf("In read\n");
+	pthread_mutex_lock(&bcache_lock);
+	bcache_writing--;
+	pthread_mutex_unlock(&bcache_lock);
+	return res;
+}
 
-	strcpy(filename, "");
-	strcpy(directory, "");
-	strcpy(extension, "");
+//Write one block through the cache to the disk
+int cache_write_block(long block, const void *buf){
+	struct bcache_buf *b;
+	int res;
 
-	if(strlen(path) > 1){
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	}
+	if(bcache_nbufs > 0){
+		pthread_mutex_lock(&bcache_lock);
+		b = bcache_find(block);
+		if(b == NULL){
+			b = bcache_claim(block);
+		}
+		if(b != NULL){
+			memcpy(b->data, buf, BLOCK_SIZE);
+			b->state = BUF_VALID;
+			b->prefetched = 0;
+			bcache_touch(b);
+		}
+		bcache_wseq++;
+		bcache_writing++;
+		pthread_mutex_unlock(&bcache_lock);
 
-	if(DEBUG)printf("Path: %s\n", path);
+		res = disk_write_block(block, buf);
 
-	if(strcmp(directory, "") == 0){
-		printf("Directory cannot be empty\n");
-		res = -EPERM;
+		pthread_mutex_lock(&bcache_lock);
+		bcache_writing--;
+		pthread_mutex_unlock(&bcache_lock);
 		return res;
 	}
-	
+	return disk_write_block(block, buf);
+}
 
-	if(DEBUG)printf("filename %s, extension %s\n", filename, extension);
-	if(strcmp(filename, "") == 0){
-		printf("Invalid file name, file name is empty %s\n", path);
-		res = -EPERM;
-		return res;
-	}
+/*
+ * Load count physically adjacent blocks into the cache for readahead,
+ * without copying them anywhere. Only blocks not cached yet are read, each
+ * run of them with one request into scratch. The worker holds no directory
+ * lock, so a load is given up if any write was in progress when it started
+ * or began before it finished; the disk could hold either version then.
+ */
+void cache_prefetch(long block, long count, char *scratch){
+	struct bcache_buf *run_bufs[READAHEAD_MAX_BLOCKS];
+	unsigned long seq;
+	long i = 0;
+	long run;
+	long k;
+	int res;
 
-	//Check file name length
-	if(strlen(filename) > MAX_FILENAME){
-		return -ENAMETOOLONG;
+	if(bcache_nbufs == 0){
+		return;
 	}
 
-	if(strcmp(extension, "") != 0){
-		//File extension exists
-		if(strlen(extension) > MAX_EXTENSION){
-			return -ENAMETOOLONG;
+	while(i < count){
+		pthread_mutex_lock(&bcache_lock);
+		while(i < count && bcache_lookup(block + i) != NULL){
+			i++;	//Already cached or being loaded
 		}
-	}
+		if(bcache_writing > 0){
+			pthread_mutex_unlock(&bcache_lock);
+			return;
+		}
+		//Claim buffers for the run of misses, never more than a quarter of the cache
+		for(run = 0; i + run < count && run < READAHEAD_MAX_BLOCKS && (unsigned long)run < bcache_nbufs / 4
+			&& bcache_lookup(block + i + run) == NULL; run++){
+			run_bufs[run] = bcache_claim(block + i + run);
+			if(run_bufs[run] == NULL){
+				break;
+			}
+			run_bufs[run]->state = BUF_LOADING;
+		}
+		seq = bcache_wseq;
+		pthread_mutex_unlock(&bcache_lock);
 
-	get_root_block(&root_block);		//Start from the beginning
+		if(run == 0){
+			return;
+		}
+		res = disk_read(scratch, run * BLOCK_SIZE, (off_t)(block + i) * BLOCK_SIZE);
 
-        // Get directory nStartBlock
-	for(i = 0; i < root_block.nDirectories; i++){
-		if(strcmp(root_block.directories[i].dname, "") != 0 && strcmp(root_block.directories[i].dname, directory) == 0){
-			break;	//Directory found
+		pthread_mutex_lock(&bcache_lock);
+		if(seq != bcache_wseq){
+			res = -EAGAIN;	//Raced with a write, the data may be stale
+		}
+		for(k = 0; k < run; k++){
+			if(res == 0){
+				memcpy(run_bufs[k]->data, scratch + k * BLOCK_SIZE, BLOCK_SIZE);
+				run_bufs[k]->state = BUF_VALID;
+				run_bufs[k]->prefetched = 1;
+				ra_blocks++;
+			}
+			else{
+				bcache_unhash(run_bufs[k]);
+				run_bufs[k]->state = BUF_EMPTY;
+			}
+		}
+		pthread_cond_broadcast(&bcache_cond);
+		pthread_mutex_unlock(&bcache_lock);
+		if(res != 0){
+			return;
 		}
+		i += run;
 	}
+}
 
-	if(i == root_block.nDirectories){
-		//No directories by name found
-		printf("No such %s directory found\n", directory);
-		res = -ENOENT;
-		return res;
+//Start the readahead worker, if readahead is enabled and there is a cache
+int readahead_start(void){
+	ra_head = ra_tail = 0;
+	ra_stop = 0;
+	ra_blocks = ra_hits = ra_wasted = ra_dropped = 0;
+	if(options.readahead == 0 || bcache_nbufs == 0){
+		return 0;
 	}
-	
-
-    // found directory name, using nStartBlock, go to that block
-
-	FILE *fd = fopen(DISKFILE, "r+b");
-	fseek(fd, root_block.directories[i].nStartBlock*BLOCK_SIZE, SEEK_SET);	//Go to the nStartBlock
-
-	if(DEBUG)printf("Read Subdirectory nStartBlock %ld\n", root_block.directories[i].nStartBlock);
-	//Subdirectory block
-	cs1550_directory_entry subdir;
-	i = fread(&subdir, BLOCK_SIZE, 1, fd);
-
-	if (i < 0){
-		printf("Error: Unable to read subdirectory block\n");
-		res = -ENOENT;
-		return res;
+	if(options.readahead > READAHEAD_MAX_BLOCKS){
+		options.readahead = READAHEAD_MAX_BLOCKS;	//Size of the worker's scratch buffer
 	}
-
-	fclose(fd);
-
-	//Check if file already exists in subdir
-	for(i = 0; i < subdir.nFiles; i++){
-		if(DEBUG)printf("Read filename %s %s\n", subdir.files[i].fname, subdir.files[i].fext);
-		if(strcmp(subdir.files[i].fname, filename) == 0 && 
-		   strcmp(subdir.files[i].fext, extension) == 0){
-			//printf("File already exists\n");
-			res = 0;
-			break;
-		}
+	if(pthread_create(&ra_thread, NULL, readahead_worker, NULL) != 0){
+		return -errno;
 	}
+	ra_started = 1;
+	return 0;
+}
 
-	if(i == subdir.nFiles){
-		printf("Read File %s not found\n", filename);
-		return -ENOENT;
+//Stop the worker and let it finish the request it is on
+void readahead_stop(void){
+	if(!ra_started){
+		return;
 	}
-	
-	//check to make sure path exists
-	//check that size is > 0
-	
-	if(DEBUG)printf("-----------Size is %ld\n", size);
+	pthread_mutex_lock(&ra_lock);
+	ra_stop = 1;
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_thread, NULL);
+	ra_started = 0;
+	if(DEBUG)printf("Readahead: %lu blocks, %lu hits, %lu wasted, %lu dropped\n", ra_blocks, ra_hits, ra_wasted, ra_dropped);
+}
 
-	if(size <= 0){
-		printf("Error: Size cannot be 0\n");
-		return -ENOENT;
+//Hand a run of blocks to the worker. Never blocks, a full queue drops it.
+void readahead_queue(long block, long count){
+	if(!ra_started){
+		return;
 	}
-	//check that offset is <= to the file size
-
-	if(offset > subdir.files[i].fsize*BLOCK_SIZE){
-		printf("Error: offset out of bounds\n");
-		res = -EFBIG;
-		return res;
+	pthread_mutex_lock(&ra_lock);
+	if((ra_tail + 1) % READAHEAD_QUEUE == ra_head){
+		ra_dropped++;
 	}
+	else{
+		ra_queue[ra_tail].block = block;
+		ra_queue[ra_tail].count = count;
+		ra_tail = (ra_tail + 1) % READAHEAD_QUEUE;
+		pthread_cond_signal(&ra_cond);
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
 
-	//Need to get to block in offset range
-	int offset_block = offset / BLOCK_SIZE;
-
-    //Jump to offset block for reading
+void *readahead_worker(void *arg){
+	char *scratch = malloc((size_t)READAHEAD_MAX_BLOCKS * BLOCK_SIZE);
+	struct readahead_request r;
 
-	//???? Remove later
-	//char output[10000];		//Will hold buf contents
-	char output[size];
+	(void) arg;
+	pthread_mutex_lock(&ra_lock);
+	for(;;){
+		while(!ra_stop && ra_head == ra_tail){
+			pthread_cond_wait(&ra_cond, &ra_lock);
+		}
+		if(ra_stop){
+			break;
+		}
+		r = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % READAHEAD_QUEUE;
+		pthread_mutex_unlock(&ra_lock);
 
+		if(scratch != NULL){
+			cache_prefetch(r.block, r.count, scratch);
+		}
 
-	fd = fopen(DISKFILE, "r+b");
-//????	fseek(fd, subdir.files[i].nStartBlock*BLOCK_SIZE + offset_block, SEEK_SET);    //Go to location of $
-    	fseek(fd, ((subdir.files[i].nStartBlock+1)*BLOCK_SIZE) + offset_block, SEEK_SET);    //Go to location of $
+		pthread_mutex_lock(&ra_lock);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	free(scratch);
+	return NULL;
+}
 
-	
-	//Read blocks until EOF marker in FAT 
+/*
+ * Transactions. A mutating operation calls txn_begin() once it holds its
+ * directory locks and before its first change, logs the directory and
+ * extent blocks it changes with journal_write_block() instead of writing
+ * them in place, and ends with commit_metadata(). Operations that changed
+ * nothing end with txn_end() instead. One that may log more than
+ * JOURNAL_TXN_BLOCKS blocks says how many with txn_begin_blocks().
+ */
+void txn_begin(void){
+	txn_begin_blocks(JOURNAL_TXN_BLOCKS);
+}
 
-	if(DEBUG)printf(">>>>>>offset : %ld offset_block %d\n", offset, offset_block);
+void txn_begin_blocks(int blocks){
+	pthread_mutex_lock(&jnl_lock);
+	while(jnl_count + jnl_reserved + blocks > JOURNAL_TABLE_SIZE){
+		//Not enough room left for this operation, commit what is there
+		pthread_mutex_unlock(&jnl_lock);
+		if(journal_flush() != 0){
+			pthread_mutex_lock(&jnl_lock);
+			break;	//journal_write_block() writes in place when full
+		}
+		pthread_mutex_lock(&jnl_lock);
+	}
+	jnl_reserved += blocks;
+	txn_blocks = blocks;
+	pthread_mutex_unlock(&jnl_lock);
+	pthread_rwlock_rdlock(&txn_lock);
+}
 
-	if(DEBUG)printf("Read File nStartBlock %ld\n", subdir.files[i].nStartBlock);
-	
-	int bytes = fread(output, size, 1, fd);
+void txn_end(void){
+	pthread_rwlock_unlock(&txn_lock);
+	pthread_mutex_lock(&jnl_lock);
+	jnl_reserved -= txn_blocks;
+	pthread_mutex_unlock(&jnl_lock);
+}
 
-	if(DEBUG)printf("In read, output = %s	bytes %d	size %ld\n", output, bytes, size);
-	if(DEBUG)printf("File nStartBlock offset %ld\n", subdir.files[i].nStartBlock);
-	fclose(fd);
-	
-	memcpy(buf, output, strlen(output));
+/*
+ * Commit point for metadata. Ends the caller's transaction and returns once
+ * it is on disk. Every operation that ends while a commit is running waits
+ * for it to finish, and the first of them then commits all of them at once,
+ * so concurrent operations share one journal write and one fdatasync.
+ */
+int commit_metadata(void){
+	unsigned long seq = txn_seq;	//Only changes under the write side of txn_lock
+	int res;
 
-	//check to make sure path exists
-	//check that size is > 0
-	//check that offset is <= to the file size
-	//read in data
-	//set size and return, or error
+	txn_end();
+	pthread_mutex_lock(&commit_lock);
+	jnl_ops++;
+	if(committed_seq < seq){
+		journal_group_commit();
+	}
+	res = commit_res;
+	pthread_mutex_unlock(&commit_lock);
+	return res;
+}
 
-	//size = 0;
-	size = strlen(buf);
+//FNV-1a over len bytes, continuing from h
+unsigned int journal_checksum(unsigned int h, const void *buf, size_t len){
+	const unsigned char *p = buf;
+	size_t i;
 
-	return size;
+	for(i = 0; i < len; i++){
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
 }
 
-/* 
- * Write size bytes from buf into file starting from offset
- *
- */
-static int cs1550_write(const char *path, const char *buf, size_t size, 
-			  off_t offset, struct fuse_file_info *fi)
-{
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
-
-	int res;
-	int i = 0;
+//Log the new contents of a directory or extent block in the running
+//transaction. Caller is between txn_begin() and its commit.
+int journal_write_block(long block, const void *buf){
+	int i;
+
+	pthread_mutex_lock(&jnl_lock);
+	for(i = 0; i < jnl_count && jnl_images[i].block != block; i++);
+	if(i == jnl_count){
+		if(jnl_count == JOURNAL_TABLE_SIZE){
+			//Only after a failed commit; unprotected, but not lost
+			pthread_mutex_unlock(&jnl_lock);
+			return cache_write_block(block, buf);
+		}
+		jnl_images[jnl_count++].block = block;
+	}
+	memcpy(jnl_images[i].data, buf, BLOCK_SIZE);
+	pthread_mutex_unlock(&jnl_lock);
+	return 0;
+}
 
-	if(DEBUG)printf("In write\n");
+//Copy of a block logged but not written home yet. Returns 1 if there is one.
+int journal_read_block(long block, void *buf){
+	int i;
+	int found = 0;
 
-	cs1550_disk_block data_block[1+ offset/BLOCK_SIZE+ strlen(buf)/BLOCK_SIZE];	//For writing block
-	memset(data_block, 0, sizeof(data_block));
+	pthread_mutex_lock(&jnl_lock);
+	for(i = 0; i < jnl_count; i++){
+		if(jnl_images[i].block == block){
+			memcpy(buf, jnl_images[i].data, BLOCK_SIZE);
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&jnl_lock);
+	return found;
+}
 
-	int bytes_to_write = strlen(buf);	//Number of bytes needed to write
+//Remove image i from the table, its buffer moves to the free end.
+//Caller holds jnl_lock.
+void journal_drop(int i){
+	struct journal_image last = jnl_images[--jnl_count];
 
+	jnl_images[jnl_count] = jnl_images[i];
+	jnl_images[i] = last;
+}
 
-	strcpy(filename, "");
-	strcpy(directory, "");
-	strcpy(extension, "");
+//Drop the image of a block that was freed, so the commit does not write it
+//over whatever the block is reused for
+void journal_forget(long block){
+	int i;
 
-	if(strlen(path) > 1){
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	pthread_mutex_lock(&jnl_lock);
+	for(i = 0; i < jnl_count; i++){
+		if(jnl_images[i].block == block){
+			journal_drop(i);
+			break;
+		}
 	}
+	pthread_mutex_unlock(&jnl_lock);
+}
 
-	if(DEBUG)printf("Path: %s\n", path);
+/*
+ * Commit everything changed since the last commit as the next generation.
+ * The logged directory and extent blocks go into the journal record, the
+ * bitmaps and table blocks the other copy lacks are written to it, and once
+ * both are on disk the superblock slot of the new generation is written
+ * and synced. Only then are the logged blocks written home, since a crash
+ * before the slot lands keeps the previous generation and its blocks.
+ * Caller holds txn_lock for writing, so no operation is halfway through its
+ * changes.
+ */
+int journal_commit(void){
+	char *record = jnl_record;
+	struct cs1550_journal_header *hdr = (struct cs1550_journal_header *)record;
+	unsigned long gen = sb_generation + 1;
+	int copy = gen % 2;
+	int pending = 0;
+	long i;
+	int images;
+	int res = 0;
 
-	if(strcmp(directory, "") == 0){
-		printf("Directory cannot be empty\n");
-		res = -EPERM;
-		return res;
+	//Gather the logged images
+	memset(record, 0, BLOCK_SIZE);
+	pthread_mutex_lock(&jnl_lock);
+	images = jnl_count;
+	for(i = 0; i < images; i++){
+		hdr->blocks[i] = jnl_images[i].block;
+		memcpy(record + (1 + i) * BLOCK_SIZE, jnl_images[i].data, BLOCK_SIZE);
 	}
+	pthread_mutex_unlock(&jnl_lock);
 
-	if(strcmp(filename, "") == 0){
-		printf("Invalid file name, file name is empty %s\n", path);
-		res = -EPERM;
-		return res;
+	//Anything the current copy lacks has not been committed yet
+	pthread_mutex_lock(&alloc_lock);
+	pending = ndirty_groups[1 - copy] > 0;
+	pthread_mutex_unlock(&alloc_lock);
+	if(images == 0 && !pending){
+		return 0;
 	}
 
-	//Check file name length
-	if(strlen(filename) > MAX_FILENAME){
-		return -ENAMETOOLONG;
+	if(images > 0){
+		hdr->magic = JOURNAL_MAGIC;
+		hdr->seq = gen;
+		hdr->nBlocks = images;
+		hdr->checksum = journal_checksum(2166136261u, record, (1 + images) * BLOCK_SIZE);
+		res = disk_write(record, (1 + images) * BLOCK_SIZE, (off_t)(JOURNAL_START + copy * JOURNAL_HALF_BLOCKS) * BLOCK_SIZE);
 	}
-
-	if(strcmp(extension, "") != 0){
-		//File extension exists
-		if(strlen(extension) > MAX_EXTENSION){
-			return -ENAMETOOLONG;
-		}
+	if(res == 0){
+		pthread_mutex_lock(&alloc_lock);
+		res = write_groups(copy);
+		pthread_mutex_unlock(&alloc_lock);
 	}
-
-	get_root_block(&root_block);		//Start from the beginning
-
-    // Get directory nStartBlock
-	for(i = 0; i < root_block.nDirectories; i++){
-		if(strcmp(root_block.directories[i].dname, "") != 0 && strcmp(root_block.directories[i].dname, directory) == 0){
-			break;	//Directory found
+	if(res == 0 && fdatasync(disk_fd) != 0){
+		res = -errno;
+	}
+	if(res == 0){
+		res = write_superblock(gen, images);
+	}
+	if(res == 0 && fdatasync(disk_fd) != 0){
+		res = -errno;
+	}
+	if(res != 0){
+		LOG(LOG_ERR, "Unable to commit generation %lu\n", gen);
+		return res;		//Everything stays dirty for the next commit
+	}
+	sb_generation = gen;
+	jnl_commits++;
+	pthread_mutex_lock(&alloc_lock);
+	groups_written(copy);
+	pthread_mutex_unlock(&alloc_lock);
+
+	//Home locations; a crash from here on is repaired by journal_replay().
+	//The next commit's syncs cover these before this record's half is reused.
+	for(i = images - 1; i >= 0; i--){
+		//Through the cache so it is current before the image goes away
+		if(cache_write_block(jnl_images[i].block, jnl_images[i].data) != 0){
+			res = -EIO;
+			continue;
 		}
+		pthread_mutex_lock(&jnl_lock);
+		journal_drop(i);
+		pthread_mutex_unlock(&jnl_lock);
 	}
+	return res;
+}
 
-	if(i == root_block.nDirectories ){
-		//No directories by name found
-		printf("No such directory found\n");
-		res = -ENOENT;
-		return res;
-	}
+//Commit the running transaction. Caller holds commit_lock.
+int journal_group_commit(void){
+	pthread_rwlock_wrlock(&txn_lock);
+	commit_res = journal_commit();
+	committed_seq = txn_seq++;
+	pthread_rwlock_unlock(&txn_lock);
+	return commit_res;
+}
 
-        // found directory name, using nStartBlock, go to that block
+//Commit whatever is pending without being part of it
+int journal_flush(void){
+	int res;
 
-	FILE *fd = fopen(DISKFILE, "r+b");
-	fseek(fd, root_block.directories[i].nStartBlock*BLOCK_SIZE, SEEK_SET);	//Go to the nStartBlock
+	pthread_mutex_lock(&commit_lock);
+	res = journal_group_commit();
+	pthread_mutex_unlock(&commit_lock);
+	return res;
+}
 
-	//Subdirectory block
-	cs1550_directory_entry subdir;
-	i = fread(&subdir, BLOCK_SIZE, 1, fd);
+/*
+ * Write the journal record of the current generation home again, which
+ * finishes a commit that was interrupted after its superblock slot landed.
+ * Records of later generations never took effect and are ignored. With
+ * in_memory the images go into the running transaction's table instead,
+ * where reads find them, and nothing is written.
+ */
+int journal_replay(const struct cs1550_superblock *sb, int in_memory){
+	char *record = jnl_record;	//Free until the first commit
+	struct cs1550_journal_header *hdr = (struct cs1550_journal_header *)record;
+	unsigned int sum;
+	int i;
+	int res;
 
-	if (i < 0){
-		printf("Error: Unable to read subdirectory block\n");
-		res = -ENOENT;
+	if(sb->journal_blocks <= 0 || sb->journal_blocks > JOURNAL_MAX_IMAGES){
+		return 0;	//The commit logged no blocks
+	}
+	res = disk_read(record, (1 + sb->journal_blocks) * BLOCK_SIZE, (off_t)(JOURNAL_START + (sb->generation % 2) * JOURNAL_HALF_BLOCKS) * BLOCK_SIZE);
+	if(res != 0){
 		return res;
 	}
-
-	fclose(fd);
-
-	//Check if file already exists in subdir
-	for(i = 0; i < subdir.nFiles; i++){
-		if(strcmp(subdir.files[i].fname, filename) == 0 && 
-		   strcmp(subdir.files[i].fext, extension) == 0){
-			if(DEBUG) printf("File already exists\n");
-			res = 0;
-			break;
+	sum = hdr->checksum;
+	hdr->checksum = 0;
+	if(hdr->magic != JOURNAL_MAGIC || hdr->seq != sb->generation || hdr->nBlocks != sb->journal_blocks
+		|| journal_checksum(2166136261u, record, (1 + hdr->nBlocks) * BLOCK_SIZE) != sum){
+		LOG(LOG_ERR, "Journal record %lu is damaged\n", sb->generation);
+		return -EIO;
+	}
+	for(i = 0; res == 0 && i < hdr->nBlocks; i++){
+		if(hdr->blocks[i] < FIRST_DIR_BLOCK || hdr->blocks[i] >= MAX_NUM_BLOCKS){
+			continue;
+		}
+		if(in_memory){
+			res = journal_write_block(hdr->blocks[i], record + (1 + i) * BLOCK_SIZE);
+		}
+		else{
+			res = disk_write_block(hdr->blocks[i], record + (1 + i) * BLOCK_SIZE);
 		}
-		//???? check if not exists
 	}
-	
-	//???? check if not exists
-	if( i== subdir.nFiles ){
-		if(DEBUG) printf("write(), File %s.%s does not exist\n", filename, extension);
-		res = -ENOENT;
-		return res;	
+	if(res == 0 && !in_memory && fdatasync(disk_fd) != 0){
+		res = -errno;
 	}
-	
-	//check to make sure path exists
-	//check that size is > 0
+	if(DEBUG)printf("Journal: replayed %d blocks of record %lu\n", hdr->nBlocks, sb->generation);
+	return res;
+}
 
-	if(size <= 0){
-		printf("Error: Size cannot be 0\n");
-		return -ENOENT;
-	}
-	//check that offset is <= to the file size
+//Checksum of the resident group table, as recorded for a copy
+unsigned int copy_checksum(void){
+	return journal_checksum(2166136261u, table_sums, TABLE_BLOCKS * sizeof(unsigned int));
+}
 
-	if(DEBUG)printf("Offset: %ld	File size: %ld\n", offset, subdir.files[i].fsize);
-	if(offset > subdir.files[i].fsize*BLOCK_SIZE){
-		printf("Error: offset out of bounds\n");
-		res = -EFBIG;
-		return res;
-	}
+//Bring the checksum of group table block tb up to date
+void table_sum(long tb){
+	table_sums[tb] = journal_checksum(2166136261u, (char *)group_table + tb * BLOCK_SIZE, BLOCK_SIZE);
+}
 
-	//Need to get to block in offset range
-	int offset_block = offset / BLOCK_SIZE;
+//Write the slot of generation, describing the resident group table
+int write_superblock(unsigned long generation, int journal_blocks){
+	struct cs1550_superblock sb;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = SUPER_MAGIC;
+	sb.generation = generation;
+	sb.copy_checksum = copy_checksum();
+	sb.journal_blocks = journal_blocks;
+	sb.block_size = BLOCK_SIZE;
+	sb.num_blocks = MAX_NUM_BLOCKS;
+	sb.table_blocks = TABLE_BLOCKS;
+	sb.journal_start = JOURNAL_START;
+	sb.first_dir_block = FIRST_DIR_BLOCK;
+	sb.version = SUPER_VERSION;
+	sb.checksum = journal_checksum(2166136261u, &sb, sizeof(sb));
+	return disk_write(&sb, sizeof(sb), (off_t)(generation % 2) * SUPER_SLOT_SIZE);
+}
 
-    //Jump to offset block for writing
+int read_superblock(int slot, struct cs1550_superblock *sb){
+	return disk_read(sb, sizeof(*sb), (off_t)slot * SUPER_SLOT_SIZE);
+}
 
-	fd = fopen(DISKFILE, "r+b");
-	fseek(fd, (subdir.files[i].nStartBlock*BLOCK_SIZE) + offset_block, SEEK_SET);    //Go to location of file
-	//Read block
-	fread(&data_block, BLOCK_SIZE, 1, fd);
+//Slot that is not torn, whatever layout it is for
+int super_intact(const struct cs1550_superblock *sb){
+	struct cs1550_superblock copy = *sb;
 
-	//Copy data starting at offset and until BLOCK_SIZE
-	//Get starting point from offset_block
+	copy.checksum = 0;
+	return sb->magic == SUPER_MAGIC && journal_checksum(2166136261u, &copy, sizeof(copy)) == sb->checksum;
+}
 
-	if(DEBUG)printf("Write() file nStartBlock %ld\n", subdir.files[i].nStartBlock);
+//Intact slot whose geometry is one this build lays out the same way. The
+//geometry is put in *g.
+int super_valid(const struct cs1550_superblock *sb, struct cs1550_geometry *g){
+	return super_intact(sb) && sb->version == SUPER_VERSION
+		&& geo_compute(g, sb->block_size, sb->num_blocks) == 0 && sb->table_blocks == g->table_blocks
+		&& sb->journal_start == g->journal_start && sb->first_dir_block == g->first_dir_block;
+}
 
-	//Copy from offset start to end of data portion
-	if(DEBUG)printf("Write() Data to be written: %s	bytes to write %d\n", buf,  bytes_to_write);
- 	memcpy(&data_block[0].data[offset%BLOCK_SIZE], buf, bytes_to_write);
-	
-	int bytes = fwrite(&data_block[0], bytes_to_write, 1, fd);
+/*
+ * Layout of an image with block_size byte blocks and num_blocks of them.
+ * Everything after the superblock slots follows from those two.
+ */
+int geo_compute(struct cs1550_geometry *g, int block_size, long num_blocks){
+	memset(g, 0, sizeof(*g));
+	if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0){
+		return -EINVAL;
+	}
+	if(num_blocks <= 0 || num_blocks > (LONG_MAX >> 1) / block_size){
+		return -EFBIG;		//Byte offsets are off_t
+	}
+	g->block_size = block_size;
+	g->block_shift = __builtin_ctz(block_size);
+	g->num_blocks = num_blocks;
+	g->files_per_dir = (block_size - sizeof(int)) / sizeof(struct cs1550_file_directory);
+	g->index_entries = (block_size - 3 * sizeof(int)) / sizeof(struct cs1550_index_entry);
+	g->extents_per_block = (block_size - sizeof(int)) / sizeof(struct cs1550_extent);
+	g->group_shift = g->block_shift + 3;	//One bit per block in a bitmap block
+	g->groups = (num_blocks + (1L << g->group_shift) - 1) >> g->group_shift;
+	g->table_blocks = (g->groups * (long)sizeof(struct cs1550_group) + block_size - 1) / block_size;
+	g->super_blocks = (2 * SUPER_SLOT_SIZE + block_size - 1) / block_size;
+	g->copy_blocks = g->table_blocks + g->groups;
+	g->journal_start = g->super_blocks + 2 * g->copy_blocks;
+	g->first_dir_block = g->journal_start + JOURNAL_BLOCKS;
+	g->first_file_block = g->first_dir_block + 1;
+	if(g->first_file_block + MIN_FILE_BLOCKS > num_blocks){
+		return -ENOSPC;		//No room left for files
+	}
+	return 0;
+}
 
-	if(DEBUG)printf("write(), Bytes written %d, %s\n", bytes,&data_block[0].data[0] );
+//Make g the mounted geometry and size the tables that depend on it
+int geo_setup(const struct cs1550_geometry *g){
+	int i;
+
+	geo_free();
+	geo = *g;
+	group_table = calloc(TABLE_BLOCKS, BLOCK_SIZE);
+	table_sums = calloc(TABLE_BLOCKS, sizeof(unsigned int));
+	group_maps = calloc(NUM_GROUPS, sizeof(uint64_t *));
+	loaded_groups = malloc(NUM_GROUPS * sizeof(long));
+	group_io = malloc((size_t)GROUP_IO_BLOCKS * BLOCK_SIZE);
+	jnl_data = malloc((size_t)JOURNAL_TABLE_SIZE * BLOCK_SIZE);
+	jnl_record = malloc((size_t)JOURNAL_HALF_BLOCKS * BLOCK_SIZE);
+	for(i = 0; i < 2; i++){
+		group_dirty[i] = calloc(NUM_GROUPS, 1);
+		dirty_groups[i] = malloc(NUM_GROUPS * sizeof(long));
+	}
+	if(group_table == NULL || table_sums == NULL || group_maps == NULL || loaded_groups == NULL || group_io == NULL
+		|| jnl_data == NULL || jnl_record == NULL || group_dirty[0] == NULL || group_dirty[1] == NULL
+		|| dirty_groups[0] == NULL || dirty_groups[1] == NULL){
+		geo_free();
+		return -ENOMEM;
+	}
+	for(i = 0; i < JOURNAL_TABLE_SIZE; i++){
+		jnl_images[i].data = jnl_data + (size_t)i * BLOCK_SIZE;
+	}
+	return 0;
+}
 
-	fclose(fd);
+void geo_free(void){
+	int i;
 
-	for(i = 0; i < strlen(buf)%BLOCK_SIZE; i++){		//Get and reserve as many blocks needed for file write/append
-		get_free_nStartBlock(&FAT_buf, 1);
-		write_FAT_block(FAT_buf);
+	if(group_maps != NULL){
+		group_drop();
 	}
-   	//Write EOF marker
-	i=get_free_nStartBlock(&FAT_buf, 1);
-        FAT_buf.nStartBlock[i]= EOF;
-	write_FAT_block(FAT_buf);
+	free(group_table);
+	free(table_sums);
+	free(group_maps);
+	free(loaded_groups);
+	free(group_io);
+	free(jnl_data);
+	free(jnl_record);
+	group_table = NULL;
+	table_sums = NULL;
+	group_maps = NULL;
+	loaded_groups = NULL;
+	group_io = NULL;
+	jnl_data = NULL;
+	jnl_record = NULL;
+	for(i = 0; i < 2; i++){
+		free(group_dirty[i]);
+		free(dirty_groups[i]);
+		group_dirty[i] = NULL;
+		dirty_groups[i] = NULL;
+		ndirty_groups[i] = 0;
+	}
+	jnl_count = 0;
+	memset(&geo, 0, sizeof(geo));
+}
 
-	//write data
-	//set size (should be same as input) and return, or error
-    //???? 
-	size = bytes_to_write;
-	
-	return size;
+//Set bits from through to - 1 of a bitmap
+void bits_set(uint64_t *bits, long from, long to){
+	for(; from < to && from % 64 != 0; from++){
+		bits[from / 64] |= 1ULL << (from % 64);
+	}
+	for(; from + 64 <= to; from += 64){
+		bits[from / 64] = ~0ULL;
+	}
+	for(; from < to; from++){
+		bits[from / 64] |= 1ULL << (from % 64);
+	}
 }
 
-/******************************************************************************
+//Bitmap of group g as it is when the volume is empty: the superblocks,
+//copies, journal and root directory and anything past the end of the
+//volume are in use. Returns its free count.
+long group_empty(long g, uint64_t *bits){
+	long base = g << GROUP_SHIFT;
+
+	memset(bits, 0, BLOCK_SIZE);
+	bits_set(bits, 0, MIN(FIRST_FILE_BLOCK, base + GROUP_BLOCKS) - base);
+	bits_set(bits, MAX(MAX_NUM_BLOCKS, base) - base, GROUP_BLOCKS);
+	return MAX(0, MIN(MAX_NUM_BLOCKS, base + GROUP_BLOCKS) - MAX(FIRST_FILE_BLOCK, base));
+}
+
+/*
+ * Lay out an empty filesystem with the mounted geometry: both copies empty,
+ * generations 0 and 1, and an empty root directory. The bitmaps go out
+ * GROUP_IO_BLOCKS at a time and none of them stay loaded.
+ */
+int format_disk(void){
+	long g;
+	long i;
+	long n;
+	int c;
+	int res = 0;
+
+	memset(group_table, 0, TABLE_BLOCKS * BLOCK_SIZE);
+	group_drop();
+	for(g = 0; g < NUM_GROUPS && res == 0; g += n){
+		n = MIN(GROUP_IO_BLOCKS, NUM_GROUPS - g);
+		for(i = 0; i < n; i++){
+			char *bits = group_io + i * BLOCK_SIZE;
+
+			group_table[g + i].nFree = group_empty(g + i, (uint64_t *)bits);
+			group_table[g + i].checksum = journal_checksum(2166136261u, bits, BLOCK_SIZE);
+		}
+		for(c = 0; c < 2 && res == 0; c++){
+			res = disk_write(group_io, n * BLOCK_SIZE, (off_t)BITMAP_COPY(c, g) * BLOCK_SIZE);
+		}
+	}
+	for(i = 0; i < TABLE_BLOCKS; i++){
+		table_sum(i);
+	}
+	for(c = 0; c < 2 && res == 0; c++){
+		res = disk_write(group_table, TABLE_BLOCKS * BLOCK_SIZE, (off_t)TABLE_COPY(c) * BLOCK_SIZE);
+	}
+	if(res == 0){
+		memset(group_io, 0, BLOCK_SIZE);	//A leaf with no entries
+		res = disk_write_block(FIRST_DIR_BLOCK, group_io);
+	}
+	if(res != 0){
+		return res;
+	}
+	if(fdatasync(disk_fd) != 0){
+		return -errno;
+	}
+	res = write_superblock(0, 0);
+	if(res == 0){
+		res = write_superblock(1, 0);
+	}
+	if(res == 0 && fdatasync(disk_fd) != 0){
+		res = -errno;
+	}
+	return res;
+}
+
+//Format a blank image with DEFAULT_BLOCK_SIZE blocks filling the image file
+int format_blank(void){
+	struct cs1550_geometry g;
+	struct stat st;
+	int res;
+
+	if(fstat(disk_fd, &st) != 0){
+		return -errno;
+	}
+	res = geo_compute(&g, DEFAULT_BLOCK_SIZE, st.st_size / DEFAULT_BLOCK_SIZE);
+	if(res == 0){
+		res = geo_setup(&g);
+	}
+	if(res == 0){
+		res = format_disk();
+	}
+	return res;
+}
+
+/*
+ * Called at mount. Loads the copy of the newest superblock slot that is
+ * intact and whose copy checksums correctly, falling back to the other
+ * slot, and finishes its commit from the journal. Two superblock slots, one
+ * copy's group table and at most one journal record are read
+ * whatever the disk holds. An image without any valid slot is formatted,
+ * unless it is one of an older layout. The geometry is the slot's.
+ */
+int load_superblock(void){
+	struct cs1550_superblock sb;
+	int res = load_copy(&sb, 1);
+
+	if(res == 0){
+		res = journal_replay(&sb, 0);
+	}
+	return res;
+}
+
+//Load the group table of the best slot, which is copied to *cur.
+//Without format an image with no usable slot is left alone and -EIO
+//returned.
+int load_copy(struct cs1550_superblock *cur, int format){
+	struct cs1550_superblock sb[2];
+	struct cs1550_geometry g[2];
+	int newest;
+	int older = 0;
+	int pass;
+	int i;
+	int k;
+	int res;
+
+	for(pass = 0; pass < 2; pass++){
+		for(i = 0; i < 2; i++){
+			if(read_superblock(i, &sb[i]) != 0 || !super_valid(&sb[i], &g[i])){
+				older |= super_intact(&sb[i]) && sb[i].version != SUPER_VERSION;
+				sb[i].magic = 0;
+			}
+		}
+		newest = (sb[1].magic != 0 && (sb[0].magic == 0 || sb[1].generation > sb[0].generation)) ? 1 : 0;
+		for(i = 0; i < 2; i++){
+			k = i == 0 ? newest : 1 - newest;
+			*cur = sb[k];
+			if(cur->magic == 0){
+				continue;
+			}
+			if(memcmp(&g[k], &geo, sizeof(geo)) != 0 && geo_setup(&g[k]) != 0){
+				return -ENOMEM;
+			}
+			sb_generation = cur->generation;
+			res = load_groups();
+			if(res == 0 && copy_checksum() == cur->copy_checksum){
+				if(i > 0){
+					LOG(LOG_WARN, "Superblock %lu is damaged, using %lu\n", sb[newest].generation, cur->generation);
+				}
+				//The other copy is older, the first commit rewrites all of it
+				group_stale(1 - sb_generation % 2);
+				count_free();
+				return 0;
+			}
+		}
+		if(pass == 0 && format && !older){
+			LOG(LOG_WARN, "No valid superblock on %s, formatting it\n", disk_path);
+			res = format_blank();
+			if(res != 0){
+				return res;
+			}
+		}
+		else{
+			break;
+		}
+	}
+	if(older){
+		LOG(LOG_ERR, "%s has an older layout, format it again with cs1550_mkfs -f\n", disk_path);
+	}
+	return -EIO;
+}
+
+//Read the group table of the current copy. No bitmap is loaded until a
+//search or a change needs it.
+int load_groups(void){
+	long i;
+	int res;
+
+	group_drop();
+	res = disk_read(group_table, TABLE_BLOCKS * BLOCK_SIZE, (off_t)TABLE_COPY(sb_generation % 2) * BLOCK_SIZE);
+	if(res != 0){
+		return res;
+	}
+	for(i = 0; i < TABLE_BLOCKS; i++){
+		table_sum(i);
+	}
+	return 0;
+}
+
+//Free blocks from the table, without loading any bitmap. Resets the hints
+//too.
+void count_free(void){
+	long g;
+
+	pthread_mutex_lock(&alloc_lock);
+	free_count = 0;
+	reserved_count = 0;
+	for(g = 0; g < NUM_GROUPS; g++){
+		free_count += group_table[g].nFree;
+	}
+	free_hint[0] = FIRST_FILE_BLOCK;
+	free_hint[1] = FIRST_FILE_BLOCK;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//Drop every loaded bitmap and forget which groups were dirty
+void group_drop(void){
+	long i;
+
+	for(i = 0; i < groups_loaded; i++){
+		free(group_maps[loaded_groups[i]]);
+		group_maps[loaded_groups[i]] = NULL;
+	}
+	groups_loaded = 0;
+	for(i = 0; i < 2; i++){
+		memset(group_dirty[i], 0, NUM_GROUPS);
+		ndirty_groups[i] = 0;
+	}
+}
+
+//Record that copy lacks the current bitmap of group g
+void group_touch(long g, int copy){
+	if(!group_dirty[copy][g]){
+		group_dirty[copy][g] = 1;
+		dirty_groups[copy][ndirty_groups[copy]++] = g;
+	}
+}
+
+//Record that copy lacks every bitmap, as after mount for the older copy
+void group_stale(int copy){
+	long g;
+
+	for(g = 0; g < NUM_GROUPS; g++){
+		group_touch(g, copy);
+	}
+}
+
+//Drop one loaded bitmap the current copy holds as it is, in clock order
+void group_evict(void){
+	int copy = sb_generation % 2;
+	long i;
+	long g;
+
+	for(i = 0; i < groups_loaded; i++){
+		group_clock = (group_clock + 1) % groups_loaded;
+		g = loaded_groups[group_clock];
+		if(!group_dirty[copy][g]){
+			free(group_maps[g]);
+			group_maps[g] = NULL;
+			loaded_groups[group_clock] = loaded_groups[--groups_loaded];
+			return;
+		}
+	}
+}
+
+//Bitmap of group g, read from the current copy the first time it is
+//needed. NULL if it cannot be read or does not match the group table.
+//Caller holds alloc_lock.
+uint64_t *group_map(long g){
+	uint64_t *bits = group_maps[g];
+
+	if(bits != NULL){
+		return bits;
+	}
+	if(groups_loaded * BLOCK_SIZE >= GROUP_CACHE_BYTES){
+		group_evict();
+	}
+	bits = malloc(BLOCK_SIZE);
+	if(bits == NULL){
+		return NULL;
+	}
+	if(disk_read_block(BITMAP_COPY(sb_generation % 2, g), bits) != 0
+		|| journal_checksum(2166136261u, bits, BLOCK_SIZE) != group_table[g].checksum){
+		LOG(LOG_ERR, "Bitmap of group %ld is damaged\n", g);
+		free(bits);
+		return NULL;
+	}
+	group_maps[g] = bits;
+	loaded_groups[groups_loaded++] = g;
+	return bits;
+}
+
+int long_cmp(const void *a, const void *b){
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Write the bitmaps copy lacks, and the group table blocks describing them,
+ * to copy. Runs of adjacent groups go out with one request. A bitmap that
+ * is not loaded has not changed since the current copy, so it is copied
+ * from there. The checksums in the table are brought up to date on the way.
+ * Caller holds txn_lock for writing, so nothing is being allocated.
+ */
+int write_groups(int copy){
+	long *list = dirty_groups[copy];
+	long n = ndirty_groups[copy];
+	long tb = -1;
+	long i;
+	long j;
+	long k;
+	int res = 0;
+
+	qsort(list, n, sizeof(long), long_cmp);
+	for(i = 0; res == 0 && i < n; i = j){
+		for(j = i + 1; j < n && j - i < GROUP_IO_BLOCKS && list[j] == list[j - 1] + 1; j++);
+		for(k = i; res == 0 && k < j; k++){
+			char *buf = group_io + (k - i) * BLOCK_SIZE;
+
+			if(group_maps[list[k]] != NULL){
+				memcpy(buf, group_maps[list[k]], BLOCK_SIZE);
+				group_table[list[k]].checksum = journal_checksum(2166136261u, buf, BLOCK_SIZE);
+			}
+			else{
+				res = disk_read_block(BITMAP_COPY(1 - copy, list[k]), buf);
+			}
+		}
+		if(res == 0){
+			res = disk_write(group_io, (j - i) * BLOCK_SIZE, (off_t)BITMAP_COPY(copy, list[i]) * BLOCK_SIZE);
+		}
+	}
+	for(i = 0; res == 0 && i < n; i++){
+		if(list[i] / GROUPS_PER_TABLE_BLOCK != tb){
+			tb = list[i] / GROUPS_PER_TABLE_BLOCK;
+			table_sum(tb);
+			res = disk_write_block(TABLE_COPY(copy) + tb, (char *)group_table + tb * BLOCK_SIZE);
+		}
+	}
+	return res;
+}
+
+//The groups of copy are all written, forget they were dirty
+void groups_written(int copy){
+	long i;
+
+	for(i = 0; i < ndirty_groups[copy]; i++){
+		group_dirty[copy][dirty_groups[copy][i]] = 0;
+	}
+	ndirty_groups[copy] = 0;
+}
+
+//Is block in use? A bitmap that cannot be read counts as all in use.
+//Caller holds alloc_lock.
+int block_in_use(long block){
+	uint64_t *bits = group_map(block >> GROUP_SHIFT);
+	long i = block & (GROUP_BLOCKS - 1);
+
+	return bits == NULL || (bits[i / 64] & (1ULL << (i % 64))) != 0;
+}
+
+//Mark one block in use or free in its group, which then needs writing to
+//both copies. Returns 1 if that changed the bitmap, 0 if the block already
+//was or its bitmap cannot be read, so the caller only counts real changes.
+//Caller holds alloc_lock.
+int set_block(long block, int value){
+	long g = block >> GROUP_SHIFT;
+	uint64_t *bits = group_map(g);
+	long i = block & (GROUP_BLOCKS - 1);
+	uint64_t bit = 1ULL << (i % 64);
+
+	if(bits == NULL){
+		return 0;	//Damaged, fsck rebuilds it
+	}
+	if(((bits[i / 64] & bit) != 0) == (value == USED)){
+		return 0;
+	}
+	if(value == USED){
+		bits[i / 64] |= bit;
+		group_table[g].nFree--;
+	}
+	else{
+		bits[i / 64] &= ~bit;
+		group_table[g].nFree++;
+	}
+	group_touch(g, 0);
+	group_touch(g, 1);
+	return 1;
+}
+
+//First block past group g that is in the volume
+#define GROUP_END(g) MIN(((g) + 1) << GROUP_SHIFT, MAX_NUM_BLOCKS)
+
+//First free block in [from, to), or -1. Groups without free blocks are
+//passed over on their count, the others are scanned 64 blocks at a time.
+long find_free_block(long from, long to){
+	uint64_t *bits;
+	uint64_t x;
+	long base;
+	long end;
+	long w;
+	long g;
+
+	while(from < to){
+		g = from >> GROUP_SHIFT;
+		base = g << GROUP_SHIFT;
+		end = MIN(GROUP_END(g), to);
+		if(group_table[g].nFree > 0 && (bits = group_map(g)) != NULL){
+			w = (from - base) / 64;
+			x = ~bits[w] & (~0ULL << ((from - base) % 64));	//Ignore blocks before from
+			for(;;){
+				if(x != 0){
+					long block = base + w * 64 + __builtin_ctzll(x);
+
+					if(block < end){
+						return block;
+					}
+					break;
+				}
+				if(++w >= (end - base + 63) / 64){
+					break;
+				}
+				x = ~bits[w];
+			}
+		}
+		from = end;
+	}
+	return -1;
+}
+
+/*
+ * Allocate count blocks in one pass and store their numbers in blocks[].
+ * Directory and file blocks share the data area but keep separate rotating
+ * hints, so directory blocks stay near each other and away from file runs.
+ * The search wraps once, so a nearly full disk is not rescanned from the
+ * start on every call. Directory blocks (file_flag 0) may not dip into
+ * space reserved for delayed writes; file blocks are already covered by
+ * the caller's reservation. Returns the number allocated, or -1 (with
+ * nothing allocated) if there are not enough free blocks. The caller
+ * writes the bitmaps back once through commit_metadata().
+ */
+long alloc_blocks(long count, long *blocks, int file_flag){
+	long n = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	n = alloc_blocks_locked(count, blocks, file_flag);
+	pthread_mutex_unlock(&alloc_lock);
+	return n;
+}
+
+long alloc_blocks_locked(long count, long *blocks, int file_flag){
+	long first = FIRST_FILE_BLOCK;
+	long last = MAX_NUM_BLOCKS;
+	long hint = free_hint[file_flag ? 1 : 0];
+	long n = 0;
+	long block = hint;
+	int wrapped = 0;
+
+	if(!file_flag && count > free_count - reserved_count){
+		return -1;
+	}
+	if(hint < first || hint >= last){
+		hint = block = first;
+	}
+	while(n < count){
+		block = find_free_block(block, wrapped ? hint : last);
+		if(block < 0){
+			if(wrapped || hint == first){
+				break;
+			}
+			wrapped = 1;	//Wrap around to the start of the region
+			block = first;
+			continue;
+		}
+		free_count -= set_block(block, USED);
+		blocks[n++] = block++;
+	}
+	if(n < count){
+		//Not enough space, give back what was taken
+		while(n > 0){
+			free_block(blocks[--n]);
+		}
+		return -1;
+	}
+	free_hint[file_flag ? 1 : 0] = block;
+	return n;
+}
+
+//Mark a block free. Caller holds alloc_lock.
+void free_block(long block){
+	if(block < FIRST_FILE_BLOCK || block >= MAX_NUM_BLOCKS || !block_in_use(block)){
+		return;
+	}
+	journal_forget(block);
+	free_count += set_block(block, UNUSED);
+}
+
+//Allocate a single block, returns its number or -1 if the disk is full.
+//Caller holds alloc_lock.
+long get_free_nStartBlock(int file_flag){
+	long block;
+
+	if(alloc_blocks_locked(1, &block, file_flag) != 1){
+		return -1;	//Return -1 if unable to find any free blocks
+	}
+	return block;	//Return block number
+}
+
+//First used block in [from, to), or to if they are all free. Groups
+//without used blocks are passed over on their count.
+long find_used_block(long from, long to){
+	uint64_t *bits;
+	uint64_t x;
+	long base;
+	long end;
+	long w;
+	long g;
+
+	while(from < to){
+		g = from >> GROUP_SHIFT;
+		base = g << GROUP_SHIFT;
+		end = MIN(GROUP_END(g), to);
+		if(group_table[g].nFree < GROUP_END(g) - base){
+			bits = group_map(g);
+			if(bits == NULL){
+				return from;
+			}
+			w = (from - base) / 64;
+			x = bits[w] & (~0ULL << ((from - base) % 64));
+			for(;;){
+				if(x != 0){
+					long block = base + w * 64 + __builtin_ctzll(x);
+
+					if(block < end){
+						return block;
+					}
+					break;
+				}
+				if(++w >= (end - base + 63) / 64){
+					break;
+				}
+				x = bits[w];
+			}
+		}
+		from = end;
+	}
+	return to;
+}
+
+/*
+ * Find a free run of up to want file blocks without taking it. A run
+ * continuing at goal is preferred so a growing file stays in one extent.
+ * Otherwise the first run from the hint that is long enough is used, or
+ * the longest one on the disk if none is. Returns the first block and the
+ * run length in *len, or -1 if the disk is full. Caller holds alloc_lock.
+ */
+long find_run(long goal, long want, long *len){
+	long first = FIRST_FILE_BLOCK;
+	long hint = free_hint[1];
+	long best = -1;
+	long best_len = 0;
+	long block;
+	long end;
+	int wrapped = 0;
+
+	if(goal >= first && goal < MAX_NUM_BLOCKS && !block_in_use(goal)){
+		*len = find_used_block(goal, MIN(goal + want, MAX_NUM_BLOCKS)) - goal;
+		return goal;
+	}
+
+	if(hint < first || hint >= MAX_NUM_BLOCKS){
+		hint = first;
+	}
+	block = hint;
+	for(;;){
+		block = find_free_block(block, wrapped ? hint : MAX_NUM_BLOCKS);
+		if(block < 0){
+			if(wrapped || hint == first){
+				break;
+			}
+			wrapped = 1;	//Wrap around to the start of the region
+			block = first;
+			continue;
+		}
+		end = find_used_block(block, MIN(block + want, MAX_NUM_BLOCKS));
+		if(end - block > best_len){
+			best = block;
+			best_len = end - block;
+		}
+		if(best_len >= want){
+			break;
+		}
+		block = end;
+	}
+	*len = best_len;
+	return best;
+}
+
+//Mark count blocks from start in use. Caller holds alloc_lock.
+void take_run(long start, long count){
+	long i;
+
+	for(i = start; i < start + count; i++){
+		free_count -= set_block(i, USED);
+	}
+}
+
+//Allocate one run of up to want file blocks, see find_run(). A run that
+//cannot continue at goal is looked for with room to grow, like a new file.
+//Returns its length with the first block in *start, or 0 if the disk is
+//full. Caller holds alloc_lock.
+long alloc_run_locked(long goal, long want, long *start){
+	long len = 0;
+
+	*start = find_run(goal, want < NEW_FILE_RUN ? NEW_FILE_RUN : want, &len);
+	if(*start < 0){
+		return 0;
+	}
+	if(*start != goal){
+		free_hint[1] = *start + len;
+	}
+	len = MIN(len, want);
+	take_run(*start, len);
+	return len;
+}
+
+//Free count blocks from start. Caller holds alloc_lock.
+void free_run(long start, long count){
+	long i;
+
+	for(i = start; i < start + count; i++){
+		free_block(i);
+	}
+}
+
+//Gather the runs of a file from its directory entry and its extent block
+int load_extents(const struct cs1550_file_directory *file, struct extent_map *map){
+	struct cs1550_extent_block eb;
+	int i;
+	int n;
+
+	map->n = 0;
+	map->blocks = 0;
+	for(i = 0; i < INLINE_EXTENTS && file->extents[i].count > 0; i++){
+		map->ext[map->n++] = file->extents[i];
+	}
+	if(file->nExtentBlock > 0){
+		if(cache_read_block(file->nExtentBlock, &eb) != 0){
+			return -EIO;
+		}
+		n = MIN(eb.nExtents, (int)EXTENTS_PER_BLOCK);
+		for(i = 0; i < n; i++){
+			map->ext[map->n++] = eb.extents[i];
+		}
+	}
+	for(i = 0; i < map->n; i++){
+		map->blocks += map->ext[i].count;
+	}
+	return 0;
+}
+
+//Put the runs back: the first ones in the entry, the rest in its extent
+//block, which grow_extents() has allocated by then
+int store_extents(struct cs1550_file_directory *file, const struct extent_map *map){
+	struct cs1550_extent_block eb;
+	int i;
+
+	memset(file->extents, 0, sizeof(file->extents));
+	for(i = 0; i < map->n && i < INLINE_EXTENTS; i++){
+		file->extents[i] = map->ext[i];
+	}
+	if(map->n > 0){
+		file->nStartBlock = map->ext[0].start;
+	}
+	if(map->n <= INLINE_EXTENTS){
+		return 0;
+	}
+	if(file->nExtentBlock <= 0){
+		return -EIO;
+	}
+	memset(&eb, 0, sizeof(eb));
+	eb.nExtents = map->n - INLINE_EXTENTS;
+	memcpy(eb.extents, &map->ext[INLINE_EXTENTS], eb.nExtents * sizeof(struct cs1550_extent));
+	return journal_write_block(file->nExtentBlock, &eb);
+}
+
+/*
+ * Add count blocks to the end of a file. The last run is extended in place
+ * while the blocks after it are free, otherwise new runs are taken as long
+ * as possible. If the runs no longer fit in the directory entry the extent
+ * block is allocated too, *ext_block holds it (0 if the file has none yet).
+ * Either everything is allocated or nothing is. reserved is what the
+ * caller set aside with reserve_blocks(); it may be used here and is all
+ * given back on success. The bitmaps are left dirty for the caller's
+ * commit_metadata().
+ */
+int grow_extents(struct extent_map *map, long count, long *ext_block, long reserved){
+	static __thread struct extent_map grown;
+	struct cs1550_extent *last;
+	long goal;
+	long start;
+	long len = 0;
+	long i;
+	int res = 0;
+
+	memcpy(&grown, map, EXTENT_MAP_SIZE(map));
+	pthread_mutex_lock(&alloc_lock);
+	if(count > free_count - reserved_count + reserved){
+		count = 0;	//The free blocks are promised to buffered writes
+		res = -ENOSPC;
+	}
+	while(count > 0){
+		last = grown.n > 0 ? &grown.ext[grown.n - 1] : NULL;
+		goal = last != NULL ? last->start + last->count : -1;
+		len = alloc_run_locked(goal, count, &start);
+		if(len == 0){
+			res = -ENOSPC;
+			break;
+		}
+		grown.blocks += len;
+		count -= len;
+		if(last != NULL && start == goal){
+			last->count += len;
+		}
+		else if(grown.n < (int)MAX_EXTENTS){
+			grown.ext[grown.n].start = start;
+			grown.ext[grown.n].count = len;
+			grown.n++;
+		}
+		else{
+			free_run(start, len);	//Too fragmented to describe
+			grown.blocks -= len;
+			res = -ENOSPC;
+			break;
+		}
+	}
+	if(res == 0 && grown.n > INLINE_EXTENTS && *ext_block <= 0){
+		if(alloc_blocks_locked(1, &start, 1) != 1){
+			res = -ENOSPC;
+		}
+		else{
+			*ext_block = start;
+		}
+	}
+	if(res != 0){
+		//Give back the blocks added by this call
+		for(i = map->blocks; i < grown.blocks; i += len){
+			start = map_block(&grown, i, &len, NULL);
+			if(start < 0){
+				break;	//Past the runs, nothing more was added
+			}
+			len = MIN(len, grown.blocks - i);
+			free_run(start, len);
+		}
+	}
+	else{
+		memcpy(map, &grown, EXTENT_MAP_SIZE(&grown));
+		reserved_count -= reserved;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return res;
+}
+
+//Set count free blocks aside for data that is buffered until write back,
+//so running out of space is still reported by write()
+int reserve_blocks(long count){
+	int res = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	if(count > free_count - reserved_count){
+		res = -ENOSPC;
+	}
+	else{
+		reserved_count += count;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return res;
+}
+
+void unreserve_blocks(long count){
+	pthread_mutex_lock(&alloc_lock);
+	reserved_count -= count;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+//Free all blocks of a file, its extent block included
+void free_extents(const struct cs1550_file_directory *file){
+	struct extent_map map;
+	int i;
+
+	if(load_extents(file, &map) != 0){
+		map.n = 0;	//Unreadable extent block, only the inline runs go
+		for(i = 0; i < INLINE_EXTENTS && file->extents[i].count > 0; i++){
+			map.ext[map.n++] = file->extents[i];
+		}
+	}
+	pthread_mutex_lock(&alloc_lock);
+	for(i = 0; i < map.n; i++){
+		free_run(map.ext[i].start, map.ext[i].count);
+	}
+	if(file->nExtentBlock > 0){
+		free_block(file->nExtentBlock);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Physical block holding block number index of a file, or -1 past its last
+ * run. *run is set to how many blocks from there on are contiguous. With a
+ * cursor the search starts at the run the previous request ended in when
+ * that is not past index. Runs are only added at the end, so a cursor
+ * stays valid until a truncate takes runs away and bumps extent_trims.
+ */
+long map_block(const struct extent_map *map, long index, long *run, struct extent_cursor *cursor){
+	long first = 0;
+	int i = 0;
+
+	if(map->n == 0){
+		return -1;
+	}
+	if(cursor != NULL && cursor->start == map->ext[0].start && cursor->extent < map->n
+		&& cursor->block == map->ext[cursor->extent].start && cursor->index <= index
+		&& cursor->trims == __atomic_load_n(&extent_trims, __ATOMIC_RELAXED)){
+		i = cursor->extent;
+		first = cursor->index;
+	}
+	for(; i < map->n; i++){
+		if(index < first + map->ext[i].count){
+			if(cursor != NULL){
+				cursor->start = map->ext[0].start;
+				cursor->index = first;
+				cursor->extent = i;
+				cursor->block = map->ext[i].start;
+				cursor->trims = __atomic_load_n(&extent_trims, __ATOMIC_RELAXED);
+			}
+			*run = first + map->ext[i].count - index;
+			return map->ext[i].start + (index - first);
+		}
+		first += map->ext[i].count;
+	}
+	return -1;
+}
+
+/*
+ * Read engine: copy up to size bytes at offset of file into buf. Each run
+ * of the file is read with one request, only a partial first or last block
+ * goes through a bounce buffer. Returns the number of bytes read,
+ * min(size, fsize - offset). cursor, if given, is used for the mapping and
+ * left at the last run read.
+ */
+static inline __attribute__((always_inline)) int read_file_data_bs(const struct cs1550_file_directory *file, char *buf, size_t size, off_t offset, struct extent_cursor *cursor, const size_t bs){
+	struct extent_map map;
+	char tmp[bs];
+	size_t end;
+	size_t pos = offset;
+	size_t run_end;
+	long block;
+	long run;
+	int res;
+
+	if((size_t)offset >= file->fsize || size == 0){
+		return 0;
+	}
+	end = MIN(file->fsize, offset + size);
+
+	res = load_extents(file, &map);
+	if(res != 0){
+		return res;
+	}
+
+	while(pos < end){
+		block = map_block(&map, pos / bs, &run, cursor);
+		if(block < 0){
+			break;	//Fewer blocks than the file size says
+		}
+		run_end = MIN((pos / bs + run) * bs, end);
+
+		//A partial first block goes through a bounce buffer
+		if(pos % bs != 0 || run_end - pos < bs){
+			size_t n = MIN(bs - pos % bs, run_end - pos);
+
+			res = cache_read_block(block, tmp);
+			if(res != 0){
+				return res;
+			}
+			memcpy(buf + (pos - offset), tmp + pos % bs, n);
+			pos += n;
+			block++;
+		}
+
+		//Whole blocks are read straight into the caller's buffer
+		if(run_end - pos >= bs){
+			long whole = (run_end - pos) / bs;
+
+			res = cache_read_blocks(block, whole, buf + (pos - offset));
+			if(res != 0){
+				return res;
+			}
+			pos += whole * bs;
+			block += whole;
+		}
+
+		//And so does a partial last block
+		if(pos < run_end){
+			res = cache_read_block(block, tmp);
+			if(res != 0){
+				return res;
+			}
+			memcpy(buf + (pos - offset), tmp, run_end - pos);
+			pos = run_end;
+		}
+	}
+	return pos - offset;
+}
+
+int read_file_data(const struct cs1550_file_directory *file, char *buf, size_t size, off_t offset, struct extent_cursor *cursor){
+	return BLOCK_SIZE_DISPATCH(read_file_data_bs, file, buf, size, offset, cursor);
+}
+
+//Queue blocks from through from + count - 1 of file for readahead, one
+//request per run
+void readahead_file(const struct cs1550_file_directory *file, long from, long count){
+	struct extent_map map;
+	long block;
+	long run;
+
+	if(load_extents(file, &map) != 0){
+		return;
+	}
+	while(count > 0){
+		block = map_block(&map, from, &run, NULL);
+		if(block < 0){
+			break;
+		}
+		run = MIN(run, count);
+		readahead_queue(block, run);
+		from += run;
+		count -= run;
+	}
+}
+
+/*
+ * Write engine: store size bytes from buf at offset of file (offset <=
+ * fsize). Blocks needed past the end are allocated in one go, extending the
+ * last run where possible, then each run is written with one request; only
+ * a partial first or last block is read back to merge with. The entry's
+ * runs are updated in file but its size and directory block are left to
+ * the caller, and the bitmaps to the caller's single commit_metadata().
+ * Returns size or an error. cursor is used like in read_file_data().
+ */
+static inline __attribute__((always_inline)) int write_file_data_bs(struct cs1550_file_directory *file, const char *buf, size_t size, off_t offset, struct extent_cursor *cursor, const size_t bs){
+	struct extent_map map;
+	char tmp[bs];
+	size_t fsize = file->fsize;
+	size_t end = offset + size;
+	size_t pos = offset;
+	size_t run_end;
+	long need = (end + bs - 1) / bs;
+	long block;
+	long run;
+	int res;
+
+	if(size == 0){
+		return 0;
+	}
+
+	res = load_extents(file, &map);
+	if(res != 0){
+		return res;
+	}
+
+	//Grow the file: one pass over the free map for all new blocks
+	if(need > map.blocks){
+		long ext_block = file->nExtentBlock;
+
+		res = grow_extents(&map, need - map.blocks, &ext_block, 0);
+		if(res != 0){
+			return res;
+		}
+		file->nExtentBlock = ext_block;
+		res = store_extents(file, &map);
+		if(res != 0){
+			return res;
+		}
+	}
+
+	while(pos < end){
+		block = map_block(&map, pos / bs, &run, cursor);
+		if(block < 0){
+			return -EIO;
+		}
+		run_end = MIN((pos / bs + run) * bs, end);
+
+		//A partial first block is merged with what is on disk
+		if(pos % bs != 0 || run_end - pos < bs){
+			size_t n = MIN(bs - pos % bs, run_end - pos);
+
+			if(pos % bs != 0 || pos + n < fsize){
+				res = cache_read_block(block, tmp);
+				if(res != 0){
+					return res;
+				}
+			}
+			else{
+				memset(tmp, 0, bs);	//Nothing worth keeping past the end of the file
+			}
+			memcpy(tmp + pos % bs, buf + (pos - offset), n);
+			res = cache_write_block(block, tmp);
+			if(res != 0){
+				return res;
+			}
+			pos += n;
+			block++;
+		}
+
+		//Whole blocks go out straight from the caller's buffer
+		if(run_end - pos >= bs){
+			long whole = (run_end - pos) / bs;
+
+			res = cache_write_blocks(block, whole, buf + (pos - offset));
+			if(res != 0){
+				return res;
+			}
+			pos += whole * bs;
+			block += whole;
+		}
+
+		//And so does a partial last block, merged like the first
+		if(pos < run_end){
+			if(run_end < fsize){
+				res = cache_read_block(block, tmp);
+				if(res != 0){
+					return res;
+				}
+			}
+			else{
+				memset(tmp, 0, bs);
+			}
+			memcpy(tmp, buf + (pos - offset), run_end - pos);
+			res = cache_write_block(block, tmp);
+			if(res != 0){
+				return res;
+			}
+			pos = run_end;
+		}
+	}
+	return (int)size;
+}
+
+int write_file_data(struct cs1550_file_directory *file, const char *buf, size_t size, off_t offset, struct extent_cursor *cursor){
+	return BLOCK_SIZE_DISPATCH(write_file_data_bs, file, buf, size, offset, cursor);
+}
+
+//FNV-1a over the directory block and the name
+unsigned int name_hash(long dir_block, const char *name, const char *ext){
+	unsigned int h = 2166136261u ^ (unsigned int)dir_block;
+
+	for(; *name; name++){
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	}
+	h = (h ^ '.') * 16777619u;
+	for(; *ext; ext++){
+		h = (h ^ (unsigned char)*ext) * 16777619u;
+	}
+	return h % NAME_INDEX_BUCKETS;
+}
+
+//index_lookup expects the caller to hold index_lock. A hit moves to the
+//front of its bucket, so the tail is the least recently used.
+struct name_index_entry *index_lookup(long dir_block, const char *name, const char *ext){
+	struct name_index_entry **head = &name_index[name_hash(dir_block, name, ext)];
+	struct name_index_entry **pe;
+	struct name_index_entry *e;
+
+	for(pe = head; (e = *pe) != NULL; pe = &e->next){
+		if(e->dir_block == dir_block && strcmp(e->name, name) == 0 && strcmp(e->ext, ext) == 0){
+			*pe = e->next;
+			e->next = *head;
+			*head = e;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+//Entry for a name, made if it is not there yet. NULL when out of memory,
+//or when the index is full and the name's bucket has nothing to give up.
+//Caller holds index_lock.
+struct name_index_entry *index_entry(long dir_block, const char *name, const char *ext){
+	unsigned int h = name_hash(dir_block, name, ext);
+	struct name_index_entry **pe;
+	struct name_index_entry *e = index_lookup(dir_block, name, ext);
+
+	if(e != NULL){
+		return e;
+	}
+	if(name_index_count < NAME_INDEX_MAX){
+		e = malloc(sizeof(struct name_index_entry));
+		if(e != NULL){
+			name_index_count++;
+		}
+	}
+	else if(name_index[h] != NULL){
+		for(pe = &name_index[h]; (*pe)->next != NULL; pe = &(*pe)->next);
+		e = *pe;
+		*pe = NULL;
+	}
+	if(e == NULL){
+		return NULL;
+	}
+	e->dir_block = dir_block;
+	strncpy(e->name, name, MAX_FILENAME);
+	e->name[MAX_FILENAME] = '\0';
+	strncpy(e->ext, ext, MAX_EXTENSION);
+	e->ext[MAX_EXTENSION] = '\0';
+	e->next = name_index[h];
+	name_index[h] = e;
+	return e;
+}
+
+//Remember where an entry is. Failing that it is just not remembered.
+void index_add(long dir_block, const struct cs1550_file_directory *entry, long leaf, int slot){
+	struct name_index_entry *e;
+
+	pthread_mutex_lock(&index_lock);
+	e = index_entry(dir_block, entry->fname, entry->fext);
+	if(e != NULL){
+		e->ftype = entry->ftype;
+		e->leaf = leaf;
+		e->slot = slot;
+		e->nStartBlock = entry->nStartBlock;
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+//Remember that a directory has no such name. An entry the name had is
+//always turned around, so the index never says a gone name is there.
+void index_absent(long dir_block, const char *name, const char *ext){
+	struct name_index_entry *e;
+
+	pthread_mutex_lock(&index_lock);
+	e = index_entry(dir_block, name, ext);
+	if(e != NULL){
+		e->ftype = ENTRY_NONE;
+		e->leaf = -1;
+		e->slot = -1;
+		e->nStartBlock = -1;
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+//An entry moved within its directory; names not remembered stay that way
+void index_move(long dir_block, const char *name, const char *ext, long leaf, int slot){
+	struct name_index_entry *e;
+
+	pthread_mutex_lock(&index_lock);
+	e = index_lookup(dir_block, name, ext);
+	if(e != NULL){
+		e->leaf = leaf;
+		e->slot = slot;
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+//Forget every entry of a directory
+void index_drop_directory(long dir_block){
+	struct name_index_entry **pe;
+	struct name_index_entry *e;
+	int i;
+
+	pthread_mutex_lock(&index_lock);
+	for(i = 0; i < NAME_INDEX_BUCKETS; i++){
+		pe = &name_index[i];
+		while((e = *pe) != NULL){
+			if(e->dir_block == dir_block){
+				*pe = e->next;
+				free(e);
+				name_index_count--;
+			}
+			else{
+				pe = &e->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+void index_clear(void){
+	struct name_index_entry *e;
+	int i;
+
+	for(i = 0; i < NAME_INDEX_BUCKETS; i++){
+		while((e = name_index[i]) != NULL){
+			name_index[i] = e->next;
+			free(e);
+		}
+	}
+	name_index_count = 0;
+}
+
+//Hash the entries of a directory are spread over its leaves by: FNV-1a
+//over the name and extension
+unsigned int dir_hash(const char *name, const char *ext){
+	unsigned int h = 2166136261u;
+
+	for(; *name; name++){
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	}
+	h = (h ^ '.') * 16777619u;
+	for(; *ext; ext++){
+		h = (h ^ (unsigned char)*ext) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Is a block read from a directory what belongs where it was found? above
+ * is nLevels of the index block it was reached from, -1 for a directory's
+ * first block. That one is a leaf or an index with fewer than
+ * DIR_MAX_LEVELS levels under it; below an index of nLevels come indexes
+ * of nLevels - 1, and below nLevels 0 the leaves.
+ */
+int dir_node_ok(const void *node, int above){
+	const struct cs1550_index_block *ib = node;
+	const cs1550_directory_entry *leaf = node;
+
+	if(leaf->nFiles != DIR_INDEX_MARK){
+		return leaf->nFiles >= 0 && leaf->nFiles <= (int)MAX_FILES_IN_DIR && above <= 0;
+	}
+	return ib->nEntries >= 1 && ib->nEntries <= (int)MAX_INDEX_ENTRIES && ib->nLevels >= 0
+		&& (above < 0 ? ib->nLevels < DIR_MAX_LEVELS : ib->nLevels == above - 1);
+}
+
+//Entry of an index block covering hash h: the last one starting at or
+//below it, found by binary search
+int index_child(const struct cs1550_index_block *ib, unsigned int h){
+	int lo = 0;
+	int hi = ib->nEntries - 1;
+	int mid;
+
+	while(lo < hi){
+		mid = (lo + hi + 1) / 2;
+		if(ib->entries[mid].hash <= h){
+			lo = mid;
+		}
+		else{
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Find a name in the directory starting at dir_block, reading one block per
+ * index level and then the leaf its hash falls in. The leaf is left in
+ * *leaf and its block in *leaf_block, also when the name is not there.
+ * Returns the slot, -ENOENT or -EIO. Caller holds the directory's lock.
+ */
+int dir_lookup(long dir_block, const char *name, const char *ext, long *leaf_block, cs1550_directory_entry *leaf){
+	struct cs1550_index_block *ib = (struct cs1550_index_block *)leaf;
+	unsigned int h = dir_hash(name, ext);
+	int above = -1;
+	long block = dir_block;
+	int i;
+
+	for(;;){
+		if(cache_read_block(block, leaf) != 0 || !dir_node_ok(leaf, above)){
+			return -EIO;
+		}
+		if(leaf->nFiles != DIR_INDEX_MARK){
+			break;
+		}
+		above = ib->nLevels;
+		block = ib->entries[index_child(ib, h)].block;
+		if(block < FIRST_DIR_BLOCK || block >= MAX_NUM_BLOCKS){
+			return -EIO;
+		}
+	}
+	*leaf_block = block;
+	for(i = 0; i < leaf->nFiles; i++){
+		if(strcmp(leaf->files[i].fname, name) == 0 && strcmp(leaf->files[i].fext, ext) == 0){
+			return i;
+		}
+	}
+	return -ENOENT;
+}
+
+/*
+ * Slot of a name in the directory starting at dir_block, or a negative
+ * errno. The leaf holding it is read into *leaf and its block stored in
+ * *leaf_block. A name found before is read straight from the leaf the
+ * index remembers, once its slot there has been checked, and one known
+ * to be missing is -ENOENT without reading anything or touching *leaf.
+ * Caller holds the directory's lock.
+ */
+int find_file(long dir_block, const char *fname, const char *fext, long *leaf_block, cs1550_directory_entry *leaf){
+	struct name_index_entry *e;
+	long block = -1;
+	int slot = -1;
+
+	pthread_mutex_lock(&index_lock);
+	e = index_lookup(dir_block, fname, fext);
+	if(e != NULL){
+		block = e->leaf;
+		slot = e->slot;
+		if(e->ftype == ENTRY_NONE){
+			pthread_mutex_unlock(&index_lock);
+			return -ENOENT;
+		}
+	}
+	pthread_mutex_unlock(&index_lock);
+
+	if(block >= 0 && cache_read_block(block, leaf) == 0 && slot < leaf->nFiles && leaf->nFiles <= (int)MAX_FILES_IN_DIR
+		&& strcmp(leaf->files[slot].fname, fname) == 0 && strcmp(leaf->files[slot].fext, fext) == 0){
+		*leaf_block = block;
+		return slot;
+	}
+	slot = dir_lookup(dir_block, fname, fext, leaf_block, leaf);
+	if(slot >= 0){
+		index_add(dir_block, &leaf->files[slot], *leaf_block, slot);
+	}
+	else if(slot == -ENOENT){
+		index_absent(dir_block, fname, fext);
+	}
+	return slot;
+}
+
+/*
+ * First block of the directory name.ext in the directory starting at
+ * dir_block, -ENOENT if there is no such name or -ENOTDIR if it is a file.
+ * Whatever the index knows is taken as it is: what a name is only changes
+ * under meta_lock for writing, and a name coming or going updates the index
+ * under the directory's lock. Otherwise the directory is searched under
+ * its lock and the result remembered. Caller holds meta_lock.
+ */
+long lookup_directory(long dir_block, const char *name, const char *ext){
+	struct name_index_entry *e;
+	cs1550_directory_entry *leaf;
+	long leaf_block;
+	long block = 0;
+	int i;
+
+	pthread_mutex_lock(&index_lock);
+	e = index_lookup(dir_block, name, ext);
+	if(e != NULL){
+		block = e->ftype == ENTRY_DIR ? e->nStartBlock : e->ftype == ENTRY_NONE ? -ENOENT : -ENOTDIR;
+	}
+	pthread_mutex_unlock(&index_lock);
+	if(block != 0){
+		return block;
+	}
+
+	leaf = malloc(BLOCK_SIZE);
+	if(leaf == NULL){
+		return -ENOMEM;
+	}
+	pthread_rwlock_rdlock(dir_lock(dir_block));
+	i = find_file(dir_block, name, ext, &leaf_block, leaf);
+	block = i < 0 ? i : leaf->files[i].ftype == ENTRY_DIR ? leaf->files[i].nStartBlock : -ENOTDIR;
+	pthread_rwlock_unlock(dir_lock(dir_block));
+	free(leaf);
+	return block;
+}
+
+/*
+ * Walk path down to its last component, leaving that in p with p->parent
+ * the first block of the directory holding it; "/" itself gives parent
+ * -1. Every component before the last must be a directory, and the walk
+ * fails with -EINVAL if it passes through the one starting at avoid (-1
+ * for none). Otherwise returns 0, -ENOENT, -ENOTDIR, -ENAMETOOLONG or
+ * -EIO. Caller holds meta_lock.
+ */
+int walk_components(const char *path, struct cs1550_path *p, long avoid){
+	const char *end;
+	long dir = FIRST_DIR_BLOCK;
+	int res;
+
+	p->parent = -1;
+	p->filename[0] = '\0';
+	p->extension[0] = '\0';
+	while(*path == '/'){
+		path++;
+	}
+	if(*path == '\0'){
+		return 0;
+	}
+	for(;;){
+		end = strchr(path, '/');
+		if(end == NULL){
+			end = path + strlen(path);
+		}
+		res = split_name(path, end - path, p->filename, p->extension);
+		if(res != 0){
+			return res;
+		}
+		while(*end == '/'){
+			end++;
+		}
+		if(*end == '\0'){
+			p->parent = dir;
+			return 0;
+		}
+		dir = lookup_directory(dir, p->filename, p->extension);
+		if(dir < 0){
+			return dir;
+		}
+		if(dir == avoid){
+			return -EINVAL;
+		}
+		path = end;
+	}
+}
+
+int walk_path(const char *path, struct cs1550_path *p){
+	return walk_components(path, p, -1);
+}
+
+//An entry or index entry with its hash, for splitting a block in hash order
+struct dir_sort
+{
+	unsigned int hash;
+	int i;
+};
+
+int dir_sort_cmp(const void *a, const void *b){
+	const struct dir_sort *x = a;
+	const struct dir_sort *y = b;
+
+	if(x->hash != y->hash){
+		return x->hash < y->hash ? -1 : 1;
+	}
+	return x->i - y->i;
+}
+
+//Make buf an index block of nLevels holding entries
+void index_fill(void *buf, int nLevels, const struct cs1550_index_entry *entries, int n){
+	struct cs1550_index_block *ib = buf;
+
+	memset(buf, 0, BLOCK_SIZE);
+	ib->nFiles = DIR_INDEX_MARK;
+	ib->nLevels = nLevels;
+	ib->nEntries = n;
+	memcpy(ib->entries, entries, n * sizeof(struct cs1550_index_entry));
+}
+
+//Make buf a leaf holding the entries of files listed in order[], and tell
+//the index where they are now
+int leaf_fill(long dir_block, long block, void *buf, const struct cs1550_file_directory *files, const struct dir_sort *order, int n){
+	cs1550_directory_entry *leaf = buf;
+	int i;
+
+	memset(buf, 0, BLOCK_SIZE);
+	leaf->nFiles = n;
+	for(i = 0; i < n; i++){
+		leaf->files[i] = files[order[i].i];
+		index_move(dir_block, leaf->files[i].fname, leaf->files[i].fext, block, i);
+	}
+	return journal_write_block(block, buf);
+}
+
+/*
+ * Add an entry to the directory starting at dir_block. It goes into the
+ * leaf its hash falls in. A full leaf is split at a hash boundary near its
+ * middle, the upper half moving to a new block listed in the parent index,
+ * and a full index block is split the same way. When the first block is
+ * the one that is full its halves move to two new blocks and it becomes
+ * the index above them, so a directory keeps its first block for life.
+ * Every block is allocated before anything changes, so a directory that
+ * cannot grow is left as it was. Returns 0, -ENOSPC, -ENOMEM or -EIO.
+ * Caller holds the directory's lock for writing and is in a transaction
+ * begun for DIR_TXN_BLOCKS blocks.
+ */
+int dir_insert(long dir_block, const struct cs1550_file_directory *entry){
+	char *bufs;
+	void *path[DIR_MAX_LEVELS + 1];
+	long pb[DIR_MAX_LEVELS + 1];
+	int pos[DIR_MAX_LEVELS + 1];
+	long blocks[DIR_MAX_LEVELS + 2];
+	void *spare[2];
+	struct cs1550_file_directory *files = NULL;
+	struct cs1550_index_entry *ents = NULL;
+	struct dir_sort *order = NULL;
+	struct cs1550_index_block *ib;
+	struct cs1550_index_entry ins;
+	cs1550_directory_entry *leaf;
+	unsigned int h = dir_hash(entry->fname, entry->fext);
+	int depth;
+	int need;
+	int used = 0;
+	int n;
+	int m;
+	int k;
+	int i;
+	int res = 0;
+
+	bufs = malloc((DIR_MAX_LEVELS + 3) * (size_t)BLOCK_SIZE);
+	files = malloc((MAX_FILES_IN_DIR + 1) * sizeof(struct cs1550_file_directory));
+	ents = malloc((MAX_INDEX_ENTRIES + 1) * sizeof(struct cs1550_index_entry));
+	order = malloc((MAX_FILES_IN_DIR + 1) * sizeof(struct dir_sort));
+	if(bufs == NULL || files == NULL || ents == NULL || order == NULL){
+		res = -ENOMEM;
+		goto out;
+	}
+	for(k = 0; k <= DIR_MAX_LEVELS; k++){
+		path[k] = bufs + k * (size_t)BLOCK_SIZE;
+	}
+	spare[0] = bufs + (DIR_MAX_LEVELS + 1) * (size_t)BLOCK_SIZE;
+	spare[1] = bufs + (DIR_MAX_LEVELS + 2) * (size_t)BLOCK_SIZE;
+
+	//Down to the leaf, keeping every block on the way
+	pb[0] = dir_block;
+	for(depth = 0; ; depth++){
+		if(cache_read_block(pb[depth], path[depth]) != 0
+			|| !dir_node_ok(path[depth], depth > 0 ? ((struct cs1550_index_block *)path[depth - 1])->nLevels : -1)){
+			res = -EIO;
+			goto out;
+		}
+		leaf = path[depth];
+		if(leaf->nFiles != DIR_INDEX_MARK){
+			break;
+		}
+		ib = path[depth];
+		pos[depth] = index_child(ib, h);
+		pb[depth + 1] = ib->entries[pos[depth]].block;
+		if(pb[depth + 1] < FIRST_DIR_BLOCK || pb[depth + 1] >= MAX_NUM_BLOCKS){
+			res = -EIO;
+			goto out;
+		}
+	}
+
+	if(leaf->nFiles < (int)MAX_FILES_IN_DIR){
+		leaf->files[leaf->nFiles++] = *entry;
+		res = journal_write_block(pb[depth], leaf);
+		if(res == 0){
+			index_add(dir_block, entry, pb[depth], leaf->nFiles - 1);
+		}
+		goto out;
+	}
+
+	//Split the leaf with the new entry in it, between names of different hashes
+	n = leaf->nFiles + 1;
+	memcpy(files, leaf->files, leaf->nFiles * sizeof(struct cs1550_file_directory));
+	files[n - 1] = *entry;
+	for(i = 0; i < n; i++){
+		order[i].hash = dir_hash(files[i].fname, files[i].fext);
+		order[i].i = i;
+	}
+	qsort(order, n, sizeof(struct dir_sort), dir_sort_cmp);
+	for(m = n / 2; m < n && order[m].hash == order[m - 1].hash; m++);
+	if(m == n){
+		for(m = n / 2; m > 0 && order[m].hash == order[m - 1].hash; m--);
+	}
+	if(m == 0){
+		res = -ENOSPC;	//Every name in the leaf has the same hash
+		goto out;
+	}
+
+	//Blocks needed: the new leaf, one per full index block above it and
+	//two for the first block if it is full too
+	need = depth == 0 ? 2 : 1;
+	for(k = depth - 1; k >= 0 && ((struct cs1550_index_block *)path[k])->nEntries == (int)MAX_INDEX_ENTRIES; k--){
+		if(k == 0 && ((struct cs1550_index_block *)path[0])->nLevels == DIR_MAX_LEVELS - 1){
+			res = -ENOSPC;	//Index as deep as it goes
+			goto out;
+		}
+		need += k == 0 ? 2 : 1;
+	}
+	if(alloc_blocks(need, blocks, 0) != need){
+		res = -ENOSPC;
+		goto out;
+	}
+	index_add(dir_block, entry, -1, 0);	//Placed by leaf_fill
+
+	if(depth == 0){
+		//The first block was the only leaf, it becomes the index above two
+		if(leaf_fill(dir_block, blocks[0], spare[0], files, order, m) != 0
+			|| leaf_fill(dir_block, blocks[1], spare[1], files, order + m, n - m) != 0){
+			res = -EIO;
+		}
+		ents[0].hash = 0;
+		ents[0].block = blocks[0];
+		ents[1].hash = order[m].hash;
+		ents[1].block = blocks[1];
+		index_fill(path[0], 0, ents, 2);
+		if(journal_write_block(dir_block, path[0]) != 0){
+			res = -EIO;
+		}
+		goto out;
+	}
+
+	ins.hash = order[m].hash;
+	ins.block = blocks[used++];
+	if(leaf_fill(dir_block, pb[depth], spare[0], files, order, m) != 0
+		|| leaf_fill(dir_block, ins.block, spare[1], files, order + m, n - m) != 0){
+		res = -EIO;
+	}
+
+	//Add the new block to the index above, splitting full index blocks
+	for(k = depth - 1; k >= 0; k--){
+		ib = path[k];
+		n = ib->nEntries + 1;
+		memcpy(ents, ib->entries, (pos[k] + 1) * sizeof(struct cs1550_index_entry));
+		ents[pos[k] + 1] = ins;
+		memcpy(ents + pos[k] + 2, ib->entries + pos[k] + 1, (ib->nEntries - pos[k] - 1) * sizeof(struct cs1550_index_entry));
+		if(n <= (int)MAX_INDEX_ENTRIES){
+			index_fill(ib, ib->nLevels, ents, n);
+			if(journal_write_block(pb[k], ib) != 0){
+				res = -EIO;
+			}
+			break;
+		}
+		m = n / 2;
+		if(k == 0){
+			//The first block is full, its halves move down a level
+			index_fill(spare[0], ib->nLevels, ents, m);
+			index_fill(spare[1], ib->nLevels, ents + m, n - m);
+			ins.hash = ents[m].hash;
+			ents[0].hash = 0;
+			ents[0].block = blocks[used++];
+			ents[1].hash = ins.hash;
+			ents[1].block = blocks[used++];
+			if(journal_write_block(ents[0].block, spare[0]) != 0 || journal_write_block(ents[1].block, spare[1]) != 0){
+				res = -EIO;
+			}
+			index_fill(ib, ib->nLevels + 1, ents, 2);
+			if(journal_write_block(pb[0], ib) != 0){
+				res = -EIO;
+			}
+			break;
+		}
+		index_fill(spare[0], ib->nLevels, ents + m, n - m);
+		index_fill(ib, ib->nLevels, ents, m);
+		ins.hash = ents[m].hash;
+		ins.block = blocks[used++];
+		if(journal_write_block(pb[k], ib) != 0 || journal_write_block(ins.block, spare[0]) != 0){
+			res = -EIO;
+		}
+	}
+
+out:
+	free(bufs);
+	free(files);
+	free(ents);
+	free(order);
+	return res;
+}
+
+//Take the entry in slot out of a leaf already read into *leaf, moving the
+//last one into its place. Caller holds the directory's lock for writing
+//and is in a transaction.
+int dir_remove(long dir_block, long leaf_block, cs1550_directory_entry *leaf, int slot){
+	index_absent(dir_block, leaf->files[slot].fname, leaf->files[slot].fext);
+	leaf->nFiles--;
+	if(slot < leaf->nFiles){
+		leaf->files[slot] = leaf->files[leaf->nFiles];
+		index_move(dir_block, leaf->files[slot].fname, leaf->files[slot].fext, leaf_block, slot);
+	}
+	memset(&leaf->files[leaf->nFiles], 0, sizeof(struct cs1550_file_directory));
+	return journal_write_block(leaf_block, leaf);
+}
+
+/*
+ * Call fn on every block of the directory starting at dir_block, each index
+ * block before the blocks under it, stopping at the first call that
+ * returns nonzero. Returns that value, 0 when all were visited, or -EIO for
+ * a damaged tree. Caller holds the directory's lock.
+ */
+int dir_walk(long dir_block, int (*fn)(long block, void *data, void *arg), void *arg){
+	char *bufs = malloc((DIR_MAX_LEVELS + 1) * (size_t)BLOCK_SIZE);
+	long block[DIR_MAX_LEVELS + 1];
+	int next[DIR_MAX_LEVELS + 1];
+	struct cs1550_index_block *ib;
+	int depth = 0;
+	int res = 0;
+
+	if(bufs == NULL){
+		return -ENOMEM;
+	}
+	block[0] = dir_block;
+	for(;;){
+		ib = (struct cs1550_index_block *)(bufs + depth * (size_t)BLOCK_SIZE);
+		if(cache_read_block(block[depth], ib) != 0
+			|| !dir_node_ok(ib, depth > 0 ? ((struct cs1550_index_block *)(bufs + (depth - 1) * (size_t)BLOCK_SIZE))->nLevels : -1)){
+			res = -EIO;
+			break;
+		}
+		res = fn(block[depth], ib, arg);
+		if(res != 0){
+			break;
+		}
+		if(ib->nFiles == DIR_INDEX_MARK){
+			next[depth] = 0;
+		}
+		else{
+			depth--;
+		}
+		//Next child of the nearest index block not done yet
+		while(depth >= 0 && next[depth] >= ((struct cs1550_index_block *)(bufs + depth * (size_t)BLOCK_SIZE))->nEntries){
+			depth--;
+		}
+		if(depth < 0){
+			break;
+		}
+		ib = (struct cs1550_index_block *)(bufs + depth * (size_t)BLOCK_SIZE);
+		block[depth + 1] = ib->entries[next[depth]++].block;
+		depth++;
+		if(block[depth] < FIRST_DIR_BLOCK || block[depth] >= MAX_NUM_BLOCKS){
+			res = -EIO;
+			break;
+		}
+	}
+	free(bufs);
+	return res;
+}
+
+/*
+ * Locate a regular file for read or write and lock it: meta_lock for
+ * reading and the directory lock, for writing if exclusive. With an open
+ * handle the path is not walked at all; the leaf and slot
+ * saved at open are checked and only searched for again if unlink or a
+ * split moved the entry. path may be NULL with a handle, as from the
+ * inode frontend, which then goes by the in-core file if rmdir or rename
+ * made the handle stale. Returns 0 with the locks held, or an error with
+ * nothing held.
+ */
+int get_file(const char *path, struct cs1550_handle *h, int exclusive, struct file_ref *ref){
+	struct cs1550_path p;
+	int res;
+
+	pthread_rwlock_rdlock(&meta_lock);
+	if(h != NULL && h->dir_generation == dir_generation){
+		return lock_file(h->dir_block, h->fname, h->fext, h, exclusive, ref);
+	}
+	if(path == NULL){
+		//Only rename moves an in-core file, and it keeps it up to date
+		if(h->file != NULL && !h->file->unlinked){
+			return lock_file(h->file->dir_block, h->file->fname, h->file->fext, NULL, exclusive, ref);
+		}
+		pthread_rwlock_unlock(&meta_lock);
+		return -ESTALE;
+	}
+	res = walk_path(path, &p);
+	if(res == 0 && p.parent < 0){
+		res = -EISDIR;
+	}
+	if(res != 0){
+		pthread_rwlock_unlock(&meta_lock);
+		LOG(LOG_DEBUG, "No file %s\n", path);
+		return res;
+	}
+	return lock_file(p.parent, p.filename, p.extension, NULL, exclusive, ref);
+}
+
+//The part of get_file() after the file's directory is known. The caller
+//holds meta_lock for reading, which is dropped again on an error.
+int lock_file(long dir_block, const char *fname, const char *fext, struct cs1550_handle *h, int exclusive, struct file_ref *ref){
+	int i;
+
+	ref->dir_block = dir_block;
+	ref->exclusive = exclusive;
+	if(exclusive){
+		pthread_rwlock_wrlock(dir_lock(ref->dir_block));
+	}
+	else{
+		pthread_rwlock_rdlock(dir_lock(ref->dir_block));
+	}
+
+	i = -1;
+	if(h != NULL){
+		pthread_mutex_lock(&h->lock);
+		ref->leaf = h->leaf;
+		i = h->slot;
+		pthread_mutex_unlock(&h->lock);
+		if(cache_read_block(ref->leaf, &ref->dir) != 0){
+			i = -1;
+		}
+	}
+	if(i < 0 || i >= ref->dir.nFiles || strcmp(ref->dir.files[i].fname, fname) != 0 || strcmp(ref->dir.files[i].fext, fext) != 0){
+		i = find_file(ref->dir_block, fname, fext, &ref->leaf, &ref->dir);
+	}
+	if(i >= 0 && ref->dir.files[i].ftype == ENTRY_DIR){
+		i = -EISDIR;
+	}
+	if(i < 0){
+		if(i == -EIO){
+			LOG(LOG_ERR, "Unable to read subdirectory block\n");
+		}
+		put_file(ref);
+		return i;
+	}
+	ref->slot = i;
+	return 0;
+}
+
+void put_file(struct file_ref *ref){
+	pthread_rwlock_unlock(dir_lock(ref->dir_block));
+	pthread_rwlock_unlock(&meta_lock);
+}
+
+//In-core file for an entry, or NULL if it is not open. The caller holds the
+//directory's lock, which keeps the file from being freed.
+struct cs1550_file *file_find(long dir_block, const char *fname, const char *fext){
+	struct cs1550_file *f;
+
+	pthread_mutex_lock(&file_lock);
+	for(f = open_files; f != NULL; f = f->next){
+		if(f->dir_block == dir_block && strcmp(f->fname, fname) == 0 && strcmp(f->fext, fext) == 0){
+			break;
+		}
+	}
+	pthread_mutex_unlock(&file_lock);
+	return f;
+}
+
+//Take a reference on the in-core file for an entry, creating it on first open
+struct cs1550_file *file_get(long dir_block, const char *fname, const char *fext, size_t fsize){
+	struct cs1550_file *f;
+
+	pthread_mutex_lock(&file_lock);
+	for(f = open_files; f != NULL; f = f->next){
+		if(f->dir_block == dir_block && strcmp(f->fname, fname) == 0 && strcmp(f->fext, fext) == 0){
+			break;
+		}
+	}
+	if(f == NULL){
+		f = calloc(1, sizeof(struct cs1550_file));
+		if(f == NULL){
+			pthread_mutex_unlock(&file_lock);
+			return NULL;
+		}
+		f->dir_block = dir_block;
+		strcpy(f->fname, fname);
+		strcpy(f->fext, fext);
+		f->size = fsize;
+		f->next = open_files;
+		open_files = f;
+	}
+	f->refs++;
+	pthread_mutex_unlock(&file_lock);
+	return f;
+}
+
+//Drop a reference, freeing the file with the last one. The caller holds the
+//directory's lock for writing and has written the pages back.
+void file_put(struct cs1550_file *f){
+	struct cs1550_file **pf;
+
+	pthread_mutex_lock(&file_lock);
+	if(--f->refs > 0){
+		pthread_mutex_unlock(&file_lock);
+		return;
+	}
+	if(!f->unlinked){
+		for(pf = &open_files; *pf != f; pf = &(*pf)->next);
+		*pf = f->next;
+	}
+	pthread_mutex_unlock(&file_lock);
+	pages_free(f);
+	free(f);
+}
+
+//The entry is gone: throw the dirty data away and take the file out of the
+//table so a new file of the same name starts clean. Open handles keep it
+//until they are released. The caller holds the directory's lock for writing.
+void file_discard(struct cs1550_file *f){
+	struct cs1550_file **pf;
+
+	pages_free(f);
+	pthread_mutex_lock(&file_lock);
+	for(pf = &open_files; *pf != f; pf = &(*pf)->next);
+	*pf = f->next;
+	f->unlinked = 1;
+	pthread_mutex_unlock(&file_lock);
+}
+
+//Last page at or before block index of the file, or NULL. Starts from the
+//page the last write ended in, so sequential access does not walk the list.
+struct dirty_page *page_seek(const struct cs1550_file *f, long index){
+	struct dirty_page *pg = f->hint != NULL ? f->hint : f->pages;
+
+	while(pg != NULL && pg->index > index){
+		pg = pg->prev;
+	}
+	if(pg == NULL){
+		pg = f->pages;
+		if(pg == NULL || pg->index > index){
+			return NULL;
+		}
+	}
+	while(pg->next != NULL && pg->next->index <= index){
+		pg = pg->next;
+	}
+	return pg;
+}
+
+//Dirty page for block index, made on first use from what the file holds
+//there on disk so that it is always a whole block
+struct dirty_page *page_get(struct cs1550_file *f, const struct cs1550_file_directory *file, long index){
+	struct dirty_page *prev = page_seek(f, index);
+	struct dirty_page *pg;
+	int n = 0;
+
+	if(prev != NULL && prev->index == index){
+		return prev;
+	}
+	pg = malloc(sizeof(struct dirty_page) + BLOCK_SIZE);
+	if(pg == NULL){
+		return NULL;
+	}
+	pg->index = index;
+	if((size_t)index * BLOCK_SIZE < file->fsize){
+		n = read_file_data(file, pg->data, BLOCK_SIZE, (off_t)index * BLOCK_SIZE, NULL);
+		if(n < 0){
+			free(pg);
+			return NULL;
+		}
+	}
+	memset(pg->data + n, 0, BLOCK_SIZE - n);
+
+	pg->prev = prev;
+	pg->next = prev != NULL ? prev->next : f->pages;
+	if(pg->next != NULL){
+		pg->next->prev = pg;
+	}
+	if(prev != NULL){
+		prev->next = pg;
+	}
+	else{
+		f->pages = pg;
+	}
+	f->npages++;
+	pthread_mutex_lock(&file_lock);
+	if(f->dirty_since == 0){
+		f->dirty_since = time(NULL);
+	}
+	dirty_pages++;
+	pthread_mutex_unlock(&file_lock);
+	return pg;
+}
+
+//Drop all pages of a file without writing them
+void pages_free(struct cs1550_file *f){
+	struct dirty_page *pg;
+
+	while((pg = f->pages) != NULL){
+		f->pages = pg->next;
+		free(pg);
+	}
+	pthread_mutex_lock(&file_lock);
+	dirty_pages -= f->npages;
+	f->dirty_since = 0;
+	pthread_mutex_unlock(&file_lock);
+	f->hint = NULL;
+	f->npages = 0;
+	if(f->reserved > 0){
+		unreserve_blocks(f->reserved);
+		f->reserved = 0;
+	}
+}
+
+//Drop the pages of f past size bytes and clear the rest of the last one,
+//so growing the file again shows zeros there. The reservation is left to
+//the caller.
+void pages_cut(struct cs1550_file *f, size_t size){
+	long keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	struct dirty_page *last = keep > 0 ? page_seek(f, keep - 1) : NULL;
+	struct dirty_page *pg = last != NULL ? last->next : f->pages;
+	struct dirty_page *next;
+	long n = 0;
+
+	for(; pg != NULL; pg = next){
+		next = pg->next;
+		free(pg);
+		n++;
+	}
+	if(last != NULL){
+		last->next = NULL;
+		if(last->index == keep - 1 && size % BLOCK_SIZE != 0){
+			memset(last->data + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+		}
+	}
+	else{
+		f->pages = NULL;
+	}
+	f->hint = last;
+	f->npages -= n;
+	pthread_mutex_lock(&file_lock);
+	dirty_pages -= n;
+	if(f->npages == 0){
+		f->dirty_since = 0;
+	}
+	pthread_mutex_unlock(&file_lock);
+}
+
+/*
+ * Write size bytes at offset (<= f->size) into the dirty pages of f. Blocks
+ * the file does not have yet are only reserved; the entry is left alone
+ * until the data is written back. Returns size or an error.
+ */
+static inline __attribute__((always_inline)) int buffer_write_bs(struct cs1550_file *f, struct cs1550_file_directory *file, const char *buf, size_t size, off_t offset, const size_t bs){
+	struct extent_map map;
+	struct dirty_page *pg;
+	size_t pos = offset;
+	size_t end = offset + size;
+	long need = (end + bs - 1) / bs;
+	size_t n;
+	int res;
+
+	res = load_extents(file, &map);
+	if(res != 0){
+		return res;
+	}
+	if(need > map.blocks + f->reserved){
+		res = reserve_blocks(need - map.blocks - f->reserved);
+		if(res != 0){
+			return res;
+		}
+		f->reserved = need - map.blocks;
+	}
+
+	while(pos < end){
+		pg = page_get(f, file, pos / bs);
+		if(pg == NULL){
+			return -ENOMEM;
+		}
+		n = MIN(bs - pos % bs, end - pos);
+		memcpy(pg->data + pos % bs, buf + (pos - offset), n);
+		f->hint = pg;
+		pos += n;
+	}
+	if(end > f->size){
+		f->size = end;
+	}
+	return (int)size;
+}
+
+int buffer_write(struct cs1550_file *f, struct cs1550_file_directory *file, const char *buf, size_t size, off_t offset){
+	return BLOCK_SIZE_DISPATCH(buffer_write_bs, f, file, buf, size, offset);
+}
+
+//Lay the dirty pages of f over size bytes at offset that were read from disk
+static inline __attribute__((always_inline)) void buffer_read_bs(const struct cs1550_file *f, char *buf, size_t size, off_t offset, const size_t bs){
+	struct dirty_page *pg = page_seek(f, offset / bs);
+	size_t end = offset + size;
+	size_t from;
+	size_t to;
+
+	if(pg == NULL){
+		pg = f->pages;
+	}
+	for(; pg != NULL && (size_t)pg->index * bs < end; pg = pg->next){
+		from = MAX((size_t)pg->index * bs, (size_t)offset);
+		to = MIN((size_t)(pg->index + 1) * bs, end);
+		if(from < to){
+			memcpy(buf + (from - offset), pg->data + from % bs, to - from);
+		}
+	}
+}
+
+void buffer_read(const struct cs1550_file *f, char *buf, size_t size, off_t offset){
+	BLOCK_SIZE_DISPATCH(buffer_read_bs, f, buf, size, offset);
+}
+
+/*
+ * Write back the dirty pages of f, whose entry is ref. The blocks past the
+ * end of the file are allocated first, all at once now that the final size
+ * is known, so they can come from one free run. The pages then go out in
+ * offset order with one request per run of adjacent pages, and the new
+ * size and runs are recorded in the entry and committed. The caller holds
+ * the directory's lock for writing and is not inside a transaction.
+ */
+int flush_file(struct cs1550_file *f, struct file_ref *ref){
+	struct cs1550_file_directory *file = &ref->dir.files[ref->slot];
+	struct cs1550_file_directory before = *file;
+	struct dirty_page *pg = f->pages;
+	struct extent_map map;
+	char *run_buf = NULL;
+	size_t off;
+	size_t len;
+	long need = (f->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long n;
+	int res = 0;
+
+	if(pg == NULL){
+		return 0;
+	}
+
+	txn_begin();
+	res = load_extents(file, &map);
+	if(res == 0 && need > map.blocks){
+		long ext_block = file->nExtentBlock;
+
+		res = grow_extents(&map, need - map.blocks, &ext_block, f->reserved);
+		if(res == 0){
+			f->reserved = 0;
+			file->nExtentBlock = ext_block;
+			res = store_extents(file, &map);
+		}
+	}
+	if(res == 0){
+		run_buf = malloc(WRITEBACK_RUN_BLOCKS * BLOCK_SIZE);
+		if(run_buf == NULL){
+			res = -ENOMEM;
+			pg = NULL;
+		}
+	}
+	else{
+		pg = NULL;
+	}
+	while(pg != NULL){
+		off = (size_t)pg->index * BLOCK_SIZE;
+		for(n = 0; pg != NULL && pg->index == (long)(off / BLOCK_SIZE) + n && n < WRITEBACK_RUN_BLOCKS; n++, pg = pg->next){
+			memcpy(run_buf + n * BLOCK_SIZE, pg->data, BLOCK_SIZE);
+		}
+		len = MIN((size_t)n * BLOCK_SIZE, f->size - off);
+		res = write_file_data(file, run_buf, len, off, NULL);
+		if(res < 0){
+			break;
+		}
+		if(off + len > file->fsize){
+			file->fsize = off + len;
+		}
+		res = 0;
+	}
+	free(run_buf);
+
+	if(memcmp(&before, file, sizeof(before)) != 0 && journal_write_block(ref->leaf, &ref->dir) != 0 && res == 0){
+		res = -EIO;
+	}
+	if(commit_metadata() != 0 && res == 0){
+		res = -EIO;
+	}
+	if(res == 0){
+		pages_free(f);
+	}
+	return res;
+}
+
+/*
+ * Cut the file of ref to size bytes, or extend it with zeros. Blocks past
+ * the new end go back to the free space, along with the extent block once
+ * the runs fit in the entry again, and dirty pages past it are dropped
+ * with what was reserved for them. The new size and runs are committed.
+ * The caller holds the directory's lock for writing and is not inside a
+ * transaction.
+ */
+int truncate_file(struct file_ref *ref, off_t size){
+	struct cs1550_file_directory *file = &ref->dir.files[ref->slot];
+	struct cs1550_file_directory before = *file;
+	struct cs1550_file *f = file_find(ref->dir_block, file->fname, file->fext);
+	struct extent_map map;
+	size_t fsize = f != NULL ? f->size : file->fsize;
+	size_t pos;
+	long keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long n;
+	char *zeros;
+	int i;
+	int res = 0;
+
+	if(size < 0){
+		return -EINVAL;
+	}
+
+	txn_begin();
+	if((size_t)size > fsize){
+		//Growing is writing zeros, through the pages when the file is open
+		zeros = calloc(WRITEBACK_RUN_BLOCKS, BLOCK_SIZE);
+		if(zeros == NULL){
+			res = -ENOMEM;
+		}
+		for(pos = fsize; res == 0 && pos < (size_t)size; pos += n){
+			n = MIN((size_t)WRITEBACK_RUN_BLOCKS * BLOCK_SIZE, size - pos);
+			res = f != NULL ? buffer_write(f, file, zeros, n, pos) : write_file_data(file, zeros, n, pos, NULL);
+			if(res >= 0 && f == NULL){
+				file->fsize = pos + n;
+			}
+			res = res < 0 ? res : 0;
+		}
+		free(zeros);
+	}
+	else{
+		if(f != NULL){
+			pages_cut(f, size);
+			f->size = size;
+		}
+		if(file->fsize > (size_t)size){
+			file->fsize = size;
+		}
+		res = load_extents(file, &map);
+		if(res == 0 && map.blocks > keep){
+			//Shorten the runs from the end, keep blocks are left
+			pthread_mutex_lock(&alloc_lock);
+			for(i = map.n - 1; i >= 0 && map.blocks > keep; i--){
+				n = MIN((long)map.ext[i].count, map.blocks - keep);
+				free_run(map.ext[i].start + map.ext[i].count - n, n);
+				map.ext[i].count -= n;
+				map.blocks -= n;
+				if(map.ext[i].count == 0){
+					map.n--;
+				}
+			}
+			if(map.n <= INLINE_EXTENTS && file->nExtentBlock > 0){
+				free_block(file->nExtentBlock);
+				file->nExtentBlock = 0;
+			}
+			pthread_mutex_unlock(&alloc_lock);
+			__atomic_store_n(&extent_trims, extent_trims + 1, __ATOMIC_RELAXED);
+			res = store_extents(file, &map);
+			if(map.n == 0){
+				file->nStartBlock = -1;
+			}
+		}
+		//Only the pages still past the last block need their reservation
+		if(res == 0 && f != NULL && f->reserved > MAX(keep - map.blocks, 0)){
+			unreserve_blocks(f->reserved - MAX(keep - map.blocks, 0));
+			f->reserved = MAX(keep - map.blocks, 0);
+		}
+	}
+
+	if(memcmp(&before, file, sizeof(before)) != 0){
+		if(journal_write_block(ref->leaf, &ref->dir) != 0 && res == 0){
+			res = -EIO;
+		}
+		if(commit_metadata() != 0 && res == 0){
+			res = -EIO;
+		}
+	}
+	else{
+		txn_end();
+	}
+	return res;
+}
+
+//Lock the entry of f and write its pages back, dropping a reference too if
+//put is set. Used where no request has the file locked already.
+int writeback_file(struct cs1550_file *f, int put){
+	struct file_ref ref;
+	long dir_block;
+	int res = 0;
+
+	//Only rename moves a file to another directory, and not while this is held
+	pthread_rwlock_rdlock(&meta_lock);
+	dir_block = f->dir_block;	//f may be gone after file_put()
+	pthread_rwlock_wrlock(dir_lock(dir_block));
+	if(!f->unlinked && f->pages != NULL){
+		ref.dir_block = f->dir_block;
+		ref.exclusive = 1;
+		ref.slot = find_file(f->dir_block, f->fname, f->fext, &ref.leaf, &ref.dir);
+		res = ref.slot >= 0 ? flush_file(f, &ref) : ref.slot;
+		if(res != 0){
+			LOG(LOG_ERR, "Unable to write back %s.%s\n", f->fname, f->fext);
+			pthread_mutex_lock(&file_lock);
+			f->dirty_since = time(NULL);	//Try again after another dirty_age
+			pthread_mutex_unlock(&file_lock);
+		}
+	}
+	if(put){
+		file_put(f);
+	}
+	pthread_rwlock_unlock(dir_lock(dir_block));
+	pthread_rwlock_unlock(&meta_lock);
+	return res;
+}
+
+//Start the writeback thread, unless write-back caching is off
+int writeback_start(void){
+	wb_stop = 0;
+	if(options.dirty_kb == 0){
+		return 0;
+	}
+	if(pthread_create(&wb_thread, NULL, writeback_worker, NULL) != 0){
+		return -errno;
+	}
+	wb_started = 1;
+	return 0;
+}
+
+//Stop the writeback thread and write back everything still dirty
+void writeback_stop(void){
+	struct cs1550_file *f;
+
+	if(wb_started){
+		pthread_mutex_lock(&file_lock);
+		wb_stop = 1;
+		pthread_cond_signal(&wb_cond);
+		pthread_mutex_unlock(&file_lock);
+		pthread_join(wb_thread, NULL);
+		wb_started = 0;
+	}
+	for(f = open_files; f != NULL; f = f->next){
+		writeback_file(f, 0);
+	}
+}
+
+/*
+ * Writeback thread: once a second, and whenever a writer finds dirty_pages
+ * over the limit, write back every file whose data is older than dirty_age
+ * or, while over the limit, the file that has been dirty longest.
+ */
+void *writeback_worker(void *arg){
+	struct cs1550_file *f;
+	struct cs1550_file *oldest;
+	struct timespec ts;
+	time_t now;
+	int over;
+	int res = 0;
+
+	(void) arg;
+	pthread_mutex_lock(&file_lock);
+	while(!wb_stop){
+		now = time(NULL);
+		over = dirty_pages * BLOCK_SIZE > options.dirty_kb * 1024;
+		oldest = NULL;
+		for(f = open_files; f != NULL; f = f->next){
+			if(f->dirty_since != 0 && (oldest == NULL || f->dirty_since < oldest->dirty_since)){
+				oldest = f;
+			}
+		}
+		if(oldest != NULL && res == 0 && (over || now - oldest->dirty_since >= (time_t)options.dirty_age)){
+			oldest->refs++;		//Keeps it while file_lock is dropped
+			pthread_mutex_unlock(&file_lock);
+			res = writeback_file(oldest, 1);
+			pthread_mutex_lock(&file_lock);
+			continue;
+		}
+		res = 0;	//After a failure wait before trying again
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&wb_cond, &file_lock, &ts);
+	}
+	pthread_mutex_unlock(&file_lock);
+	return NULL;
+}
+
+void stats_key_create(void){
+	pthread_key_create(&stats_key, stats_release_slot);
+}
+
+//Thread exit: the slot keeps its counts for whoever takes it next
+void stats_release_slot(void *slot){
+	pthread_mutex_lock(&stats_lock);
+	((struct stats_slot *)slot)->in_use = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//The calling thread's slot, taken on its first request
+struct stats_slot *stats_slot(void){
+	struct stats_slot *slot;
+
+	if(stats_self != NULL){
+		return stats_self;
+	}
+	pthread_once(&stats_once, stats_key_create);
+	pthread_mutex_lock(&stats_lock);
+	for(slot = stats_slots; slot != NULL && slot->in_use; slot = slot->next);
+	if(slot == NULL){
+		slot = calloc(1, sizeof(struct stats_slot));
+		if(slot != NULL){
+			slot->next = stats_slots;
+			stats_slots = slot;
+		}
+	}
+	if(slot != NULL){
+		slot->in_use = 1;
+	}
+	pthread_mutex_unlock(&stats_lock);
+	if(slot != NULL){
+		pthread_setspecific(stats_key, slot);
+	}
+	stats_self = slot;
+	return slot;
+}
+
+uint64_t stats_start(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Only the owning thread writes a counter, the atomics just keep readers
+//from seeing a torn value; they compile to plain loads and stores
+void stats_add(uint64_t *counter, uint64_t n){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+//Count one call of op that began at start and returned res
+int stats_end(int op, uint64_t start, int res){
+	struct stats_slot *slot = stats_slot();
+	struct op_counters *c;
+	uint64_t ns = stats_start() - start;
+	uint64_t us = ns / 1000;
+	int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+
+	if(slot == NULL){
+		return res;
+	}
+	c = &slot->ops[op];
+	stats_add(&c->calls, 1);
+	if(res < 0){
+		stats_add(&c->errors, 1);
+	}
+	else if(op == OP_READ || op == OP_WRITE){
+		stats_add(&c->bytes, res);
+	}
+	stats_add(&c->total_ns, ns);
+	if(ns > __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED)){
+		__atomic_store_n(&c->max_ns, ns, __ATOMIC_RELAXED);
+	}
+	stats_add(&c->hist[MIN(bucket, STATS_BUCKETS - 1)], 1);
+	return res;
+}
+
+#define STATS_TEXT_MAX 16384
+
+void text_append(char *buf, size_t *len, const char *fmt, ...){
+	va_list ap;
+	int n;
+
+	if(*len >= STATS_TEXT_MAX - 1){
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(buf + *len, STATS_TEXT_MAX - *len, fmt, ap);
+	va_end(ap);
+	if(n > 0){
+		*len = MIN(*len + n, (size_t)STATS_TEXT_MAX - 1);
+	}
+}
+
+//Upper bound in us of the bucket holding the pct'th percentile call
+unsigned long hist_percentile(const struct op_counters *c, int pct){
+	uint64_t seen = 0;
+	int i;
+
+	for(i = 0; i < STATS_BUCKETS; i++){
+		seen += c->hist[i];
+		if(seen * 100 >= c->calls * pct){
+			break;
+		}
+	}
+	return 2UL << MIN(i, STATS_BUCKETS - 1);
+}
+
+/*
+ * Contents of the stats file: the per-operation counters of all threads
+ * added up, their latency histograms, and the counters the cache,
+ * readahead, journal and allocator keep. Returns a malloc'd string.
+ */
+char *stats_text(size_t *len){
+	struct op_counters total[OP_COUNT];
+	struct stats_slot *slot;
+	unsigned long v[10];
+	char *buf = malloc(STATS_TEXT_MAX);
+	int op;
+	int i;
+
+	*len = 0;
+	if(buf == NULL){
+		return NULL;
+	}
+	buf[0] = '\0';
+	memset(total, 0, sizeof(total));
+	pthread_mutex_lock(&stats_lock);
+	for(slot = stats_slots; slot != NULL; slot = slot->next){
+		for(op = 0; op < OP_COUNT; op++){
+			struct op_counters *c = &slot->ops[op];
+			uint64_t max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+
+			total[op].calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+			total[op].errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+			total[op].bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+			total[op].total_ns += __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+			total[op].max_ns = MAX(total[op].max_ns, max);
+			for(i = 0; i < STATS_BUCKETS; i++){
+				total[op].hist[i] += __atomic_load_n(&c->hist[i], __ATOMIC_RELAXED);
+			}
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	text_append(buf, len, "%-9s %10s %8s %14s %10s %10s %9s %9s\n", "op", "calls", "errors", "bytes", "avg us", "max us", "p50 us<", "p99 us<");
+	for(op = 0; op < OP_COUNT; op++){
+		struct op_counters *c = &total[op];
+
+		if(c->calls == 0){
+			continue;
+		}
+		text_append(buf, len, "%-9s %10lu %8lu %14lu %10.1f %10.1f %9lu %9lu\n", op_names[op],
+			(unsigned long)c->calls, (unsigned long)c->errors, (unsigned long)c->bytes,
+			c->total_ns / 1000.0 / c->calls, c->max_ns / 1000.0, hist_percentile(c, 50), hist_percentile(c, 99));
+	}
+	text_append(buf, len, "\nlatency histograms, calls under each bound in us\n");
+	for(op = 0; op < OP_COUNT; op++){
+		if(total[op].calls == 0){
+			continue;
+		}
+		text_append(buf, len, "%-9s", op_names[op]);
+		for(i = 0; i < STATS_BUCKETS; i++){
+			if(total[op].hist[i] != 0){
+				text_append(buf, len, " <%lu:%lu", 2UL << i, (unsigned long)total[op].hist[i]);
+			}
+		}
+		text_append(buf, len, "\n");
+	}
+
+	pthread_mutex_lock(&bcache_lock);
+	v[0] = bcache_hits;
+	v[1] = bcache_misses;
+	v[2] = ra_blocks;
+	v[3] = ra_hits;
+	v[4] = ra_wasted;
+	pthread_mutex_unlock(&bcache_lock);
+	pthread_mutex_lock(&ra_lock);
+	v[5] = ra_dropped;
+	pthread_mutex_unlock(&ra_lock);
+	pthread_mutex_lock(&commit_lock);
+	v[6] = jnl_commits;
+	v[7] = jnl_ops;
+	v[8] = sb_generation;
+	pthread_mutex_unlock(&commit_lock);
+	pthread_mutex_lock(&file_lock);
+	v[9] = dirty_pages;
+	pthread_mutex_unlock(&file_lock);
+	text_append(buf, len, "\ncache      %lu hits, %lu misses, %lu blocks\n", v[0], v[1], bcache_nbufs);
+	text_append(buf, len, "readahead  %lu blocks, %lu hits, %lu wasted, %lu dropped\n", v[2], v[3], v[4], v[5]);
+	text_append(buf, len, "journal    %lu commits for %lu operations, generation %lu\n", v[6], v[7], v[8]);
+	pthread_mutex_lock(&alloc_lock);
+	text_append(buf, len, "space      %ld free blocks, %ld reserved, %lu dirty pages, %ld of %ld groups loaded\n", free_count, reserved_count, v[9], groups_loaded, NUM_GROUPS);
+	pthread_mutex_unlock(&alloc_lock);
+	text_append(buf, len, "log        level %lu, %lu dropped\n", options.log_level, __atomic_load_n(&log_dropped, __ATOMIC_RELAXED));
+	return buf;
+}
+
+/*
+ * Queue one message for the log thread. Writers claim a position by moving
+ * log_head on, format into its slot and then publish it through the slot's
+ * seq; the log thread frees the slot by moving seq a full lap ahead.
+ */
+void log_msg(int level, const char *fmt, ...){
+	struct log_slot *slot;
+	unsigned long pos;
+	unsigned long seq;
+	va_list ap;
+
+	if(!log_allow(level, fmt)){
+		return;
+	}
+	if(!log_started){
+		//No thread yet (or any more), nothing else is running to block
+		va_start(ap, fmt);
+		printf("cs1550 %s: ", log_names[level]);
+		vprintf(fmt, ap);
+		va_end(ap);
+		fflush(stdout);
+		return;
+	}
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	for(;;){
+		slot = &log_ring[pos % LOG_RING];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq == pos){
+			if(__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if((long)(seq - pos) < 0){
+			//Still holds the message from a lap ago: full
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else{
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+	slot->level = level;
+	va_start(ap, fmt);
+	vsnprintf(slot->text, LOG_LINE, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	//The thread wakes up on its own every LOG_PERIOD_MS, only hurry it
+	//along when the ring is filling up
+	if(pos + 1 - __atomic_load_n(&log_tail, __ATOMIC_RELAXED) >= LOG_RING / 2){
+		pthread_cond_signal(&log_cond);
+	}
+}
+
+//The rate limit of the call site logging fmt, found by the format string's
+//address and probing on from there. A site is given the first unused slot
+//the first time it logs and keeps it. NULL once every slot is taken.
+struct log_limit *log_limit_for(const char *fmt){
+	unsigned long i = ((uintptr_t)fmt >> 3) % LOG_LIMITS;
+	unsigned long n;
+	const char *owner;
+
+	for(n = 0; n < LOG_LIMITS; n++, i = (i + 1) % LOG_LIMITS){
+		owner = __atomic_load_n(&log_limits[i].fmt, __ATOMIC_ACQUIRE);
+		if(owner == NULL && __atomic_compare_exchange_n(&log_limits[i].fmt, &owner, fmt, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			return &log_limits[i];
+		}
+		if(owner == fmt){
+			return &log_limits[i];
+		}
+	}
+	return NULL;
+}
+
+//Count a message against its call site's budget for this second. Returns 0
+//if it is over and should only be counted. The first message of a new
+//second reports how many were held back in the last one.
+int log_allow(int level, const char *fmt){
+	struct log_limit *l = log_limit_for(fmt);
+	time_t now = time(NULL);
+	time_t window;
+	unsigned long suppressed;
+
+	if(l == NULL){
+		return 1;
+	}
+	window = __atomic_load_n(&l->window, __ATOMIC_RELAXED);
+	if(window != now && __atomic_compare_exchange_n(&l->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+		__atomic_store_n(&l->count, 0, __ATOMIC_RELAXED);
+		suppressed = __atomic_exchange_n(&l->suppressed, 0, __ATOMIC_RELAXED);
+		if(suppressed > 0){
+			log_msg(level, "%lu similar messages suppressed\n", suppressed);
+		}
+	}
+	if(__atomic_fetch_add(&l->count, 1, __ATOMIC_RELAXED) >= LOG_BURST){
+		__atomic_fetch_add(&l->suppressed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+//Write out every published message in order, called by the log thread only
+void log_drain(void){
+	static unsigned long reported = 0;
+	struct log_slot *slot;
+	unsigned long dropped;
+	int wrote = 0;
+
+	for(;;){
+		slot = &log_ring[log_tail % LOG_RING];
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1){
+			break;
+		}
+		printf("cs1550 %s: %s", log_names[slot->level], slot->text);
+		if(slot->text[0] == '\0' || slot->text[strlen(slot->text) - 1] != '\n'){
+			printf("\n");
+		}
+		__atomic_store_n(&slot->seq, log_tail + LOG_RING, __ATOMIC_RELEASE);
+		__atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELAXED);
+		wrote = 1;
+	}
+	dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	if(dropped != reported){
+		printf("cs1550 warn: %lu log messages dropped, the ring was full\n", dropped - reported);
+		reported = dropped;
+		wrote = 1;
+	}
+	if(wrote){
+		fflush(stdout);
+	}
+}
+
+int log_start(void){
+	unsigned long i;
+
+	if(options.log_level == LOG_OFF){
+		return 0;
+	}
+	//Start over from position 0, where position p lives in slot
+	//p % LOG_RING. Nothing is queued once log_stop() has drained the ring.
+	log_head = 0;
+	log_tail = 0;
+	for(i = 0; i < LOG_RING; i++){
+		log_ring[i].seq = i;
+	}
+	log_stop_flag = 0;
+	if(pthread_create(&log_thread, NULL, log_worker, NULL) != 0){
+		return -1;
+	}
+	log_started = 1;
+	return 0;
+}
+
+//Write out what is still queued and stop the thread; later messages are
+//written directly
+void log_stop(void){
+	if(!log_started){
+		return;
+	}
+	pthread_mutex_lock(&log_lock);
+	log_stop_flag = 1;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+	pthread_join(log_thread, NULL);
+	log_started = 0;
+}
+
+void *log_worker(void *arg){
+	struct timespec ts;
+	int stop;
+
+	(void) arg;
+	do{
+		log_drain();
+		pthread_mutex_lock(&log_lock);
+		stop = log_stop_flag;
+		if(!stop){
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LOG_PERIOD_MS * 1000000L;
+			if(ts.tv_nsec >= 1000000000L){
+				ts.tv_sec += 1;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&log_cond, &log_lock, &ts);
+			stop = log_stop_flag;
+		}
+		pthread_mutex_unlock(&log_lock);
+	}while(!stop);
+	log_drain();
+	return NULL;
+}
+
+/*
+ * Offline tools, driven by cs1550_mkfs.c and cs1550_fsck.c against the
+ * image at disk_path while it is not mounted.
+ */
+
+//Make disk_path a volume of volume_bytes in block_size byte blocks holding
+//an empty filesystem, DEFAULT_VOLUME_BYTES if volume_bytes is 0. The image
+//file is grown to the volume's size, never shrunk. An image that already
+//holds a filesystem is only formatted with force.
+int cs1550_mkfs(int block_size, long volume_bytes, int force, FILE *out){
+	struct cs1550_superblock sb;
+	struct cs1550_geometry g;
+	struct stat st;
+	int res;
+	int i;
+
+	res = geo_compute(&g, block_size, (volume_bytes > 0 ? volume_bytes : DEFAULT_VOLUME_BYTES) / MAX(block_size, 1));
+	if(res != 0){
+		return res;
+	}
+	disk_fd = open(disk_path, O_RDWR | O_CREAT, 0644);
+	if(disk_fd < 0){
+		return -errno;
+	}
+	for(i = 0; i < 2 && !force; i++){
+		if(read_superblock(i, &sb) == 0 && super_intact(&sb)){
+			res = -EEXIST;	//Older layouts too
+		}
+	}
+	if(res == 0 && fstat(disk_fd, &st) != 0){
+		res = -errno;
+	}
+	if(res == 0 && st.st_size < (off_t)g.num_blocks * g.block_size && ftruncate(disk_fd, (off_t)g.num_blocks * g.block_size) != 0){
+		res = -errno;
+	}
+	if(res == 0){
+		res = geo_setup(&g);
+	}
+	if(res == 0){
+		res = format_disk();
+	}
+	if(res == 0){
+		fprintf(out, "%s: %ld blocks of %d bytes\n", disk_path, (long)MAX_NUM_BLOCKS, BLOCK_SIZE);
+		fprintf(out, "superblocks  0-%ld\n", (long)SUPER_BLOCKS - 1);
+		fprintf(out, "copies       %ld-%ld and %ld-%ld, %ld table and %ld bitmap blocks each\n",
+			TABLE_COPY(0), TABLE_COPY(0) + COPY_BLOCKS - 1, TABLE_COPY(1), TABLE_COPY(1) + COPY_BLOCKS - 1, (long)TABLE_BLOCKS, (long)NUM_GROUPS);
+		fprintf(out, "journal      %ld-%ld\n", (long)JOURNAL_START, (long)FIRST_DIR_BLOCK - 1);
+		fprintf(out, "root         %ld\n", (long)FIRST_DIR_BLOCK);
+		fprintf(out, "data         %ld-%ld, %ld blocks free\n", (long)FIRST_FILE_BLOCK, (long)MAX_NUM_BLOCKS - 1, (long)(MAX_NUM_BLOCKS - FIRST_FILE_BLOCK));
+		fprintf(out, "directories  %d entries a leaf, %d an index block, %d index levels\n", MAX_FILES_IN_DIR, MAX_INDEX_ENTRIES, DIR_MAX_LEVELS);
+	}
+	disk_close();
+	geo_free();
+	return res;
+}
+
+/*
+ * fsck. The group table is read from the current copy with the journal
+ * replayed (only in memory when checking), then the directory tree from the
+ * root down, each file's extent block as its entry is met. Data blocks are never
+ * read, so the cost is one pass over the metadata. Every block reached is
+ * marked in fsck.reached, which is compared with the bitmaps at the end.
+ */
+struct fsck_state
+{
+	int mode;
+	FILE *out;
+	long problems;		//Found
+	long fixed;			//Of those, repaired
+	int failed;			//A repair could not be written
+	long dirs;
+	long files;
+	long used;			//Blocks reached from the root
+	uint64_t *reached;	//FREE_MAP_WORDS words
+};
+
+struct fsck_state fsck;
+
+//Report a problem. Returns 1 if it is to be fixed, which mode need allows,
+//and then says how with fix.
+int fsck_problem(int need, const char *fix, const char *fmt, ...){
+	va_list ap;
+	int fixing = fsck.mode >= need;
+
+	fsck.problems++;
+	fsck.fixed += fixing;
+	va_start(ap, fmt);
+	vfprintf(fsck.out, fmt, ap);
+	va_end(ap);
+	if(fixing){
+		fprintf(fsck.out, ", %s", fix);
+	}
+	fprintf(fsck.out, "\n");
+	return fixing;
+}
+
+//Mark count blocks from start as reached. Returns -ERANGE if they are not
+//all in the data area and -EEXIST if one is reached already, marking none.
+int fsck_claim(long start, long count){
+	long i;
+
+	if(count <= 0 || start < FIRST_DIR_BLOCK || start >= MAX_NUM_BLOCKS || count > MAX_NUM_BLOCKS - start){
+		return -ERANGE;
+	}
+	for(i = start; i < start + count; i++){
+		if(fsck.reached[i / 64] & (1ULL << (i % 64))){
+			return -EEXIST;
+		}
+	}
+	for(i = start; i < start + count; i++){
+		fsck.reached[i / 64] |= 1ULL << (i % 64);
+	}
+	fsck.used += count;
+	return 0;
+}
+
+void fsck_unclaim(long start, long count){
+	long i;
+
+	for(i = start; i < start + count; i++){
+		fsck.reached[i / 64] &= ~(1ULL << (i % 64));
+	}
+	fsck.used -= count;
+}
+
+//A nul terminated name of at most max characters without '/' or '.'
+int fsck_name_ok(const char *name, int max, int empty_ok){
+	size_t n = strnlen(name, max + 1);
+
+	return n <= (size_t)max && (n > 0 || empty_ok) && strchr(name, '/') == NULL && strchr(name, '.') == NULL;
+}
+
+//Commit a repair, remembering if it did not make it to disk
+void fsck_commit(void){
+	if(commit_metadata() != 0){
+		fsck.failed = 1;
+	}
+}
+
+//Path of an entry of the directory at dname for messages, NULL out of
+//memory. The caller frees it.
+char *fsck_path(const char *dname, const struct cs1550_file_directory *file){
+	char *path = malloc(strlen(dname) + MAX_FILENAME + MAX_EXTENSION + 3);
+
+	if(path != NULL){
+		sprintf(path, "%s/%s%s%s", dname, file->fname, file->fext[0] != '\0' ? "." : "", file->fext);
+	}
+	return path;
+}
+
+//Check one file's runs, extent block and size. Sets *drop if the entry is
+//to be removed and *changed if it was corrected.
+void fsck_file(const char *path, struct cs1550_file_directory *file, int *drop, int *changed){
+	struct cs1550_extent_block eb;
+	struct cs1550_extent runs[MAX_EXTENTS];
+	int claimed[MAX_EXTENTS];
+	const char *bad = NULL;
+	long blocks = 0;
+	long first;
+	int ext_claimed = 0;
+	int n = 0;
+	int i;
+
+	for(i = 0; i < INLINE_EXTENTS && file->extents[i].count != 0; i++){
+		runs[n++] = file->extents[i];
+	}
+	if(file->nExtentBlock != 0){
+		if(fsck_claim(file->nExtentBlock, 1) != 0){
+			bad = "extent block out of range or shared";
+		}
+		else{
+			ext_claimed = 1;
+			if(cache_read_block(file->nExtentBlock, &eb) != 0 || eb.nExtents < 0 || eb.nExtents > (int)EXTENTS_PER_BLOCK){
+				bad = "extent block unreadable";
+			}
+			else{
+				for(i = 0; i < eb.nExtents; i++){
+					runs[n++] = eb.extents[i];
+				}
+			}
+		}
+	}
+	for(i = 0; i < n; i++){
+		int res = fsck_claim(runs[i].start, runs[i].count);
+
+		claimed[i] = res == 0;
+		if(res == -ERANGE && bad == NULL){
+			bad = "blocks out of range";
+		}
+		else if(res == -EEXIST && bad == NULL){
+			bad = "blocks shared with another file";
+		}
+		blocks += claimed[i] ? runs[i].count : 0;
+	}
+	if(bad != NULL){
+		if(fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: %s", path, bad)){
+			for(i = 0; i < n; i++){
+				if(claimed[i]){
+					fsck_unclaim(runs[i].start, runs[i].count);
+				}
+			}
+			if(ext_claimed){
+				fsck_unclaim(file->nExtentBlock, 1);
+			}
+			*drop = 1;
+			return;
+		}
+	}
+	else if(file->fsize > (size_t)blocks * BLOCK_SIZE){
+		if(fsck_problem(CS1550_FSCK_PREEN, "cut to fit", "%s: size %lu beyond its %ld blocks", path, (unsigned long)file->fsize, blocks)){
+			file->fsize = blocks * BLOCK_SIZE;
+			*changed = 1;
+		}
+	}
+	first = n > 0 ? runs[0].start : -1;
+	if(n > 0 ? file->nStartBlock != first : file->nStartBlock > 0){
+		if(fsck_problem(CS1550_FSCK_PREEN, "corrected", "%s: start block %ld, first run at %ld", path, file->nStartBlock, first)){
+			file->nStartBlock = first;
+			*changed = 1;
+		}
+	}
+	fsck.files++;
+}
+
+//Check the entries of a leaf covering hashes [lo, hi) and the files and
+//directories they stand for. Returns -1 if the leaf is to be dropped,
+//otherwise whether it was changed.
+int fsck_leaf(const char *dname, long block, cs1550_directory_entry *leaf, int above, uint64_t lo, uint64_t hi){
+	const char *name = *dname != '\0' ? dname : "root";
+	char *path;
+	int *dropped;
+	int changed = 0;
+	int n;
+	int i;
+	int j;
+	int res;
+
+	if(above > 0 && fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: leaf %ld where an index block belongs", name, block)){
+		return -1;
+	}
+	n = leaf->nFiles;
+	if(n < 0 || n > (int)MAX_FILES_IN_DIR){
+		n = n < 0 ? 0 : (int)MAX_FILES_IN_DIR;
+		if(fsck_problem(CS1550_FSCK_REPAIR, "corrected", "%s: %d entries listed in block %ld, room for %d", name, leaf->nFiles, block, n)){
+			leaf->nFiles = n;
+			changed = 1;
+		}
+	}
+	dropped = calloc(MAX_FILES_IN_DIR, sizeof(int));
+	if(dropped == NULL){
+		fsck.failed = 1;
+		return 0;
+	}
+	for(i = 0; i < n; i++){
+		struct cs1550_file_directory *file = &leaf->files[i];
+		uint64_t h;
+
+		if(!fsck_name_ok(file->fname, MAX_FILENAME, 0) || !fsck_name_ok(file->fext, MAX_EXTENSION, 1)){
+			if(fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: entry %d of block %ld has a bad name", name, i, block)){
+				dropped[i] = 1;
+			}
+			continue;
+		}
+		path = fsck_path(dname, file);
+		if(path == NULL){
+			fsck.failed = 1;
+			continue;
+		}
+		for(j = 0; j < i && (dropped[j] || strcmp(leaf->files[j].fname, file->fname) != 0 || strcmp(leaf->files[j].fext, file->fext) != 0); j++);
+		h = dir_hash(file->fname, file->fext);
+		if(j < i){
+			dropped[i] = fsck_problem(CS1550_FSCK_REPAIR, "second removed", "%s: listed twice", path);
+		}
+		else if(h < lo || h >= hi){
+			dropped[i] = fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: in leaf %ld, which does not cover its hash", path, block);
+		}
+		if(dropped[i]){
+			free(path);
+			continue;
+		}
+		if(file->ftype == ENTRY_FILE){
+			fsck_file(path, file, &dropped[i], &changed);
+		}
+		else if(file->ftype != ENTRY_DIR){
+			dropped[i] = fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: of unknown type %d", path, file->ftype);
+		}
+		//A subdirectory, checked all the way down
+		else if((res = fsck_claim(file->nStartBlock, 1)) != 0){
+			dropped[i] = fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: directory block %ld %s", path, file->nStartBlock,
+				res == -ERANGE ? "out of range" : "shared");
+		}
+		else if(fsck_tree(path, file->nStartBlock, -1, 0, 1ULL << 32)){
+			fsck_unclaim(file->nStartBlock, 1);
+			dropped[i] = 1;
+		}
+		else{
+			fsck.dirs++;
+		}
+		free(path);
+	}
+
+	//Close the gaps, keeping the order
+	for(i = j = 0; i < n; i++){
+		if(!dropped[i]){
+			leaf->files[j++] = leaf->files[i];
+		}
+	}
+	if(j < n){
+		memset(&leaf->files[j], 0, (n - j) * sizeof(struct cs1550_file_directory));
+		leaf->nFiles = j;
+		changed = 1;
+	}
+	free(dropped);
+	return changed;
+}
+
+//Check an index block covering hashes [lo, hi) and the blocks under it.
+//Returns -1 if it is to be dropped, otherwise whether it was changed.
+int fsck_index(const char *dname, long block, struct cs1550_index_block *ib, int above, uint64_t lo, uint64_t hi){
+	const char *name = *dname != '\0' ? dname : "root";
+	const char *bad;
+	char *skip;
+	uint64_t last = lo;
+	uint64_t next;
+	int changed = 0;
+	int kept = 0;
+	int i;
+	int j;
+	int res;
+
+	if(!dir_node_ok(ib, above)){
+		return fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: index block %ld is damaged", name, block) ? -1 : 0;
+	}
+	skip = calloc(ib->nEntries, 1);
+	if(skip == NULL){
+		fsck.failed = 1;
+		return 0;
+	}
+	for(i = 0; i < ib->nEntries; i++){
+		bad = NULL;
+		if(kept > 0 && (ib->entries[i].hash <= last || ib->entries[i].hash >= hi)){
+			bad = "out of order";
+		}
+		else if((res = fsck_claim(ib->entries[i].block, 1)) != 0){
+			bad = res == -ERANGE ? "out of range" : "shared";
+		}
+		if(bad != NULL){
+			skip[i] = 1 + fsck_problem(CS1550_FSCK_REPAIR, "removed", "%s: entry %d of index block %ld %s", name, i, block, bad);
+			continue;
+		}
+		if(kept++ > 0){
+			last = ib->entries[i].hash;
+		}
+	}
+
+	//Each child covers from its hash (the first from lo) to the next one's
+	for(i = 0, kept = 0; i < ib->nEntries; i++){
+		if(skip[i]){
+			continue;
+		}
+		for(j = i + 1; j < ib->nEntries && skip[j]; j++);
+		next = j < ib->nEntries ? ib->entries[j].hash : hi;
+		if(fsck_tree(dname, ib->entries[i].block, ib->nLevels, kept++ > 0 ? ib->entries[i].hash : lo, next)){
+			fsck_unclaim(ib->entries[i].block, 1);
+			skip[i] = 2;
+		}
+	}
+
+	for(i = j = 0; i < ib->nEntries; i++){
+		if(skip[i] != 2){
+			ib->entries[j++] = ib->entries[i];
+		}
+	}
+	if(j < ib->nEntries){
+		memset(&ib->entries[j], 0, (ib->nEntries - j) * sizeof(struct cs1550_index_entry));
+		ib->nEntries = j;
+		changed = 1;
+	}
+	free(skip);
+	return j == 0 ? -1 : changed;	//Nothing left under it
+}
+
+/*
+ * Check a block of a directory and everything under it. The block was
+ * claimed by the caller; above is nLevels of the index block it was
+ * reached from, -1 for the directory's first block, and [lo, hi) the
+ * hashes it covers. dname is the directory's path for messages, "" for
+ * the root. Returns 1 if the block is no good and the caller is to drop
+ * it. A first block left with nothing is made an empty leaf instead, the
+ * root's whatever is wrong with it.
+ */
+int fsck_tree(const char *dname, long block, int above, uint64_t lo, uint64_t hi){
+	void *buf = malloc(BLOCK_SIZE);
+	cs1550_directory_entry *leaf = buf;
+	int readable;
+	int res;
+
+	if(buf == NULL){
+		fsck.failed = 1;
+		return 0;
+	}
+	readable = cache_read_block(block, buf) == 0;
+	if(!readable){
+		res = fsck_problem(CS1550_FSCK_REPAIR, *dname != '\0' ? "removed" : "emptied", "%s: directory block %ld unreadable",
+			*dname != '\0' ? dname : "root", block) ? -1 : 0;
+	}
+	else if(leaf->nFiles == DIR_INDEX_MARK){
+		res = fsck_index(dname, block, buf, above, lo, hi);
+	}
+	else{
+		res = fsck_leaf(dname, block, leaf, above, lo, hi);
+	}
+	if(res < 0 && above < 0 && (*dname == '\0' || readable)){
+		memset(buf, 0, BLOCK_SIZE);
+		res = 1;
+	}
+	if(res > 0){
+		txn_begin();
+		if(journal_write_block(block, buf) != 0){
+			fsck.failed = 1;
+		}
+		fsck_commit();
+	}
+	free(buf);
+	return res < 0;
+}
+
+//Bits of word w of group g that stand for blocks of the data area. The
+//rest must always be set.
+uint64_t fsck_data_mask(long g, long w){
+	long first = (g << GROUP_SHIFT) + w * 64;
+	uint64_t mask = ~0ULL;
+
+	if(first + 64 <= FIRST_FILE_BLOCK || first >= MAX_NUM_BLOCKS){
+		return 0;
+	}
+	if(first < FIRST_FILE_BLOCK){
+		mask &= ~0ULL << (FIRST_FILE_BLOCK - first);
+	}
+	if(first + 64 > MAX_NUM_BLOCKS){
+		mask &= ~0ULL >> (first + 64 - MAX_NUM_BLOCKS);
+	}
+	return mask;
+}
+
+//Word w of group g of the blocks reached
+uint64_t fsck_reached_word(long g, long w){
+	long i = ((g << GROUP_SHIFT) >> 6) + w;
+
+	return i < FREE_MAP_WORDS ? fsck.reached[i] : 0;
+}
+
+/*
+ * Compare the blocks reached with the bitmaps and fix the bitmaps to match,
+ * a group at a time. A bitmap that does not match its checksum is rebuilt
+ * from the blocks reached, and each group's free count is checked too.
+ */
+void fsck_free_space(void){
+	long words = GROUP_BLOCKS / 64;
+	long leaked = 0;
+	long lost = 0;
+	long damaged = 0;
+	long miscounted = 0;
+	long nfree;
+	long g;
+	long w;
+	int fix_leaked;
+	int fix_lost;
+	int fix_damaged;
+	int fix_count;
+	int changed;
+	uint64_t *bits;
+
+	pthread_mutex_lock(&alloc_lock);
+	for(g = 0; g < NUM_GROUPS; g++){
+		bits = group_map(g);
+		if(bits == NULL){
+			damaged++;
+			continue;
+		}
+		nfree = 0;
+		for(w = 0; w < words; w++){
+			uint64_t m = fsck_data_mask(g, w);
+			uint64_t r = fsck_reached_word(g, w);
+
+			leaked += __builtin_popcountll(bits[w] & m & ~r);
+			lost += __builtin_popcountll(~bits[w] & ((r & m) | ~m));
+			nfree += __builtin_popcountll(~bits[w] & m);
+		}
+		miscounted += nfree != group_table[g].nFree;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	fix_damaged = damaged > 0 && fsck_problem(CS1550_FSCK_PREEN, "rebuilt", "%ld group bitmaps are damaged", damaged);
+	fix_leaked = leaked > 0 && fsck_problem(CS1550_FSCK_PREEN, "freed", "%ld blocks marked in use are not reached", leaked);
+	fix_lost = lost > 0 && fsck_problem(CS1550_FSCK_PREEN, "marked", "%ld blocks in use are marked free", lost);
+	fix_count = miscounted > 0 && fsck_problem(CS1550_FSCK_PREEN, "corrected", "%ld groups have a wrong free count", miscounted);
+	if(!fix_damaged && !fix_leaked && !fix_lost && !fix_count){
+		return;
+	}
+	txn_begin();
+	pthread_mutex_lock(&alloc_lock);
+	for(g = 0; g < NUM_GROUPS; g++){
+		bits = group_map(g);
+		changed = 0;
+		if(bits == NULL){
+			if(!fix_damaged || (bits = calloc(1, BLOCK_SIZE)) == NULL){
+				continue;
+			}
+			group_maps[g] = bits;
+			loaded_groups[groups_loaded++] = g;
+			for(w = 0; w < words; w++){
+				bits[w] = ~fsck_data_mask(g, w) | fsck_reached_word(g, w);
+			}
+			changed = 1;
+		}
+		nfree = 0;
+		for(w = 0; w < words; w++){
+			uint64_t m = fsck_data_mask(g, w);
+			uint64_t r = fsck_reached_word(g, w);
+			uint64_t x = bits[w];
+
+			if(fix_leaked){
+				x &= ~(m & ~r);
+			}
+			if(fix_lost){
+				x |= (r & m) | ~m;
+			}
+			changed |= x != bits[w];
+			bits[w] = x;
+			nfree += __builtin_popcountll(~x & m);
+		}
+		if(changed || (fix_count && nfree != group_table[g].nFree)){
+			group_table[g].nFree = nfree;
+			group_touch(g, 0);
+			group_touch(g, 1);
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	count_free();
+	fsck_commit();
+}
+
+/*
+ * Check the image at disk_path, fixing what mode allows: nothing with
+ * CS1550_FSCK_CHECK, which writes nothing. Returns what fsck(8) would
+ * exit with: 0 clean, 1 all problems fixed, 4 problems left, 8 unable to
+ * check.
+ */
+int cs1550_fsck(int mode, FILE *out){
+	struct cs1550_superblock sb;
+	void *root;
+	int recommit = 0;
+
+	memset(&fsck, 0, sizeof(fsck));
+	fsck.mode = mode;
+	fsck.out = out;
+	init_locks();
+	if(disk_open() != 0){
+		return 8;
+	}
+	if(load_copy(&sb, 0) != 0){
+		fprintf(out, "%s: no valid superblock, not a cs1550 image\n", disk_path);
+		disk_close();
+		geo_free();
+		return 8;
+	}
+	fsck.reached = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+	if(fsck.reached == NULL){
+		disk_close();
+		geo_free();
+		return 8;
+	}
+	bcache_init(options.cache_blocks);
+	if(journal_replay(&sb, mode == CS1550_FSCK_CHECK) != 0){
+		if(fsck_problem(CS1550_FSCK_PREEN, "committed over", "journal record %lu is damaged, its commit is lost", sb.generation)){
+			recommit = 1;	//A new commit makes the record unreachable
+		}
+	}
+
+	if(fsck_claim(FIRST_DIR_BLOCK, 1) == 0){
+		fsck_tree("", FIRST_DIR_BLOCK, -1, 0, 1ULL << 32);
+	}
+	if(recommit && (root = malloc(BLOCK_SIZE)) != NULL){
+		//Log the root again for something to commit
+		txn_begin();
+		if(cache_read_block(FIRST_DIR_BLOCK, root) != 0 || journal_write_block(FIRST_DIR_BLOCK, root) != 0){
+			fsck.failed = 1;
+		}
+		fsck_commit();
+		free(root);
+	}
+	fsck_free_space();
+
+	fprintf(out, "%s: %ld directories, %ld files, %ld blocks used, %ld free\n", disk_path, fsck.dirs, fsck.files, fsck.used, free_count);
+	if(fsck.failed){
+		fprintf(out, "%s: unable to write the repairs\n", disk_path);
+	}
+	if(mode == CS1550_FSCK_CHECK){
+		jnl_count = 0;	//Replayed only in memory
+	}
+	else{
+		journal_flush();
+	}
+	disk_close();
+	index_clear();
+	bcache_destroy();
+	free(fsck.reached);
+	geo_free();
+	if(fsck.failed){
+		return 8;
+	}
+	return fsck.problems > fsck.fixed ? 4 : fsck.fixed > 0;
+}
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not. 
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+	int res = 0;
+	size_t file_size = 0;
+	struct cs1550_path p;
+
+	if(DEBUG)printf("In getattr\n");
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	//The stats file is read-only and as long as its contents right now
+	if(strcmp(path, STATS_PATH) == 0){
+		free(stats_text(&file_size));
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = file_size;
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&meta_lock);
+	//Walk down to the directory holding the last component, checking the
+	//name limits on the way
+	res = walk_path(path, &p);
+	if(DEBUG)printf("---PATH--- [%s] parent: [%ld], filename: [%s], extension: [%s]\n", path, p.parent, p.filename, p.extension);
+	if(res == 0){
+		res = stat_entry(&p, stbuf);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+	if(res != 0){
+		LOG(LOG_DEBUG, "Path %s not found\n", path);
+	}
+
+        return res;
+}
+
+//Attributes of the directory starting at block, or with block -1 of a
+//file of size bytes. A directory's block is its inode number.
+void fill_stat(struct stat *stbuf, long block, size_t size){
+	memset(stbuf, 0, sizeof(struct stat));
+	if(block >= 0){
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		stbuf->st_ino = block;
+		return;
+	}
+	stbuf->st_mode = S_IFREG | 0666;
+	stbuf->st_nlink = 1; //file links
+	stbuf->st_size = size; //file size, data not written back yet included
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * (BLOCK_SIZE / 512);
+}
+
+/*
+ * Attributes of what p was walked to, for getattr and the inode frontend.
+ * Caller holds meta_lock.
+ */
+int stat_entry(const struct cs1550_path *p, struct stat *stbuf){
+	long dir_block;
+	long leaf_block;
+	size_t file_size = 0;
+	int i;
+
+	//Check if name is a directory, the root included. That and a missing
+	//name come straight from the index once seen.
+	dir_block = p->parent < 0 ? FIRST_DIR_BLOCK : lookup_directory(p->parent, p->filename, p->extension);
+	if(dir_block != -ENOTDIR){
+		if(dir_block >= 0){
+			fill_stat(stbuf, dir_block, 0);
+			return 0; //no error
+		}
+		return dir_block;
+	}
+	if(DEBUG)printf("Checking if regular file\n");
+
+	//Process file by looking at the leaf its name hashes to, the index
+	//goes straight to the leaf of a name seen before
+	cs1550_directory_entry subdir;
+
+	pthread_rwlock_rdlock(dir_lock(p->parent));
+	i = find_file(p->parent, p->filename, p->extension, &leaf_block, &subdir);
+	if(i >= 0){
+		//An open file may have grown in memory
+		struct cs1550_file *f = file_find(p->parent, p->filename, p->extension);
+
+		file_size = f != NULL ? f->size : subdir.files[i].fsize;
+	}
+	pthread_rwlock_unlock(dir_lock(p->parent));
+
+	if(i < 0){
+		return i;
+	}
+	fill_stat(stbuf, -1, file_size);
+	return 0;
+}
+
+//Where readdir_block() lists names to
+struct readdir_arg
+{
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+//List the names in one block of a directory, index blocks have none
+int readdir_block(long block, void *data, void *arg){
+	cs1550_directory_entry *file_listing = data;
+	struct readdir_arg *ra = arg;
+	char file_buf[MAX_FILENAME + 1 + MAX_EXTENSION + 1];
+	int j = 0;
+
+	(void) block;
+
+	if(file_listing->nFiles == DIR_INDEX_MARK){
+		return 0;
+	}
+	if(DEBUG)printf("file_listing.nFiles = %d\n", file_listing->nFiles);
+	for(j = 0; j < file_listing->nFiles; j++){ //Iterate over the non-empty filenames in this leaf and print them to the user using filler()
+		if(DEBUG)printf("Fname=<%s> exten=<%s>\n",file_listing->files[j].fname, file_listing->files[j].fext);
+		strcpy(file_buf, file_listing->files[j].fname);	//Copied file name
+		//Check for extension
+		if(strcmp(file_listing->files[j].fext, "") != 0){	//Found extension
+			strcat(file_buf, ".");	//Concatinate extension
+			strcat(file_buf, file_listing->files[j].fext);
+		}
+		if(DEBUG)printf("Call filler for listing files\n");
+		ra->filler(ra->buf, file_buf, NULL, 0);
+	}
+	return 0;
+}
+
+/* 
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) offset;
+	(void) fi;
+
+	int res = 0;
+	long subdir_block;
+	struct cs1550_path p;
+	struct readdir_arg ra = {buf, filler};
+	
+	if(DEBUG)printf("In readdir\n");
+
+	if(DEBUG)printf("Path: %s\n",path);
+
+	pthread_rwlock_rdlock(&meta_lock);
+
+	//Only directories can be listed, the root or one found by its parent
+	res = walk_path(path, &p);
+	subdir_block = res != 0 ? res : p.parent < 0 ? FIRST_DIR_BLOCK : lookup_directory(p.parent, p.filename, p.extension);
+
+	//Directory not found
+	if(subdir_block < 0){
+		pthread_rwlock_unlock(&meta_lock);
+		LOG(LOG_DEBUG, "Directory %s not found\n", path);
+		return subdir_block;
+	}
+
+	if(DEBUG)printf("Subdir nStartBlock = %ld\n", subdir_block);
+
+	//the filler function allows us to add entries to the listing
+	//read the fuse.h file for a description (in the ../include dir)
+	if(DEBUG)printf("Before filler\n");
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	if(DEBUG)printf("After filler\n");	
+
+	//List the files and directories in it, leaf by leaf
+	pthread_rwlock_rdlock(dir_lock(subdir_block));
+	res = dir_walk(subdir_block, readdir_block, &ra);
+	pthread_rwlock_unlock(dir_lock(subdir_block));
+	pthread_rwlock_unlock(&meta_lock);
+
+	if(res != 0){
+		LOG(LOG_ERR, "Unable to read directory block\n");
+		return res;
+	}
+	if(subdir_block == FIRST_DIR_BLOCK){
+		filler(buf, STATS_NAME, NULL, 0);
+	}
+	return 0;
+}
+
+/* 
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+	(void) mode;
+
+	int res = 0;
+	struct cs1550_path p;
+
+	if(DEBUG)printf("In mkdir\n");
+
+	if(DEBUG)printf("Path: %s\n", path);
+
+	pthread_rwlock_wrlock(&meta_lock);
+
+	//Directories go in any directory, so find the one it goes in
+	res = walk_path(path, &p);
+	if(res == 0){
+		res = make_dir(&p);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+	return res;
+}
+
+//The directory p was walked to, for mkdir and the inode frontend. Caller
+//holds meta_lock for writing.
+int make_dir(const struct cs1550_path *p){
+	int res = 0;
+	long block = 0;
+	struct cs1550_file_directory entry;
+	cs1550_directory_entry subdir;
+
+	if(DEBUG)printf("In mkdir, trying to create directory <%s.%s>\n", p->filename, p->extension);
+	block = p->parent < 0 ? FIRST_DIR_BLOCK : lookup_directory(p->parent, p->filename, p->extension);
+	if(block != -ENOENT){
+		if(DEBUG)printf("%s already exists\n", p->filename);
+		return block >= 0 || block == -ENOTDIR ? -EEXIST : block;
+	}
+
+	//Need to get nStarBlock from the bitmaps
+	txn_begin_blocks(DIR_TXN_BLOCKS);
+	if(alloc_blocks(1, &block, 0) != 1){
+		txn_end();
+		LOG(LOG_WARN, "Unable to find free block\n");
+		return -ENOSPC;
+	}
+
+	//A reused block may still hold an old directory, start it as an empty leaf
+	memset(&subdir, 0, sizeof(subdir));
+	res = journal_write_block(block, &subdir);
+
+	//Write directory into its parent
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.fname, p->filename);
+	strcpy(entry.fext, p->extension);
+	entry.ftype = ENTRY_DIR;
+	entry.nStartBlock = block;
+	if(res == 0){
+		res = dir_insert(p->parent, &entry);
+	}
+	if(res != 0){
+		pthread_mutex_lock(&alloc_lock);
+		free_block(block);
+		pthread_mutex_unlock(&alloc_lock);
+		txn_end();
+		LOG(LOG_WARN, "Unable to add directory %s\n", p->filename);
+		return res;
+	}
+
+	if(DEBUG)printf("************In mkdir, nStartBlock = %ld\n", block);
+
+	if(commit_metadata() != 0){	//Parent leaves, bitmaps and the new block
+		res = -EIO;
+	}
+
+	if(DEBUG)printf("Directory %s created with nStartBlock = %ld\n", p->filename, block);
+
+	return res;
+}
+
+//Stop at the first leaf with anything in it
+int dir_block_empty(long block, void *data, void *arg){
+	cs1550_directory_entry *leaf = data;
+
+	(void) block;
+	(void) arg;
+	return leaf->nFiles > 0 ? -ENOTEMPTY : 0;
+}
+
+//Release a block of a directory being removed
+int dir_block_free(long block, void *data, void *arg){
+	(void) data;
+	(void) arg;
+
+	pthread_mutex_lock(&alloc_lock);
+	free_block(block);
+	pthread_mutex_unlock(&alloc_lock);
+	return 0;
+}
+
+/* 
+ * Removes a directory.
+ */
+static int cs1550_rmdir(const char *path)
+{
+	int res = 0;
+	struct cs1550_path p;
+
+	if(DEBUG)printf("In rmdir\n");
+
+	//Exclusive: nobody else can be using the directory while it goes away
+	pthread_rwlock_wrlock(&meta_lock);
+
+	res = walk_path(path, &p);
+	if(res == 0){
+		res = remove_dir(&p);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+
+	if(DEBUG)printf("Directory %s removed: %d\n", path, res);
+
+	return res;
+}
+
+//The directory p was walked to, if it is empty. Caller holds meta_lock for
+//writing.
+int remove_dir(const struct cs1550_path *p){
+	int i = 0;
+	int res = 0;
+	long leaf_block;
+	cs1550_directory_entry parent;
+
+	if(p->parent < 0){
+		return -EBUSY;		//Cannot remove the root
+	}
+	i = find_file(p->parent, p->filename, p->extension, &leaf_block, &parent);
+	if(i < 0 || parent.files[i].ftype != ENTRY_DIR){
+		return i < 0 ? i : -ENOTDIR;
+	}
+
+	long subdir_block = parent.files[i].nStartBlock;
+
+	res = dir_walk(subdir_block, dir_block_empty, NULL);
+	if(res != 0){
+		if(res == -EIO){
+			LOG(LOG_ERR, "Unable to read subdirectory block\n");
+		}
+		return res;
+	}
+
+	//Take it out of its parent and release every block it had
+	txn_begin();
+	res = dir_remove(p->parent, leaf_block, &parent, i);
+	index_drop_directory(subdir_block);
+	dir_generation++;
+	dir_walk(subdir_block, dir_block_free, NULL);
+
+	if(commit_metadata() != 0 && res == 0){	//Parent leaf and bitmaps
+		res = -EIO;
+	}
+
+	if(DEBUG)printf("Freed directory block %ld\n", subdir_block);
+
+	return res;
+}
+
+/* 
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	(void) mode;
+	(void) dev;
+
+	int res;
+	struct cs1550_path p;
+
+	if(DEBUG)printf("In mknod\n");
+
+	if(DEBUG)printf("Mknod Path: %s\n", path);
+
+	pthread_rwlock_rdlock(&meta_lock);
+
+	//Walk to the directory it goes in, checking the name lengths
+	res = walk_path(path, &p);
+	if(res != 0){
+		pthread_rwlock_unlock(&meta_lock);
+		LOG(LOG_DEBUG, "No directory for %s\n", path);
+		return res;
+	}
+	res = make_file(&p);
+	pthread_rwlock_unlock(&meta_lock);
+	return res;
+}
+
+//An empty file at what p was walked to, for mknod and the inode frontend.
+//Caller holds meta_lock for reading.
+int make_file(const struct cs1550_path *p){
+	int res;
+	int i = 0;
+	long leaf_block;
+	struct cs1550_file_directory entry;
+
+	if(p->parent < 0){
+		return -EEXIST;		//The root
+	}
+	if(DEBUG)printf("Path: parent [%ld] file[%s] ext [%s]\n", p->parent, p->filename, p->extension);
+
+        // found directory nStartBlock, go to the leaf the name hashes to
+	long subdir_block = p->parent;
+
+	pthread_rwlock_wrlock(dir_lock(subdir_block));
+
+	//Leaf the file would go in
+	cs1550_directory_entry subdir;
+
+	//Check if file already exists in subdir
+	i = find_file(subdir_block, p->filename, p->extension, &leaf_block, &subdir);
+	if(i >= 0){
+		if(DEBUG)printf("File already exists\n");
+		res = -EEXIST;
+		goto out;
+	}
+	if(i != -ENOENT){
+		LOG(LOG_ERR, "Unable to read subdirectory block\n");
+		res = i;
+		goto out;
+	}
+
+	//If file does not exist
+	if(DEBUG)printf("mknod file %s does not exist\n", p->filename);
+	
+	//The file gets no blocks until data is written to it
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.fname, p->filename);
+	strcpy(entry.fext, p->extension);
+	entry.ftype = ENTRY_FILE;
+	entry.nStartBlock = -1;
+	entry.fsize = 0;
+
+	if(DEBUG)printf("Subdir Start Block %ld\n", subdir_block);
+	txn_begin_blocks(DIR_TXN_BLOCKS);
+	res = dir_insert(subdir_block, &entry);	//Log the leaf, and any split
+	if(res != 0){
+		txn_end();
+		if(res == -ENOSPC){
+			LOG(LOG_WARN, "Unable to add %s\n", p->filename);
+		}
+		goto out;
+	}
+	if(commit_metadata() != 0){
+		res = -EIO;
+	}
+
+out:
+	pthread_rwlock_unlock(dir_lock(subdir_block));
+	return res;
+}
+
+/*
+ * Deletes a file
+ */
+static int cs1550_unlink(const char *path)
+{
+	int res = 0;
+	struct cs1550_path p;
+
+	if(DEBUG)printf("In unlink\n");
+
+	pthread_rwlock_rdlock(&meta_lock);
+
+	res = walk_path(path, &p);
+	if(res == 0){
+		res = remove_file(&p);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+	return res;
+}
+
+//The file p was walked to and its data. Caller holds meta_lock for reading.
+int remove_file(const struct cs1550_path *p){
+	int i = 0;
+	int res = 0;
+	long leaf_block;
+
+	if(p->parent < 0){
+		return -EISDIR;
+	}
+
+	long subdir_block = p->parent;
+	cs1550_directory_entry subdir;
+
+	pthread_rwlock_wrlock(dir_lock(subdir_block));
+
+	i = find_file(subdir_block, p->filename, p->extension, &leaf_block, &subdir);
+	if(i < 0){
+		if(i == -EIO){
+			LOG(LOG_ERR, "Unable to read subdirectory block\n");
+		}
+		res = i;
+		goto out;
+	}
+	if(subdir.files[i].ftype == ENTRY_DIR){
+		res = -EISDIR;
+		goto out;
+	}
+
+	//Drop any data not written back and release the file's blocks
+	struct cs1550_file *f = file_find(subdir_block, p->filename, p->extension);
+	if(f != NULL){
+		file_discard(f);
+	}
+	txn_begin();
+	free_extents(&subdir.files[i]);
+
+	//Fill the hole with the last file of the leaf so it stays packed
+	res = dir_remove(subdir_block, leaf_block, &subdir, i);
+
+	if(DEBUG)printf("File %s.%s removed\n", p->filename, p->extension);
+	if(commit_metadata() != 0 && res == 0){	//Bitmaps and the leaf
+		res = -EIO;
+	}
+
+out:
+	pthread_rwlock_unlock(dir_lock(subdir_block));
+	return res;
+}
+
+/*
+ * Moves or renames a file or directory, replacing a file already at the
+ * new name, or an empty directory when a directory is moved. A directory
+ * cannot be moved below itself.
+ */
+static int cs1550_rename(const char *from, const char *to)
+{
+	int res = 0;
+	struct cs1550_path src;
+	struct cs1550_path dst;
+
+	if(DEBUG)printf("In rename %s -> %s\n", from, to);
+
+	//Exclusive: a directory may move, so no walk can be half way through
+	pthread_rwlock_wrlock(&meta_lock);
+
+	res = walk_path(from, &src);
+	if(res == 0){
+		res = rename_entry(&src, to, &dst);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+	if(res != 0){
+		LOG(LOG_DEBUG, "Rename %s to %s failed\n", from, to);
+	}
+	return res;
+}
+
+//Look for the directory starting at arg among the subdirectories listed
+//in one block of a directory and below them
+int dir_block_holds(long block, void *data, void *arg){
+	cs1550_directory_entry *leaf = data;
+	long *target = arg;
+	int res = 0;
+	int j;
+
+	(void) block;
+
+	if(leaf->nFiles == DIR_INDEX_MARK){
+		return 0;
+	}
+	for(j = 0; j < leaf->nFiles && res == 0; j++){
+		if(leaf->files[j].ftype == ENTRY_DIR){
+			res = leaf->files[j].nStartBlock == *target ? 1 : dir_walk(leaf->files[j].nStartBlock, dir_block_holds, arg);
+		}
+	}
+	return res;
+}
+
+/*
+ * Move what src was walked to. The new name is walked from the path to,
+ * where passing through a directory being moved shows it would go below
+ * itself, or with to NULL is dst as it stands, which is then checked by
+ * searching the moved directory. Caller holds meta_lock for writing.
+ */
+int rename_entry(const struct cs1550_path *src, const char *to, struct cs1550_path *dst){
+	int i = 0;
+	int j;
+	int k;
+	int res = 0;
+	long src_leaf;
+	long dst_leaf;
+	long below;
+	struct cs1550_file_directory entry;
+	struct cs1550_file_directory target;
+	struct cs1550_file *f;
+	cs1550_directory_entry *leaf;
+
+	if(src->parent < 0){
+		return -EBUSY;		//Cannot move the root
+	}
+	leaf = malloc(BLOCK_SIZE);
+	if(leaf == NULL){
+		return -ENOMEM;
+	}
+	i = find_file(src->parent, src->filename, src->extension, &src_leaf, leaf);
+	if(i < 0){
+		res = i;
+		goto out;
+	}
+	entry = leaf->files[i];
+
+	//A directory's own blocks must not come up on the way to the new name
+	below = entry.ftype == ENTRY_DIR ? entry.nStartBlock : -1;
+	if(to != NULL){
+		res = walk_components(to, dst, below);
+	}
+	else if(below >= 0 && dst->parent != src->parent && dst->parent != FIRST_DIR_BLOCK){
+		res = dst->parent == below ? 1 : dir_walk(below, dir_block_holds, &dst->parent);
+		res = res == 1 ? -EINVAL : res;
+	}
+	if(res == 0 && dst->parent < 0){
+		res = -EBUSY;
+	}
+	if(res != 0 || (dst->parent == src->parent && strcmp(dst->filename, src->filename) == 0 && strcmp(dst->extension, src->extension) == 0)){
+		goto out;
+	}
+
+	//Whatever has the new name goes, if it can
+	j = find_file(dst->parent, dst->filename, dst->extension, &dst_leaf, leaf);
+	if(j >= 0){
+		target = leaf->files[j];
+		if(target.ftype != entry.ftype){
+			res = target.ftype == ENTRY_DIR ? -EISDIR : -ENOTDIR;
+		}
+		else if(target.ftype == ENTRY_DIR){
+			res = dir_walk(target.nStartBlock, dir_block_empty, NULL);
+		}
+	}
+	else if(j != -ENOENT){
+		res = j;
+	}
+	if(res != 0){
+		goto out;
+	}
+
+	//The new name goes in first. It takes the place of a target, which has
+	//the same name and so the same leaf, without a split or anything else
+	//that can fail part way.
+	txn_begin_blocks(DIR_TXN_BLOCKS + 2);
+	strcpy(entry.fname, dst->filename);
+	strcpy(entry.fext, dst->extension);
+	if(j >= 0){
+		leaf->files[j] = entry;
+		res = journal_write_block(dst_leaf, leaf);
+		if(res == 0){
+			index_add(dst->parent, &entry, dst_leaf, j);
+		}
+	}
+	else{
+		res = dir_insert(dst->parent, &entry);
+	}
+	if(res != 0){
+		txn_end();	//Nothing changed
+		goto out;
+	}
+
+	//Then the old name comes out, found again since a split may have moved it
+	i = find_file(src->parent, src->filename, src->extension, &src_leaf, leaf);
+	res = i < 0 ? i : dir_remove(src->parent, src_leaf, leaf, i);
+	if(res != 0){
+		//The new name goes back to what it was, the target or nothing
+		index_drop_directory(src->parent);
+		index_drop_directory(dst->parent);
+		k = find_file(dst->parent, dst->filename, dst->extension, &dst_leaf, leaf);
+		if(k >= 0 && j >= 0){
+			leaf->files[k] = target;
+			journal_write_block(dst_leaf, leaf);
+			index_add(dst->parent, &target, dst_leaf, k);
+		}
+		else if(k >= 0){
+			dir_remove(dst->parent, dst_leaf, leaf, k);
+		}
+		commit_metadata();
+		goto out;
+	}
+
+	//Both names are right, only now is the target released
+	if(j >= 0){
+		if(target.ftype == ENTRY_DIR){
+			index_drop_directory(target.nStartBlock);
+			dir_walk(target.nStartBlock, dir_block_free, NULL);
+		}
+		else{
+			f = file_find(dst->parent, dst->filename, dst->extension);
+			if(f != NULL){
+				file_discard(f);
+			}
+			free_extents(&target);
+		}
+	}
+
+	//An open file moves with its entry, handles walk to it again
+	if(entry.ftype == ENTRY_FILE){
+		f = file_find(src->parent, src->filename, src->extension);
+		if(f != NULL){
+			pthread_mutex_lock(&file_lock);
+			f->dir_block = dst->parent;
+			strcpy(f->fname, dst->filename);
+			strcpy(f->fext, dst->extension);
+			pthread_mutex_unlock(&file_lock);
+		}
+	}
+	dir_generation++;
+
+	if(commit_metadata() != 0 && res == 0){	//Both parents' leaves and bitmaps
+		res = -EIO;
+	}
+
+out:
+	free(leaf);
+	return res;
+}
+
+/* 
+ * Read size bytes from file into buf starting from offset
  *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	int res;
+	struct file_ref ref;
+	struct cs1550_handle *h = (fi != NULL) ? (struct cs1550_handle *)(uintptr_t)fi->fh : NULL;
+	struct extent_cursor cursor = { -1, 0, 0, -1, 0 };
+
+	if(DEBUG)printf("In read\n");
+
+	if(DEBUG)printf("Path: %s\n", path);
+
+	//Nothing to do for an empty read
+	
+	if(DEBUG)printf("-----------Size is %ld\n", size);
+
+	if(size == 0){
+		return 0;
+	}
+
+	//The stats file as it was at open, or as it is now without a handle
+	if(h != NULL ? h->stats != NULL : strcmp(path, STATS_PATH) == 0){
+		size_t len = 0;
+		char *text = h != NULL ? h->stats : stats_text(&len);
+
+		if(h != NULL){
+			len = h->stats_len;
+		}
+		res = 0;
+		if(text != NULL && (size_t)offset < len){
+			res = MIN(size, len - offset);
+			memcpy(buf, text + offset, res);
+		}
+		if(h == NULL){
+			free(text);
+		}
+		return res;
+	}
+
+	//Through the open handle when there is one, by path otherwise
+	res = get_file(path, h, 0, &ref);
+	if(res != 0){
+		LOG(LOG_DEBUG, "Read File %s not found\n", path != NULL ? path : h->fname);
+		return res;
+	}
+
+	struct cs1550_file_directory *file = &ref.dir.files[ref.slot];
+
+	if(DEBUG)printf(">>>>>>offset : %ld	File size: %ld\n", offset, file->fsize);
+	if(DEBUG)printf("Read File nStartBlock %ld\n", file->nStartBlock);
+
+	if(h != NULL){
+		pthread_mutex_lock(&h->lock);
+		cursor = h->cursor;
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	//Map offset through the file's runs (starting at the handle's cursor) and
+	//read from there until size bytes or the end of the file. Reading at or
+	//past the end of the file returns nothing.
+	res = read_file_data(file, buf, size, offset, &cursor);
+
+	//Data not written back yet comes from the file's dirty pages
+	struct cs1550_file *f = (h != NULL && h->file != NULL && !h->file->unlinked) ? h->file : file_find(ref.dir_block, file->fname, file->fext);
+	if(res >= 0 && f != NULL && f->pages != NULL){
+		res = (size_t)offset < f->size ? (int)MIN(size, f->size - offset) : 0;
+		buffer_read(f, buf, res, offset);
+	}
+
+	if(h != NULL){
+		long ra_from = 0;
+		long ra_count = 0;
+
+		pthread_mutex_lock(&h->lock);
+		h->cursor = cursor;
+		h->leaf = ref.leaf;
+		h->slot = ref.slot;
+
+		//Grow the window while reads continue where the last one ended
+		if(res > 0 && offset == h->ra_next && options.readahead > 0){
+			long next = (offset + res + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			long last = (file->fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+			h->ra_window = h->ra_window == 0 ? READAHEAD_MIN_BLOCKS : MIN(h->ra_window * 2, (long)options.readahead);
+			if(h->ra_end < next){
+				h->ra_end = next;
+			}
+			//Top up once less than half a window is left in the cache
+			if(h->ra_end - next < h->ra_window / 2 && h->ra_end < last){
+				ra_from = h->ra_end;
+				ra_count = MIN(next + h->ra_window, last) - ra_from;
+				h->ra_end += ra_count;
+			}
+		}
+		else if(res > 0){
+			h->ra_window = 0;	//Random access, stop reading ahead
+			h->ra_end = 0;
+		}
+		if(res > 0){
+			h->ra_next = offset + res;
+		}
+		pthread_mutex_unlock(&h->lock);
+
+		if(ra_count > 0){
+			readahead_file(file, ra_from, ra_count);
+		}
+	}
+
+	if(DEBUG)printf("In read, bytes %d	size %ld\n", res, size);
+
+	put_file(&ref);
+	return res;
+}
+
+/* 
+ * Write size bytes from buf into file starting from offset
  *
- *****************************************************************************/
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size, 
+			  off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+	struct file_ref ref;
+	struct cs1550_handle *h = (fi != NULL) ? (struct cs1550_handle *)(uintptr_t)fi->fh : NULL;
+	struct extent_cursor cursor = { -1, 0, 0, -1, 0 };
+
+	if(DEBUG)printf("In write\n");
+
+	if(DEBUG)printf("Path: %s\n", path);
+
+	//Nothing to do for an empty write
+
+	if(size == 0){
+		return 0;
+	}
+
+	if(size > INT_MAX){
+		size = INT_MAX & ~(BLOCK_SIZE - 1);	//The result has to fit the return value
+	}
+
+	if(h != NULL ? h->stats != NULL : strcmp(path, STATS_PATH) == 0){
+		return -EACCES;
+	}
+
+	//Through the open handle when there is one, by path otherwise
+	res = get_file(path, h, 1, &ref);
+	if(res != 0){
+		if(DEBUG) printf("write(), File %s does not exist\n", path);
+		return res;
+	}
+
+	struct cs1550_file_directory *file = &ref.dir.files[ref.slot];
+	struct cs1550_file *f = (h != NULL && h->file != NULL && !h->file->unlinked) ? h->file : file_find(ref.dir_block, file->fname, file->fext);
+	size_t fsize = f != NULL ? f->size : file->fsize;
+	
+	//check that offset is <= to the file size
+
+	if(DEBUG)printf("Offset: %ld	File size: %ld\n", offset, fsize);
+	if((size_t)offset > fsize){
+		LOG(LOG_INFO, "Offset %ld out of bounds for %s\n", (long)offset, file->fname);
+		put_file(&ref);
+		return -EFBIG;
+	}
+
+	if(DEBUG)printf("Write() file nStartBlock %ld\n", file->nStartBlock);
+
+	if(h != NULL){
+		pthread_mutex_lock(&h->lock);
+		cursor = h->cursor;
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	//Allocate any new blocks in one batch, then write the data: into the
+	//file's dirty pages when it is open, straight to disk otherwise
+	struct cs1550_file_directory before = *file;
+	txn_begin();
+	if(f != NULL){
+		res = buffer_write(f, file, buf, size, offset);
+	}
+	else{
+		res = write_file_data(file, buf, size, offset, &cursor);
+	}
+
+	if(DEBUG)printf("write(), Bytes written %d\n", res);
+
+	if(h != NULL){
+		pthread_mutex_lock(&h->lock);
+		h->cursor = cursor;
+		h->leaf = ref.leaf;
+		h->slot = ref.slot;
+		pthread_mutex_unlock(&h->lock);
+	}
+
+	//Record the new size and runs in the directory entry
+	if(f == NULL && res > 0 && offset + (size_t)res > file->fsize){
+		file->fsize = offset + res;
+	}
+	//One commit for the whole call, buffered data changes nothing yet
+	if(memcmp(&before, file, sizeof(before)) != 0){
+		if(journal_write_block(ref.leaf, &ref.dir) != 0){
+			res = -EIO;
+		}
+		if(commit_metadata() != 0 && res >= 0){
+			res = -EIO;
+		}
+	}
+	else{
+		txn_end();
+	}
+
+	//Past the dirty limit this file is written back now, the others by the
+	//writeback thread
+	if(f != NULL && res > 0){
+		int over;
+
+		pthread_mutex_lock(&file_lock);
+		over = dirty_pages * BLOCK_SIZE > options.dirty_kb * 1024;
+		if(over){
+			pthread_cond_signal(&wb_cond);
+		}
+		pthread_mutex_unlock(&file_lock);
+		if(over && flush_file(f, &ref) != 0){
+			res = -EIO;
+		}
+	}
+
+	put_file(&ref);
+	return res;
+}
 
 /*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
+ * truncate is called when a file is opened with O_TRUNC or its size is set
+ * with truncate(). The file is cut or extended with zeros, see
+ * truncate_file().
  */
 static int cs1550_truncate(const char *path, off_t size)
 {
-	(void) path;
-	(void) size;
+	struct file_ref ref;
+	int res;
+
+	if(strcmp(path, STATS_PATH) == 0){
+		return -EACCES;
+	}
 
-    return 0;
+	res = get_file(path, NULL, 1, &ref);
+	if(res != 0){
+		return res;
+	}
+	res = truncate_file(&ref, size);
+	put_file(&ref);
+	return res;
 }
 
 
@@ -1026,22 +6138,98 @@ static int cs1550_truncate(const char *path, off_t size)
  */
 static int cs1550_open(const char *path, struct fuse_file_info *fi)
 {
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+	struct file_ref ref;
+	struct cs1550_handle *h;
+	int res;
+
+	//The stats file is read from a snapshot taken now, so a reader sees one
+	//consistent copy however many reads it takes
+	if(strcmp(path, STATS_PATH) == 0){
+		if((fi->flags & O_ACCMODE) != O_RDONLY){
+			return -EACCES;
+		}
+		h = calloc(1, sizeof(struct cs1550_handle));
+		if(h == NULL || (h->stats = stats_text(&h->stats_len)) == NULL){
+			free(h);
+			return -ENOMEM;
+		}
+		h->dir_block = -1;
+		pthread_mutex_init(&h->lock, NULL);
+		fi->direct_io = 1;	//Size changes from one open to the next
+		fi->fh = (uintptr_t)h;
+		return 0;
+	}
 
-    //It's not really necessary for this project to anything in open
+	//if we can't find the desired file, return an error
+	res = get_file(path, NULL, 0, &ref);
+	if(res != 0){
+		return res;
+	}
 
-    /* We're not going to worry about permissions for this project, but 
+	/* We're not going to worry about permissions for this project, but 
 	   if we were and we don't have them to the file we should return an error
 
         return -EACCES;
-    */
+	*/
+
+	return open_handle(&ref, fi);
+}
+
+//Resolve the file once, read and write use the handle from here on. Takes
+//the locks of a file located by get_file() or lock_file() and drops them.
+int open_handle(struct file_ref *ref, struct fuse_file_info *fi){
+	struct cs1550_handle *h = malloc(sizeof(struct cs1550_handle));
+
+	if(h == NULL){
+		put_file(ref);
+		return -ENOMEM;
+	}
+	h->dir_block = ref->dir_block;
+	h->leaf = ref->leaf;
+	h->slot = ref->slot;
+	h->dir_generation = dir_generation;
+	strcpy(h->fname, ref->dir.files[ref->slot].fname);
+	strcpy(h->fext, ref->dir.files[ref->slot].fext);
+	pthread_mutex_init(&h->lock, NULL);
+	h->cursor.start = -1;
+	h->cursor.index = 0;
+	h->cursor.extent = 0;
+	h->cursor.block = -1;
+	h->cursor.trims = 0;
+	h->ra_next = 0;
+	h->ra_window = 0;
+	h->ra_end = 0;
+	h->file = NULL;
+	h->stats = NULL;
+	h->stats_len = 0;
+	if(options.dirty_kb > 0){
+		h->file = file_get(ref->dir_block, h->fname, h->fext, ref->dir.files[ref->slot].fsize);
+	}
+	put_file(ref);
+
+	fi->fh = (uintptr_t)h;
+	return 0; //success!
+}
 
-    return 0; //success!
+/*
+ * Called when the last descriptor of an open file is closed
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+	struct cs1550_handle *h = (struct cs1550_handle *)(uintptr_t)fi->fh;
+
+	(void) path;
+
+	if(h != NULL){
+		if(h->file != NULL){
+			writeback_file(h->file, 1);	//Last chance to write it, errors went to flush
+		}
+		free(h->stats);
+		pthread_mutex_destroy(&h->lock);
+		free(h);
+		fi->fh = 0;
+	}
+	return 0;
 }
 
 /*
@@ -1052,30 +6240,434 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
  */
 static int cs1550_flush (const char *path , struct fuse_file_info *fi)
 {
+	struct cs1550_handle *h = (struct cs1550_handle *)(uintptr_t)fi->fh;
+
 	(void) path;
-	(void) fi;
 
+	//Write back on every close so errors reach close()
+	if(h != NULL && h->file != NULL){
+		return writeback_file(h->file, 0);
+	}
 	return 0; //success!
 }
 
+/*
+ * Write back the file's dirty data and wait for the disk
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	struct cs1550_handle *h = (fi != NULL) ? (struct cs1550_handle *)(uintptr_t)fi->fh : NULL;
+	int res = 0;
+
+	(void) path;
+
+	if(h != NULL && h->file != NULL){
+		res = writeback_file(h->file, 0);
+	}
+	if(res == 0 && (datasync ? fdatasync(disk_fd) : fsync(disk_fd)) != 0){
+		res = -errno;
+	}
+	return res;
+}
+
+/*
+ * Called once when the filesystem is mounted. The disk image stays open
+ * until destroy so the handlers never reopen it. The geometry comes from
+ * the superblock, so the cache is sized only once that has been read.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+	struct cs1550_geometry g;
+
+	(void) conn;
+
+	init_locks();
+	if(log_start() != 0){
+		LOG(LOG_WARN, "Unable to start the log thread, logging directly\n");
+	}
+	if(disk_open() == 0){
+		if(load_superblock() != 0){
+			LOG(LOG_ERR, "Unable to mount %s cleanly\n", disk_path);
+		}
+	}
+	if(BLOCK_SIZE == 0){
+		//No usable image, the tables still need a shape for the handlers to fail on
+		geo_compute(&g, DEFAULT_BLOCK_SIZE, DEFAULT_VOLUME_BYTES / DEFAULT_BLOCK_SIZE);
+		if(geo_setup(&g) != 0){
+			LOG(LOG_ERR, "Out of memory mounting %s\n", disk_path);
+		}
+	}
+	if(bcache_init(options.cache_blocks) != 0){
+		LOG(LOG_WARN, "Unable to allocate %lu cache blocks, running uncached\n", options.cache_blocks);
+	}
+	if(readahead_start() != 0){
+		LOG(LOG_WARN, "Unable to start the readahead thread, running without readahead\n");
+	}
+	if(writeback_start() != 0){
+		LOG(LOG_WARN, "Unable to start the writeback thread, dirty data waits for flush\n");
+	}
+	return NULL;
+}
+
+/*
+ * Called when the filesystem is unmounted
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+
+	readahead_stop();
+	writeback_stop();
+	journal_flush();
+	if(DEBUG)printf("Journal: %lu commits for %lu operations\n", jnl_commits, jnl_ops);
+	disk_close();
+	index_clear();
+	bcache_destroy();
+	geo_free();
+	log_stop();
+}
+
+
+/*
+ * Timed entry points, each handler counted under its own name in the stats
+ */
+static int stats_getattr(const char *path, struct stat *stbuf)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_GETATTR, t, cs1550_getattr(path, stbuf));
+}
+
+static int stats_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_READDIR, t, cs1550_readdir(path, buf, filler, offset, fi));
+}
+
+static int stats_mkdir(const char *path, mode_t mode)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_MKDIR, t, cs1550_mkdir(path, mode));
+}
+
+static int stats_rmdir(const char *path)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_RMDIR, t, cs1550_rmdir(path));
+}
+
+static int stats_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_MKNOD, t, cs1550_mknod(path, mode, dev));
+}
+
+static int stats_unlink(const char *path)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_UNLINK, t, cs1550_unlink(path));
+}
+
+static int stats_rename(const char *from, const char *to)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_RENAME, t, cs1550_rename(from, to));
+}
+
+static int stats_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_READ, t, cs1550_read(path, buf, size, offset, fi));
+}
+
+static int stats_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_WRITE, t, cs1550_write(path, buf, size, offset, fi));
+}
+
+static int stats_truncate(const char *path, off_t size)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_TRUNCATE, t, cs1550_truncate(path, size));
+}
+
+static int stats_open(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_OPEN, t, cs1550_open(path, fi));
+}
+
+static int stats_release(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_RELEASE, t, cs1550_release(path, fi));
+}
+
+static int stats_flush(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_FLUSH, t, cs1550_flush(path, fi));
+}
+
+static int stats_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	uint64_t t = stats_start();
+	return stats_end(OP_FSYNC, t, cs1550_fsync(path, datasync, fi));
+}
 
 //register our new functions as the implementations of the syscalls
 static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
-	.unlink = cs1550_unlink,
-	.truncate = cs1550_truncate,
-	.flush = cs1550_flush,
-	.open	= cs1550_open,
+    .getattr	= stats_getattr,
+    .readdir	= stats_readdir,
+    .mkdir	= stats_mkdir,
+	.rmdir = stats_rmdir,
+    .read	= stats_read,
+    .write	= stats_write,
+	.mknod	= stats_mknod,
+	.unlink = stats_unlink,
+	.rename = stats_rename,
+	.truncate = stats_truncate,
+	.flush = stats_flush,
+	.fsync = stats_fsync,
+	.open	= stats_open,
+	.release = stats_release,
+	.init	= cs1550_init,
+	.destroy = cs1550_destroy,
+};
+
+//For drivers linking the handlers in, see cs1550.h
+const struct fuse_operations *cs1550_operations(void){
+	return &hello_oper;
+}
+
+/*
+ * Entry points for a frontend that names things by directory and entry
+ * rather than by path, such as the low-level one in cs1550_ll.c. A
+ * directory is its first block, which is also its st_ino.
+ */
+long cs1550_root_block(void){
+	return FIRST_DIR_BLOCK;
+}
+
+//The entry called name in the directory at dir, as walk_path() would give it
+int entry_path(long dir, const char *name, struct cs1550_path *p){
+	p->parent = dir;
+	return split_name(name, strlen(name), p->filename, p->extension);
+}
+
+//Attributes of one entry, without walking a path to its directory
+int cs1550_stat_entry(long dir, const char *name, struct stat *st){
+	uint64_t t = stats_start();
+	struct cs1550_path p;
+	int res;
+
+	if(dir == FIRST_DIR_BLOCK && strcmp(name, STATS_NAME) == 0){
+		return stats_end(OP_GETATTR, t, cs1550_getattr(STATS_PATH, st));
+	}
+
+	pthread_rwlock_rdlock(&meta_lock);
+	res = entry_path(dir, name, &p);
+	if(res == 0){
+		res = stat_entry(&p, st);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+	return stats_end(OP_GETATTR, t, res);
+}
+
+//Where list_block() lists entries to
+struct list_arg
+{
+	long dir;
+	int (*fn)(void *arg, const char *name, const struct stat *st);
+	void *arg;
 };
 
-//Don't change this.
+//List the entries in one block of a directory with their attributes. Each
+//one goes in the name index too, so the lookups that follow a listing find
+//their leaf without reading the directory again.
+int list_block(long block, void *data, void *arg){
+	cs1550_directory_entry *file_listing = data;
+	struct list_arg *la = arg;
+	char file_buf[MAX_FILENAME + 1 + MAX_EXTENSION + 1];
+	struct stat st;
+	int j;
+
+	if(file_listing->nFiles == DIR_INDEX_MARK){
+		return 0;
+	}
+	for(j = 0; j < file_listing->nFiles; j++){
+		struct cs1550_file_directory *file = &file_listing->files[j];
+
+		index_add(la->dir, file, block, j);
+		strcpy(file_buf, file->fname);
+		if(strcmp(file->fext, "") != 0){
+			strcat(file_buf, ".");
+			strcat(file_buf, file->fext);
+		}
+		if(file->ftype == ENTRY_DIR){
+			fill_stat(&st, file->nStartBlock, 0);
+		}
+		else{
+			//An open file may have grown in memory
+			struct cs1550_file *f = file_find(la->dir, file->fname, file->fext);
+
+			fill_stat(&st, -1, f != NULL ? f->size : file->fsize);
+		}
+		if(la->fn(la->arg, file_buf, &st) != 0){
+			return 1;	//Stop, the caller has all it wants
+		}
+	}
+	return 0;
+}
+
+//Call fn with the name and attributes of every entry in the directory at
+//dir, stopping early when it returns nonzero
+int cs1550_list_dir(long dir, int (*fn)(void *arg, const char *name, const struct stat *st), void *arg){
+	uint64_t t = stats_start();
+	struct list_arg la = {dir, fn, arg};
+	struct stat st;
+	int res;
+
+	pthread_rwlock_rdlock(&meta_lock);
+	pthread_rwlock_rdlock(dir_lock(dir));
+	res = dir_walk(dir, list_block, &la);
+	pthread_rwlock_unlock(dir_lock(dir));
+	pthread_rwlock_unlock(&meta_lock);
+
+	if(res < 0){
+		LOG(LOG_ERR, "Unable to read directory block\n");
+		return stats_end(OP_READDIR, t, res);
+	}
+	if(res == 0 && dir == FIRST_DIR_BLOCK && cs1550_getattr(STATS_PATH, &st) == 0){
+		fn(arg, STATS_NAME, &st);
+	}
+	return stats_end(OP_READDIR, t, 0);
+}
+
+//Open one entry, read and write then go through the handle in fi
+int cs1550_open_entry(long dir, const char *name, struct fuse_file_info *fi){
+	uint64_t t = stats_start();
+	struct cs1550_path p;
+	struct file_ref ref;
+	int res;
+
+	if(dir == FIRST_DIR_BLOCK && strcmp(name, STATS_NAME) == 0){
+		return stats_end(OP_OPEN, t, cs1550_open(STATS_PATH, fi));
+	}
+
+	pthread_rwlock_rdlock(&meta_lock);
+	res = entry_path(dir, name, &p);
+	if(res != 0){
+		pthread_rwlock_unlock(&meta_lock);
+		return stats_end(OP_OPEN, t, res);
+	}
+	res = lock_file(p.parent, p.filename, p.extension, NULL, 0, &ref);
+	if(res != 0){
+		return stats_end(OP_OPEN, t, res);
+	}
+	return stats_end(OP_OPEN, t, open_handle(&ref, fi));
+}
+
+//Change the size of one entry, as truncate() would
+int cs1550_truncate_entry(long dir, const char *name, off_t size){
+	uint64_t t = stats_start();
+	struct cs1550_path p;
+	struct file_ref ref;
+	int res;
+
+	if(dir == FIRST_DIR_BLOCK && strcmp(name, STATS_NAME) == 0){
+		return stats_end(OP_TRUNCATE, t, -EACCES);
+	}
+
+	pthread_rwlock_rdlock(&meta_lock);
+	res = entry_path(dir, name, &p);
+	if(res != 0){
+		pthread_rwlock_unlock(&meta_lock);
+		return stats_end(OP_TRUNCATE, t, res);
+	}
+	res = lock_file(p.parent, p.filename, p.extension, NULL, 1, &ref);
+	if(res != 0){
+		return stats_end(OP_TRUNCATE, t, res);
+	}
+	res = truncate_file(&ref, size);
+	put_file(&ref);
+	return stats_end(OP_TRUNCATE, t, res);
+}
+
+//Run fn on one entry under meta_lock, held for writing if exclusive, and
+//count it as op
+int entry_op(int op, long dir, const char *name, int exclusive, int (*fn)(const struct cs1550_path *p)){
+	uint64_t t = stats_start();
+	struct cs1550_path p;
+	int res;
+
+	if(exclusive){
+		pthread_rwlock_wrlock(&meta_lock);
+	}
+	else{
+		pthread_rwlock_rdlock(&meta_lock);
+	}
+	res = entry_path(dir, name, &p);
+	if(res == 0){
+		res = fn(&p);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+	return stats_end(op, t, res);
+}
+
+int cs1550_mknod_entry(long dir, const char *name){
+	return entry_op(OP_MKNOD, dir, name, 0, make_file);
+}
+
+int cs1550_unlink_entry(long dir, const char *name){
+	return entry_op(OP_UNLINK, dir, name, 0, remove_file);
+}
+
+int cs1550_mkdir_entry(long dir, const char *name){
+	return entry_op(OP_MKDIR, dir, name, 1, make_dir);
+}
+
+int cs1550_rmdir_entry(long dir, const char *name){
+	return entry_op(OP_RMDIR, dir, name, 1, remove_dir);
+}
+
+//Move an entry, replacing what has the new name as rename() would. The
+//directory at new_dir must not be the moved one or below it.
+int cs1550_rename_entry(long dir, const char *name, long new_dir, const char *new_name){
+	uint64_t t = stats_start();
+	struct cs1550_path src;
+	struct cs1550_path dst;
+	int res;
+
+	pthread_rwlock_wrlock(&meta_lock);
+	res = entry_path(dir, name, &src);
+	if(res == 0){
+		res = entry_path(new_dir, new_name, &dst);
+	}
+	if(res == 0){
+		res = rename_entry(&src, NULL, &dst);
+	}
+	pthread_rwlock_unlock(&meta_lock);
+	return stats_end(OP_RENAME, t, res);
+}
+
+#ifndef CS1550_LIBRARY
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	//Pick out our own -o options and pass the rest on to FUSE
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1){
+		return 1;
+	}
+
+	//fuse_main() may chdir to / when it daemonizes, so pin down the image first
+	if(realpath(DISKFILE, disk_path) == NULL){
+		strcpy(disk_path, DISKFILE);
+	}
+	res = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
+#endif
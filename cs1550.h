@@ -0,0 +1,68 @@
+/*
+	Interface to the cs1550 filesystem for programs that drive its handlers
+	directly instead of through the FUSE kernel module, such as
+	cs1550_bench.c, or register them with another FUSE frontend, such as
+	the low-level one in cs1550_ll.c. Build cs1550.c with -DCS1550_LIBRARY
+	to leave out its main() and link it into the program.
+*/
+
+#ifndef CS1550_H
+#define CS1550_H
+
+#ifndef FUSE_USE_VERSION
+#define	FUSE_USE_VERSION 26
+#endif
+
+#include <fuse.h>
+#include <limits.h>
+#include <stdio.h>
+
+//Mount options, given with -o name=value
+struct cs1550_options
+{
+	unsigned long cache_blocks;	//Capacity of the block cache in blocks, 0 disables it
+	unsigned long readahead;	//Largest readahead window in blocks, 0 disables it
+	unsigned long dirty_kb;		//Dirty file data held before writing back, 0 writes through
+	unsigned long dirty_age;	//Seconds dirty data may wait before it is written back
+	unsigned long log_level;	//0 off, 1 errors, 2 warnings, 3 info, 4 debug
+};
+
+//Set these before calling init() through the operations
+extern struct cs1550_options options;
+extern char disk_path[PATH_MAX];	//Image to open, should be absolute
+
+//The handlers, as registered with FUSE
+const struct fuse_operations *cs1550_operations(void);
+
+//For a frontend that names entries by directory and name instead of by
+//path. A directory is known by its first block, which getattr reports as
+//st_ino, starting from cs1550_root_block(). Each returns 0 or a negative
+//errno, the same ones as the path handlers. cs1550_list_dir() calls fn for
+//every entry until it returns nonzero. Once cs1550_open_entry() has filled
+//in fi, read, write, flush, fsync and release go through
+//cs1550_operations() with a NULL path.
+long cs1550_root_block(void);
+int cs1550_stat_entry(long dir, const char *name, struct stat *st);
+int cs1550_list_dir(long dir, int (*fn)(void *arg, const char *name, const struct stat *st), void *arg);
+int cs1550_open_entry(long dir, const char *name, struct fuse_file_info *fi);
+int cs1550_mknod_entry(long dir, const char *name);
+int cs1550_unlink_entry(long dir, const char *name);
+int cs1550_mkdir_entry(long dir, const char *name);
+int cs1550_rmdir_entry(long dir, const char *name);
+int cs1550_rename_entry(long dir, const char *name, long new_dir, const char *new_name);
+int cs1550_truncate_entry(long dir, const char *name, off_t size);
+
+//What cs1550_fsck() may change
+#define CS1550_FSCK_CHECK 0		//Nothing, the image is only read
+#define CS1550_FSCK_PREEN 1		//Free-space accounting, file sizes and start blocks
+#define CS1550_FSCK_REPAIR 2	//Also remove entries that cannot be fixed
+
+//Offline tools for an image at disk_path that is not mounted. Both report
+//to out. cs1550_mkfs() lays out volume_bytes (a default size if 0) in
+//block_size byte blocks, a power of two from 512 to 65536, and returns 0 or
+//a negative errno, -EEXIST for an image already formatted unless force is
+//set; cs1550_fsck() returns an fsck(8) exit status.
+int cs1550_mkfs(int block_size, long volume_bytes, int force, FILE *out);
+int cs1550_fsck(int mode, FILE *out);
+
+#endif
@@ -0,0 +1,532 @@
+/*
+	Offline benchmark for the cs1550 filesystem. It calls the handlers
+	directly against a scratch disk image, so it runs on any Linux box
+	without /dev/fuse or a mount, and reports throughput and latency
+	percentiles for each workload.
+
+	Build:
+		gcc -Wall -DCS1550_LIBRARY `pkg-config fuse --cflags` -c cs1550.c -o cs1550_lib.o
+		gcc -Wall `pkg-config fuse --cflags` cs1550_bench.c cs1550_lib.o -o cs1550_bench -lpthread
+
+	Usage: cs1550_bench [options] [workload...]
+		-d image	disk image to use, created if missing (default: a
+					temporary image that is removed afterwards)
+		-n files	number of files (default 64)
+		-s bytes	size each file is written to (default 16384)
+		-b bytes	size of each read and write (default 4096)
+		-r count	random reads or writes per file (default 16)
+		-i count	rounds of the stat and readdir storms and of remount
+					(default 100)
+		-p files	files in each directory (default 8, one leaf at 512
+					bytes; more make the directories split)
+		-D depth	levels of directories the benchmark's own directories
+					are nested under (default 0, at most 16), for the cost
+					of walking deep paths
+		-o opts		mount options as given to -o, e.g. dirty_kb=0,cache_blocks=64
+		-B bytes	format the image with this block size first (default: use
+					the image as it is, formatting a blank one with 512)
+
+	Workloads run in the order given. The default is all of them:
+		create write read randwrite randread stat readdir remount unlink
+*/
+
+#include "cs1550.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define DISK_BYTES (5 * 1024 * 1024)	//Same as dd bs=1K count=5120
+#define MAX_DEPTH 16
+#define PREFIX_BYTES (4 * MAX_DEPTH + 1)	//"/dNN" a level
+#define PATH_BYTES 128
+
+//Workload parameters, set from the command line
+struct bench_config
+{
+	long files;
+	long file_size;
+	long io_size;
+	long random_ops;
+	long rounds;
+	long per_dir;
+	long depth;
+};
+
+struct bench_config cfg = { 64, 16384, 4096, 16, 100, 8, 0 };
+char prefix[PREFIX_BYTES] = "";	//cfg.depth levels of directories, "" for the root
+int block_size = 0;		//Format with this block size, 0 to keep the image
+
+//Latencies of one workload in nanoseconds
+struct bench_stats
+{
+	uint64_t *ns;
+	unsigned long n;
+	unsigned long cap;
+};
+
+const struct fuse_operations *ops;
+unsigned int seed = 1550;
+
+uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void record(struct bench_stats *st, uint64_t ns){
+	if(st->n == st->cap){
+		st->cap = st->cap ? st->cap * 2 : 1024;
+		st->ns = realloc(st->ns, st->cap * sizeof(uint64_t));
+		if(st->ns == NULL){
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	st->ns[st->n++] = ns;
+}
+
+int cmp_ns(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+//Latency at percentile pct of the sorted samples, in microseconds
+double percentile(const struct bench_stats *st, double pct){
+	unsigned long i = (unsigned long)(pct / 100.0 * (st->n - 1) + 0.5);
+
+	return st->ns[i] / 1000.0;
+}
+
+void report(const char *name, struct bench_stats *st, uint64_t elapsed){
+	if(st->n == 0){
+		printf("%-10s %8d\n", name, 0);
+		return;
+	}
+	qsort(st->ns, st->n, sizeof(uint64_t), cmp_ns);
+	printf("%-10s %8lu %12.1f %9.1f %9.1f %9.1f %9.1f\n", name, st->n,
+		st->n / (elapsed / 1e9), percentile(st, 50), percentile(st, 90), percentile(st, 99), st->ns[st->n - 1] / 1000.0);
+}
+
+//A handler failed, there is nothing sensible to measure after that
+void check(int res, const char *what, const char *path){
+	if(res < 0){
+		fprintf(stderr, "%s %s: %s\n", what, path, strerror(-res));
+		exit(1);
+	}
+}
+
+void dir_path(char *buf, long d){
+	snprintf(buf, PATH_BYTES, "%s/b%03ld", prefix, d);
+}
+
+void file_path(char *buf, long i){
+	snprintf(buf, PATH_BYTES, "%s/b%03ld/f%05ld.dat", prefix, i / cfg.per_dir, i % cfg.per_dir);
+}
+
+//Make the directories of prefix, or take them away again from the deepest up
+void make_prefix(int remove){
+	char path[PATH_BYTES];
+	long l;
+
+	for(l = 0; l < cfg.depth; l++){
+		snprintf(path, 4 * (remove ? cfg.depth - l : l + 1) + 1, "%s", prefix);
+		check(remove ? ops->rmdir(path) : ops->mkdir(path, 0755), remove ? "rmdir" : "mkdir", path);
+	}
+}
+
+long num_dirs(void){
+	return (cfg.files + cfg.per_dir - 1) / cfg.per_dir;
+}
+
+int count_entry(void *buf, const char *name, const struct stat *stbuf, off_t off){
+	(void) name;
+	(void) stbuf;
+	(void) off;
+
+	(*(long *)buf)++;
+	return 0;
+}
+
+void run_create(struct bench_stats *st){
+	char path[PATH_BYTES];
+	uint64_t t;
+	long i;
+
+	make_prefix(0);
+	for(i = 0; i < cfg.files; i++){
+		if(i % cfg.per_dir == 0){
+			dir_path(path, i / cfg.per_dir);
+			check(ops->mkdir(path, 0755), "mkdir", path);
+		}
+		file_path(path, i);
+		t = now_ns();
+		check(ops->mknod(path, S_IFREG | 0644, 0), "mknod", path);
+		record(st, now_ns() - t);
+	}
+}
+
+//Open a file the way the kernel does, closing it again with flush and release
+void open_file(const char *path, struct fuse_file_info *fi){
+	memset(fi, 0, sizeof(*fi));
+	fi->flags = O_RDWR;
+	check(ops->open(path, fi), "open", path);
+}
+
+void close_file(const char *path, struct fuse_file_info *fi){
+	check(ops->flush(path, fi), "flush", path);
+	ops->release(path, fi);
+}
+
+//Sequential write (write set) or read of every file, io_size at a time
+void run_sequential(struct bench_stats *st, int write){
+	struct fuse_file_info fi;
+	char path[PATH_BYTES];
+	char *buf = malloc(cfg.io_size);
+	uint64_t t;
+	long off;
+	long len;
+	long i;
+	int res;
+
+	memset(buf, 'x', cfg.io_size);
+	for(i = 0; i < cfg.files; i++){
+		file_path(path, i);
+		open_file(path, &fi);
+		for(off = 0; off < cfg.file_size; off += len){
+			len = cfg.file_size - off < cfg.io_size ? cfg.file_size - off : cfg.io_size;
+			t = now_ns();
+			res = write ? ops->write(path, buf, len, off, &fi) : ops->read(path, buf, len, off, &fi);
+			record(st, now_ns() - t);
+			check(res, write ? "write" : "read", path);
+			if(res == 0){
+				break;	//Read past the end, the file was never written
+			}
+		}
+		close_file(path, &fi);
+	}
+	free(buf);
+}
+
+//random_ops reads or writes of io_size at random offsets inside every file
+void run_random(struct bench_stats *st, int write){
+	struct fuse_file_info fi;
+	struct stat stbuf;
+	char path[PATH_BYTES];
+	char *buf = malloc(cfg.io_size);
+	uint64_t t;
+	long span;
+	long off;
+	long i;
+	long k;
+	int res;
+
+	memset(buf, 'y', cfg.io_size);
+	for(i = 0; i < cfg.files; i++){
+		file_path(path, i);
+		check(ops->getattr(path, &stbuf), "getattr", path);
+		span = stbuf.st_size > cfg.io_size ? stbuf.st_size - cfg.io_size : 0;
+		open_file(path, &fi);
+		for(k = 0; k < cfg.random_ops; k++){
+			off = span > 0 ? (long)(rand_r(&seed) % (span + 1)) : 0;
+			t = now_ns();
+			res = write ? ops->write(path, buf, cfg.io_size, off, &fi) : ops->read(path, buf, cfg.io_size, off, &fi);
+			record(st, now_ns() - t);
+			check(res, write ? "write" : "read", path);
+		}
+		close_file(path, &fi);
+	}
+	free(buf);
+}
+
+void run_stat(struct bench_stats *st){
+	struct stat stbuf;
+	char path[PATH_BYTES];
+	uint64_t t;
+	long r;
+	long i;
+
+	for(r = 0; r < cfg.rounds; r++){
+		for(i = 0; i < cfg.files; i++){
+			file_path(path, i);
+			t = now_ns();
+			check(ops->getattr(path, &stbuf), "getattr", path);
+			record(st, now_ns() - t);
+		}
+	}
+}
+
+void run_readdir(struct bench_stats *st){
+	char path[PATH_BYTES];
+	uint64_t t;
+	long entries;
+	long r;
+	long d;
+
+	for(r = 0; r < cfg.rounds; r++){
+		for(d = 0; d < num_dirs(); d++){
+			dir_path(path, d);
+			entries = 0;
+			t = now_ns();
+			check(ops->readdir(path, &entries, count_entry, 0, NULL), "readdir", path);
+			record(st, now_ns() - t);
+		}
+	}
+}
+
+//Unmount and mount again, each file still has to be there afterwards.
+//With -o log_level=4 the log thread is restarted every round and the
+//missing name gives it a message to write each time.
+void run_remount(struct bench_stats *st){
+	struct stat stbuf;
+	char path[PATH_BYTES];
+	uint64_t t;
+	long r;
+	long i;
+
+	snprintf(path, PATH_BYTES, "%s/nothere", prefix);
+	for(r = 0; r < cfg.rounds; r++){
+		t = now_ns();
+		ops->destroy(NULL);
+		ops->init(NULL);
+		record(st, now_ns() - t);
+		if(ops->getattr(path, &stbuf) != -ENOENT){
+			fprintf(stderr, "getattr %s: found after remount\n", path);
+			exit(1);
+		}
+	}
+	for(i = 0; i < cfg.files; i++){
+		file_path(path, i);
+		check(ops->getattr(path, &stbuf), "getattr", path);
+	}
+}
+
+void run_unlink(struct bench_stats *st){
+	char path[PATH_BYTES];
+	uint64_t t;
+	long i;
+
+	for(i = 0; i < cfg.files; i++){
+		file_path(path, i);
+		t = now_ns();
+		check(ops->unlink(path), "unlink", path);
+		record(st, now_ns() - t);
+	}
+	for(i = 0; i < num_dirs(); i++){
+		dir_path(path, i);
+		check(ops->rmdir(path), "rmdir", path);
+	}
+	make_prefix(1);
+}
+
+int run_workload(const char *name){
+	struct bench_stats st = { NULL, 0, 0 };
+	uint64_t t = now_ns();
+
+	if(strcmp(name, "create") == 0){
+		run_create(&st);
+	}
+	else if(strcmp(name, "write") == 0){
+		run_sequential(&st, 1);
+	}
+	else if(strcmp(name, "read") == 0){
+		run_sequential(&st, 0);
+	}
+	else if(strcmp(name, "randwrite") == 0){
+		run_random(&st, 1);
+	}
+	else if(strcmp(name, "randread") == 0){
+		run_random(&st, 0);
+	}
+	else if(strcmp(name, "stat") == 0){
+		run_stat(&st);
+	}
+	else if(strcmp(name, "readdir") == 0){
+		run_readdir(&st);
+	}
+	else if(strcmp(name, "remount") == 0){
+		run_remount(&st);
+	}
+	else if(strcmp(name, "unlink") == 0){
+		run_unlink(&st);
+	}
+	else{
+		fprintf(stderr, "Unknown workload %s\n", name);
+		return -1;
+	}
+	report(name, &st, now_ns() - t);
+	free(st.ns);
+	return 0;
+}
+
+//Mount options in the -o name=value,... form the real mount takes
+int parse_options(char *opts){
+	char *opt;
+	char *save;
+	unsigned long value;
+
+	for(opt = strtok_r(opts, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)){
+		if(sscanf(opt, "cache_blocks=%lu", &value) == 1){
+			options.cache_blocks = value;
+		}
+		else if(sscanf(opt, "readahead=%lu", &value) == 1){
+			options.readahead = value;
+		}
+		else if(sscanf(opt, "dirty_kb=%lu", &value) == 1){
+			options.dirty_kb = value;
+		}
+		else if(sscanf(opt, "dirty_age=%lu", &value) == 1){
+			options.dirty_age = value;
+		}
+		else if(sscanf(opt, "log_level=%lu", &value) == 1){
+			options.log_level = value;
+		}
+		else{
+			fprintf(stderr, "Unknown option %s\n", opt);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//Create the image at disk_path, or a temporary one if it is empty. An
+//existing image is only ever grown.
+int make_image(int *temporary){
+	struct stat st;
+	int fd;
+	int res;
+
+	*temporary = disk_path[0] == '\0';
+	if(*temporary){
+		strcpy(disk_path, "/tmp/cs1550_bench.XXXXXX");
+		fd = mkstemp(disk_path);
+	}
+	else{
+		fd = open(disk_path, O_RDWR | O_CREAT, 0644);
+	}
+	if(fd < 0){
+		perror(disk_path);
+		return -1;
+	}
+	if(fstat(fd, &st) != 0 || (st.st_size < DISK_BYTES && ftruncate(fd, DISK_BYTES) != 0)){
+		perror(disk_path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if(block_size > 0){
+		res = cs1550_mkfs(block_size, DISK_BYTES, 1, stderr);
+		if(res != 0){
+			fprintf(stderr, "%s: %s\n", disk_path, strerror(-res));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void usage(const char *prog){
+	fprintf(stderr, "Usage: %s [-d image] [-n files] [-s bytes] [-b bytes] [-r count] [-i count] [-p files] [-D depth] [-o opts] [-B bytes] [workload...]\n", prog);
+	fprintf(stderr, "Workloads: create write read randwrite randread stat readdir unlink\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *all[] = { "create", "write", "read", "randwrite", "randread", "stat", "readdir", "remount", "unlink" };
+	char image[PATH_MAX] = "";
+	int temporary;
+	int res = 0;
+	int c;
+	int i;
+
+	while((c = getopt(argc, argv, "d:n:s:b:r:i:p:D:o:B:h")) != -1){
+		switch(c){
+		case 'd':
+			snprintf(image, sizeof(image), "%s", optarg);
+			break;
+		case 'n':
+			cfg.files = atol(optarg);
+			break;
+		case 's':
+			cfg.file_size = atol(optarg);
+			break;
+		case 'b':
+			cfg.io_size = atol(optarg);
+			break;
+		case 'r':
+			cfg.random_ops = atol(optarg);
+			break;
+		case 'i':
+			cfg.rounds = atol(optarg);
+			break;
+		case 'p':
+			cfg.per_dir = atol(optarg);
+			break;
+		case 'D':
+			cfg.depth = atol(optarg);
+			break;
+		case 'o':
+			if(parse_options(optarg) != 0){
+				return 1;
+			}
+			break;
+		case 'B':
+			block_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(cfg.files <= 0 || cfg.file_size < 0 || cfg.io_size <= 0 || cfg.per_dir <= 0 || cfg.per_dir > 100000
+		|| cfg.depth < 0 || cfg.depth > MAX_DEPTH){
+		usage(argv[0]);
+		return 1;
+	}
+	for(i = 0; i < cfg.depth; i++){
+		sprintf(prefix + 4 * i, "/d%02d", i + 1);
+	}
+
+	//The handlers open the image by absolute path
+	disk_path[0] = '\0';
+	if(image[0] != '\0' && realpath(image, disk_path) == NULL){
+		if(image[0] == '/'){
+			snprintf(disk_path, sizeof(disk_path), "%s", image);
+		}
+		else if(getcwd(disk_path, sizeof(disk_path) - strlen(image) - 2) != NULL){
+			strcat(disk_path, "/");
+			strcat(disk_path, image);
+		}
+	}
+	if(make_image(&temporary) != 0){
+		return 1;
+	}
+
+	ops = cs1550_operations();
+	ops->init(NULL);
+	printf("%-10s %8s %12s %9s %9s %9s %9s\n", "workload", "ops", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+	if(optind < argc){
+		for(i = optind; i < argc && res == 0; i++){
+			res = run_workload(argv[i]);
+		}
+	}
+	else{
+		for(i = 0; i < (int)(sizeof(all) / sizeof(all[0])) && res == 0; i++){
+			res = run_workload(all[i]);
+		}
+	}
+	ops->destroy(NULL);
+
+	if(temporary){
+		unlink(disk_path);
+	}
+	return res != 0;
+}
@@ -0,0 +1,57 @@
+/*
+	Checks a cs1550 disk image that is not mounted: the superblock and the
+	copy it names, the journal record, every directory from the root down
+	with its index blocks, the runs of every file and the free-space
+	accounting in the group table and bitmaps. Only metadata is read, in
+	one pass.
+
+	Build:
+		gcc -Wall -DCS1550_LIBRARY `pkg-config fuse --cflags` -c cs1550.c -o cs1550_lib.o
+		gcc -Wall `pkg-config fuse --cflags` cs1550_fsck.c cs1550_lib.o -o cs1550_fsck -lpthread
+
+	Usage: cs1550_fsck [-n | -p | -y] image
+		-n		check only, nothing is written (default)
+		-p		fix the free-space accounting, file sizes and start blocks
+		-y		also remove entries that cannot be fixed: bad names,
+				duplicates, entries in the wrong leaf, damaged index
+				entries, files whose runs are out of range or shared,
+				directories whose block is unreadable
+
+	Repairs are written as ordinary commits, so an interrupted run leaves
+	the image as consistent as it found it. The exit status is that of
+	fsck(8): 0 clean, 1 problems fixed, 4 problems left, 8 unable to check.
+*/
+
+#include "cs1550.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+	int mode = CS1550_FSCK_CHECK;
+	int c;
+
+	while((c = getopt(argc, argv, "npyh")) != -1){
+		switch(c){
+		case 'n':
+			mode = CS1550_FSCK_CHECK;
+			break;
+		case 'p':
+			mode = CS1550_FSCK_PREEN;
+			break;
+		case 'y':
+			mode = CS1550_FSCK_REPAIR;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n | -p | -y] image\n", argv[0]);
+			return 8;
+		}
+	}
+	if(optind != argc - 1){
+		fprintf(stderr, "Usage: %s [-n | -p | -y] image\n", argv[0]);
+		return 8;
+	}
+	snprintf(disk_path, sizeof(disk_path), "%s", argv[optind]);
+	return cs1550_fsck(mode, stdout);
+}
@@ -0,0 +1,761 @@
+/*
+	Frontend for the cs1550 filesystem on the FUSE low-level API. The kernel
+	names everything by inode number here, so a lookup resolves one name in
+	a directory the kernel already holds instead of the core walking the
+	whole path from the root on every call, and the kernel keeps the answer,
+	missing names included, in its dentry cache. It serves the same image
+	as the path-based cs1550, one or the other at a time, with the same
+	operations: files and directories are created, removed and renamed here
+	too.
+
+	Every inode the kernel has looked up is a node, remembered until the
+	kernel forgets it. A directory's number is its first block, the root's
+	FUSE_ROOT_ID; a file's is derived from its directory and name with the
+	top bit set. Either moves on to the next free number while the one it
+	would get still belongs to a removed node the kernel holds, and every
+	node gets a new generation, so a number used again is never mistaken
+	for the old inode.
+
+	Build:
+		gcc -Wall -DCS1550_LIBRARY `pkg-config fuse --cflags` -c cs1550.c -o cs1550_lib.o
+		gcc -Wall `pkg-config fuse --cflags` cs1550_ll.c cs1550_lib.o -o cs1550_ll `pkg-config fuse --libs` -lpthread
+
+	Usage: cs1550_ll [FUSE options] [-o cs1550 options] mountpoint
+		Takes the same -o options as cs1550 and uses the .disk image in the
+		directory it is started from.
+*/
+
+#include "cs1550.h"
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define LL_TIMEOUT 1.0			//Seconds the kernel may keep an entry or attributes
+#define LL_NAME_MAX 16			//An 8.3 name with its dot and terminator
+#define NODE_BUCKETS 4096
+
+#define FILE_INO ((fuse_ino_t)1 << (sizeof(fuse_ino_t) * 8 - 1))
+
+#define CS1550_OPT(t, p) { t, offsetof(struct cs1550_options, p), 1 }
+
+static struct fuse_opt ll_opts[] = {
+	CS1550_OPT("cache_blocks=%lu", cache_blocks),
+	CS1550_OPT("readahead=%lu", readahead),
+	CS1550_OPT("dirty_kb=%lu", dirty_kb),
+	CS1550_OPT("dirty_age=%lu", dirty_age),
+	CS1550_OPT("log_level=%lu", log_level),
+	FUSE_OPT_END
+};
+
+//A file or directory the kernel holds an inode for, in one chain by inode
+//number and, until it is removed, one by name
+struct ll_node
+{
+	fuse_ino_t ino;
+	unsigned long generation;
+	long dir;					//First block of the directory holding it
+	char name[LL_NAME_MAX];
+	long block;					//First block of a directory, -1 for a file
+	unsigned long nlookup;		//Lookups the kernel has not forgotten yet
+	int removed;				//Unlinked, removed or replaced by a rename
+	struct ll_node *next_ino;
+	struct ll_node *next_name;
+};
+
+static struct ll_node *nodes_by_ino[NODE_BUCKETS];
+static struct ll_node *nodes_by_name[NODE_BUCKETS];
+static unsigned long node_generation = 0;	//Last generation handed out
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct fuse_operations *ops;
+static long root_block;
+
+//Everything opendir() listed, handed out by readdir() a piece at a time
+struct ll_dirbuf
+{
+	char *p;
+	size_t size;
+	int err;
+	long dir;
+	fuse_req_t req;
+};
+
+//FNV-1a over the directory and the name
+static fuse_ino_t name_hash(long dir, const char *name){
+	uint64_t h = 14695981039346656037ULL;
+
+	h = (h ^ (uint64_t)dir) * 1099511628211ULL;
+	for(; *name != '\0'; name++){
+		h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+	}
+	return (fuse_ino_t)(((uint64_t)dir << 32) ^ h);
+}
+
+//Caller holds node_lock
+static struct ll_node *node_by_ino(fuse_ino_t ino){
+	struct ll_node *n;
+
+	for(n = nodes_by_ino[ino % NODE_BUCKETS]; n != NULL && n->ino != ino; n = n->next_ino);
+	return n;
+}
+
+//Caller holds node_lock
+static struct ll_node *node_by_name(long dir, const char *name){
+	struct ll_node *n;
+
+	for(n = nodes_by_name[name_hash(dir, name) % NODE_BUCKETS]; n != NULL; n = n->next_name){
+		if(n->dir == dir && strcmp(n->name, name) == 0){
+			break;
+		}
+	}
+	return n;
+}
+
+static void name_link(struct ll_node *n){
+	struct ll_node **head = &nodes_by_name[name_hash(n->dir, n->name) % NODE_BUCKETS];
+
+	n->next_name = *head;
+	*head = n;
+}
+
+static void name_unlink(struct ll_node *n){
+	struct ll_node **pn;
+
+	for(pn = &nodes_by_name[name_hash(n->dir, n->name) % NODE_BUCKETS]; *pn != n; pn = &(*pn)->next_name);
+	*pn = n->next_name;
+}
+
+//Take a removed name out of the table, its node stays until forgotten.
+//Caller holds node_lock.
+static void node_drop_name(long dir, const char *name){
+	struct ll_node *n = node_by_name(dir, name);
+
+	if(n != NULL){
+		name_unlink(n);
+		n->removed = 1;
+	}
+}
+
+/*
+ * The inode number of the entry called name in dir, block being the first
+ * block of a directory or -1 for a file. Lookup and readdir both go
+ * through here, so a listing reports the number a lookup hands out.
+ * Caller holds node_lock.
+ */
+static fuse_ino_t node_ino(long dir, const char *name, long block){
+	struct ll_node *n = node_by_name(dir, name);
+	fuse_ino_t ino;
+
+	if(n != NULL && n->block == block){
+		return n->ino;
+	}
+	ino = block >= 0 ? (fuse_ino_t)block : name_hash(dir, name) | FILE_INO;
+	while(ino == FUSE_ROOT_ID || node_by_ino(ino) != NULL){
+		ino = block >= 0 ? (ino + 1) & ~FILE_INO : (ino + 1) | FILE_INO;
+	}
+	return ino;
+}
+
+//Count a lookup of an entry, making it a node the first time. Returns its
+//number and generation, 0 if out of memory.
+static fuse_ino_t node_ref(long dir, const char *name, long block, unsigned long *generation){
+	struct ll_node *n;
+	fuse_ino_t ino;
+
+	pthread_mutex_lock(&node_lock);
+	n = node_by_name(dir, name);
+	if(n != NULL && n->block != block){
+		name_unlink(n);		//Replaced by something else since
+		n->removed = 1;
+		n = NULL;
+	}
+	if(n == NULL && (n = calloc(1, sizeof(struct ll_node))) != NULL){
+		ino = node_ino(dir, name, block);
+		n->ino = ino;
+		n->generation = ++node_generation;
+		n->dir = dir;
+		snprintf(n->name, sizeof(n->name), "%s", name);
+		n->block = block;
+		n->next_ino = nodes_by_ino[ino % NODE_BUCKETS];
+		nodes_by_ino[ino % NODE_BUCKETS] = n;
+		name_link(n);
+	}
+	if(n != NULL){
+		n->nlookup++;
+		*generation = n->generation;
+	}
+	ino = n != NULL ? n->ino : 0;
+	pthread_mutex_unlock(&node_lock);
+	return ino;
+}
+
+//Drop count lookups of a node, freeing it once the kernel holds none
+static void node_forget(fuse_ino_t ino, unsigned long count){
+	struct ll_node **pn;
+	struct ll_node *n;
+
+	pthread_mutex_lock(&node_lock);
+	n = node_by_ino(ino);
+	if(n != NULL){
+		n->nlookup = count < n->nlookup ? n->nlookup - count : 0;
+	}
+	if(n != NULL && n->nlookup == 0){
+		for(pn = &nodes_by_ino[ino % NODE_BUCKETS]; *pn != n; pn = &(*pn)->next_ino);
+		*pn = n->next_ino;
+		if(!n->removed){
+			name_unlink(n);
+		}
+		free(n);
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+//A copy of the node for ino, -ESTALE once forgotten or removed. The root
+//has no node and comes back as a directory with no parent.
+static int node_get(fuse_ino_t ino, struct ll_node *copy){
+	struct ll_node *n;
+
+	if(ino == FUSE_ROOT_ID){
+		memset(copy, 0, sizeof(*copy));
+		copy->ino = FUSE_ROOT_ID;
+		copy->dir = -1;
+		copy->block = root_block;
+		return 0;
+	}
+	pthread_mutex_lock(&node_lock);
+	n = node_by_ino(ino);
+	if(n != NULL && !n->removed){
+		*copy = *n;
+	}
+	pthread_mutex_unlock(&node_lock);
+	return n != NULL && !n->removed ? 0 : -ESTALE;
+}
+
+//First block of the directory ino
+static int node_dir(fuse_ino_t ino, long *block){
+	struct ll_node n;
+	int res = node_get(ino, &n);
+
+	if(res == 0 && n.block < 0){
+		res = -ENOTDIR;
+	}
+	*block = n.block;
+	return res;
+}
+
+//Attributes of ino as the disk has them now. An entry that is gone or is
+//no longer what the node says is stale.
+static int node_stat(fuse_ino_t ino, struct stat *st){
+	struct ll_node n;
+	int res = node_get(ino, &n);
+
+	memset(st, 0, sizeof(*st));
+	if(res == 0 && n.dir < 0){
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+	}
+	else if(res == 0){
+		res = cs1550_stat_entry(n.dir, n.name, st);
+		if(res == -ENOENT || (res == 0 && (n.block >= 0 ? !S_ISDIR(st->st_mode) || (long)st->st_ino != n.block : S_ISDIR(st->st_mode)))){
+			res = -ESTALE;
+		}
+	}
+	st->st_ino = ino;
+	return res;
+}
+
+static void node_clear(void){
+	struct ll_node *n;
+	int i;
+
+	for(i = 0; i < NODE_BUCKETS; i++){
+		while((n = nodes_by_ino[i]) != NULL){
+			nodes_by_ino[i] = n->next_ino;
+			free(n);
+		}
+		nodes_by_name[i] = NULL;
+	}
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn){
+	(void) userdata;
+
+	ops->init(conn);
+	root_block = cs1550_root_block();
+}
+
+static void ll_destroy(void *userdata){
+	(void) userdata;
+
+	ops->destroy(NULL);
+	node_clear();
+}
+
+//Fill in e for name in dir, counting it as a lookup by the kernel
+static int make_entry(long dir, const char *name, struct fuse_entry_param *e){
+	int res;
+
+	memset(e, 0, sizeof(*e));
+	res = cs1550_stat_entry(dir, name, &e->attr);
+	if(res != 0){
+		return res;
+	}
+	e->ino = node_ref(dir, name, S_ISDIR(e->attr.st_mode) ? (long)e->attr.st_ino : -1, &e->generation);
+	if(e->ino == 0){
+		return -ENOMEM;
+	}
+	e->attr.st_ino = e->ino;
+	e->attr_timeout = LL_TIMEOUT;
+	e->entry_timeout = LL_TIMEOUT;
+	return 0;
+}
+
+static void reply_entry(fuse_req_t req, long dir, const char *name){
+	struct fuse_entry_param e;
+	int res = make_entry(dir, name, &e);
+
+	if(res != 0){
+		fuse_reply_err(req, -res);
+	}
+	else if(fuse_reply_entry(req, &e) != 0){
+		node_forget(e.ino, 1);	//The kernel never got it
+	}
+}
+
+/*
+ * One name in a directory. A missing name is answered with inode 0, which
+ * the kernel caches as a negative entry for the timeout, so a repeated
+ * stat of something that is not there never reaches us.
+ */
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+	struct fuse_entry_param e;
+	long dir;
+	int res = node_dir(parent, &dir);
+
+	if(res == 0){
+		res = make_entry(dir, name, &e);
+	}
+	if(res == -ENOENT){
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = LL_TIMEOUT;
+		fuse_reply_entry(req, &e);
+	}
+	else if(res != 0){
+		fuse_reply_err(req, -res);
+	}
+	else if(fuse_reply_entry(req, &e) != 0){
+		node_forget(e.ino, 1);
+	}
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup){
+	if(ino != FUSE_ROOT_ID){
+		node_forget(ino, nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	struct stat st;
+	int res = node_stat(ino, &st);
+
+	(void) fi;
+
+	if(res != 0){
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+//Only the size can be set, by the core truncate the path frontend uses too.
+//Times are not kept and are ignored, modes and owners are fixed.
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi){
+	struct ll_node n;
+	struct stat st;
+	int res = node_stat(ino, &st);
+
+	(void) fi;
+
+	if(res == 0 && (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) != 0){
+		res = -EPERM;
+	}
+	if(res == 0 && (to_set & FUSE_SET_ATTR_SIZE) != 0){
+		res = S_ISDIR(st.st_mode) ? -EISDIR : node_get(ino, &n);
+		if(res == 0){
+			res = cs1550_truncate_entry(n.dir, n.name, attr->st_size);
+		}
+		if(res == 0){
+			res = node_stat(ino, &st);
+		}
+	}
+	if(res != 0){
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+//Only regular files can be stored
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev){
+	long dir;
+	int res = node_dir(parent, &dir);
+
+	(void) rdev;
+
+	if(res == 0 && !S_ISREG(mode)){
+		res = -EPERM;
+	}
+	if(res == 0){
+		res = cs1550_mknod_entry(dir, name);
+	}
+	if(res != 0){
+		fuse_reply_err(req, -res);
+		return;
+	}
+	reply_entry(req, dir, name);
+}
+
+//Make and open a file in one go, for open() with O_CREAT
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi){
+	struct fuse_entry_param e;
+	long dir;
+	int res = node_dir(parent, &dir);
+
+	(void) mode;
+
+	if(res == 0){
+		res = cs1550_mknod_entry(dir, name);
+		if(res == -EEXIST && (fi->flags & O_EXCL) == 0){
+			//Made by someone else in the meantime, and cut like open() would
+			res = (fi->flags & O_TRUNC) != 0 ? cs1550_truncate_entry(dir, name, 0) : 0;
+		}
+	}
+	if(res == 0){
+		res = cs1550_open_entry(dir, name, fi);
+	}
+	if(res == 0){
+		res = make_entry(dir, name, &e);
+		if(res != 0){
+			ops->release(NULL, fi);
+		}
+	}
+	if(res != 0){
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if(fuse_reply_create(req, &e, fi) != 0){
+		ops->release(NULL, fi);
+		node_forget(e.ino, 1);
+	}
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+	long dir;
+	int res = node_dir(parent, &dir);
+
+	(void) mode;
+
+	if(res == 0){
+		res = cs1550_mkdir_entry(dir, name);
+	}
+	if(res != 0){
+		fuse_reply_err(req, -res);
+		return;
+	}
+	reply_entry(req, dir, name);
+}
+
+//unlink and rmdir, the node of what was removed goes stale
+static void remove_entry(fuse_req_t req, fuse_ino_t parent, const char *name, int (*fn)(long dir, const char *name)){
+	long dir;
+	int res = node_dir(parent, &dir);
+
+	if(res == 0){
+		res = fn(dir, name);
+	}
+	if(res == 0){
+		pthread_mutex_lock(&node_lock);
+		node_drop_name(dir, name);
+		pthread_mutex_unlock(&node_lock);
+	}
+	fuse_reply_err(req, -res);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+	remove_entry(req, parent, name, cs1550_unlink_entry);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+	remove_entry(req, parent, name, cs1550_rmdir_entry);
+}
+
+//Move the node with its entry, a node at the new name was replaced
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname){
+	struct ll_node *n;
+	long dir;
+	long new_dir = -1;
+	int res = node_dir(parent, &dir);
+
+	if(res == 0){
+		res = node_dir(newparent, &new_dir);
+	}
+	if(res == 0){
+		res = cs1550_rename_entry(dir, name, new_dir, newname);
+	}
+	if(res == 0 && (dir != new_dir || strcmp(name, newname) != 0)){
+		pthread_mutex_lock(&node_lock);
+		node_drop_name(new_dir, newname);
+		n = node_by_name(dir, name);
+		if(n != NULL){
+			name_unlink(n);
+			n->dir = new_dir;
+			snprintf(n->name, sizeof(n->name), "%s", newname);
+			name_link(n);
+		}
+		pthread_mutex_unlock(&node_lock);
+	}
+	fuse_reply_err(req, -res);
+}
+
+//Append one entry to a listing
+static int dirbuf_put(struct ll_dirbuf *b, const char *name, fuse_ino_t ino, mode_t mode){
+	struct stat st;
+	size_t old = b->size;
+	char *p;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = mode;
+	b->size += fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+	p = realloc(b->p, b->size);
+	if(p == NULL){
+		b->err = ENOMEM;
+		return 1;
+	}
+	b->p = p;
+	fuse_add_direntry(b->req, b->p + old, b->size - old, name, &st, b->size);
+	return 0;
+}
+
+//Append an entry the core listed, with the number a lookup would give it
+static int dirbuf_add(void *arg, const char *name, const struct stat *st){
+	struct ll_dirbuf *b = arg;
+	fuse_ino_t ino;
+
+	pthread_mutex_lock(&node_lock);
+	ino = node_ino(b->dir, name, S_ISDIR(st->st_mode) ? (long)st->st_ino : -1);
+	pthread_mutex_unlock(&node_lock);
+	return dirbuf_put(b, name, ino, st->st_mode);
+}
+
+/*
+ * List the whole directory once at open, each entry with its attributes.
+ * The core puts every name it lists in its name index on the way, so the
+ * lookups that usually follow a listing are answered without reading the
+ * directory again.
+ */
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	struct ll_dirbuf *b;
+	struct stat st;
+	int res;
+
+	res = node_stat(ino, &st);
+	if(res == 0 && !S_ISDIR(st.st_mode)){
+		res = -ENOTDIR;
+	}
+	b = res == 0 ? calloc(1, sizeof(struct ll_dirbuf)) : NULL;
+	if(res == 0 && b == NULL){
+		res = -ENOMEM;
+	}
+	if(res == 0){
+		b->req = req;
+		node_dir(ino, &b->dir);
+		dirbuf_put(b, ".", ino, S_IFDIR);
+		dirbuf_put(b, "..", FUSE_ROOT_ID, S_IFDIR);	//Parents are not tracked, the kernel resolves .. itself
+		res = b->err != 0 ? -b->err : cs1550_list_dir(b->dir, dirbuf_add, b);
+		if(res == 0 && b->err != 0){
+			res = -b->err;
+		}
+		if(res != 0){
+			free(b->p);
+			free(b);
+		}
+	}
+	if(res != 0){
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fi->fh = (uintptr_t)b;
+	if(fuse_reply_open(req, fi) != 0){
+		free(b->p);
+		free(b);
+	}
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi){
+	struct ll_dirbuf *b = (struct ll_dirbuf *)(uintptr_t)fi->fh;
+
+	(void) ino;
+
+	if((size_t)off < b->size){
+		fuse_reply_buf(req, b->p + off, b->size - off < size ? b->size - off : size);
+	}
+	else{
+		fuse_reply_buf(req, NULL, 0);
+	}
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	struct ll_dirbuf *b = (struct ll_dirbuf *)(uintptr_t)fi->fh;
+
+	(void) ino;
+
+	free(b->p);
+	free(b);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	struct ll_node n;
+	int res = node_get(ino, &n);
+
+	if(res == 0 && n.block >= 0){
+		res = -EISDIR;
+	}
+	if(res == 0){
+		res = cs1550_open_entry(n.dir, n.name, fi);
+	}
+	if(res != 0){
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if(fuse_reply_open(req, fi) != 0){
+		ops->release(NULL, fi);
+	}
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi){
+	char *buf = malloc(size > 0 ? size : 1);
+	int res;
+
+	(void) ino;
+
+	if(buf == NULL){
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	res = ops->read(NULL, buf, size, off, fi);
+	if(res < 0){
+		fuse_reply_err(req, -res);
+	}
+	else{
+		fuse_reply_buf(req, buf, res);
+	}
+	free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi){
+	int res = ops->write(NULL, buf, size, off, fi);
+
+	(void) ino;
+
+	if(res < 0){
+		fuse_reply_err(req, -res);
+	}
+	else{
+		fuse_reply_write(req, res);
+	}
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	(void) ino;
+
+	fuse_reply_err(req, -ops->flush(NULL, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	(void) ino;
+
+	fuse_reply_err(req, -ops->release(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi){
+	(void) ino;
+
+	fuse_reply_err(req, -ops->fsync(NULL, datasync, fi));
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+	.init = ll_init,
+	.destroy = ll_destroy,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.mknod = ll_mknod,
+	.create = ll_create,
+	.mkdir = ll_mkdir,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.rename = ll_rename,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.releasedir = ll_releasedir,
+	.open = ll_open,
+	.read = ll_read,
+	.write = ll_write,
+	.flush = ll_flush,
+	.release = ll_release,
+	.fsync = ll_fsync,
+};
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char path[PATH_MAX];
+	char *mountpoint = NULL;
+	int multithreaded = 0;
+	int foreground = 0;
+	int res = -1;
+
+	ops = cs1550_operations();
+
+	//Pick out our own -o options and pass the rest on to FUSE
+	if(fuse_opt_parse(&args, &options, ll_opts, NULL) == -1){
+		return 1;
+	}
+
+	//Daemonizing changes to /, so pin down the image first
+	if(realpath(disk_path, path) != NULL){
+		strcpy(disk_path, path);
+	}
+
+	if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1
+		&& (ch = fuse_mount(mountpoint, &args)) != NULL){
+		se = fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+		if(se != NULL){
+			if(fuse_set_signal_handlers(se) != -1){
+				fuse_session_add_chan(se, ch);
+				if(foreground || daemon(0, 0) == 0){
+					res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				}
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return res == -1 ? 1 : 0;
+}
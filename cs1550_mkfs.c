@@ -0,0 +1,89 @@
+/*
+	Lays out an empty cs1550 filesystem on a disk image: both superblock
+	slots with the geometry, an empty root and allocation bitmaps with
+	every data block free in both copies. The image is created, or grown to the volume size,
+	as needed.
+
+	Build:
+		gcc -Wall -DCS1550_LIBRARY `pkg-config fuse --cflags` -c cs1550.c -o cs1550_lib.o
+		gcc -Wall `pkg-config fuse --cflags` cs1550_mkfs.c cs1550_lib.o -o cs1550_mkfs -lpthread
+
+	Usage: cs1550_mkfs [-f] [-b block_size] [-s bytes] image
+		-f		format even if the image already holds a filesystem
+		-b		block size, a power of two from 512 to 65536 (default 512)
+		-s		volume size in bytes, k, m and g suffixes allowed (default 5000000)
+*/
+
+#include "cs1550.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define USAGE "Usage: %s [-f] [-b block_size] [-s bytes] image\n"
+
+//Bytes in a size like 64m, or -1
+long parse_size(const char *s)
+{
+	char *end;
+	long n = strtol(s, &end, 10);
+
+	switch(*end){
+	case 'g': case 'G':
+		n *= 1024;
+		//fallthrough
+	case 'm': case 'M':
+		n *= 1024;
+		//fallthrough
+	case 'k': case 'K':
+		n *= 1024;
+		end++;
+		break;
+	}
+	return end == s || *end != '\0' || n <= 0 ? -1 : n;
+}
+
+int main(int argc, char *argv[])
+{
+	int force = 0;
+	long block_size = 512;
+	long volume_bytes = 0;
+	int res;
+	int c;
+
+	while((c = getopt(argc, argv, "fb:s:h")) != -1){
+		switch(c){
+		case 'f':
+			force = 1;
+			break;
+		case 'b':
+			block_size = parse_size(optarg);
+			break;
+		case 's':
+			volume_bytes = parse_size(optarg);
+			break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			return 1;
+		}
+	}
+	if(optind != argc - 1 || block_size <= 0 || block_size > INT_MAX || volume_bytes < 0){
+		fprintf(stderr, USAGE, argv[0]);
+		return 1;
+	}
+	snprintf(disk_path, sizeof(disk_path), "%s", argv[optind]);
+
+	res = cs1550_mkfs(block_size, volume_bytes, force, stdout);
+	if(res == -EEXIST){
+		fprintf(stderr, "%s already holds a filesystem, use -f to format it anyway\n", disk_path);
+		return 1;
+	}
+	if(res != 0){
+		fprintf(stderr, "%s: %s\n", disk_path, res == -EINVAL ? "block size is not a power of two from 512 to 65536"
+			: res == -ENOSPC ? "volume too small for the metadata" : strerror(-res));
+		return 1;
+	}
+	return 0;
+}